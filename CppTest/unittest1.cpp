@@ -3,40 +3,62 @@
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
 #include "../RayTracingWeekend/material.h"
+#include "../RayTracingWeekend/sphere.h"
+#include "../RayTracingWeekend/hittable_list.h"
+#include "../RayTracingWeekend/bvh.h"
+#include "../RayTracingWeekend/light_bvh.h"
+#include "../RayTracingWeekend/restir.h"
+#include "../RayTracingWeekend/environment.h"
+#include "../RayTracingWeekend/guiding.h"
+#include "../RayTracingWeekend/instance.h"
+#include "../RayTracingWeekend/triangle_mesh.h"
 
 #include <ppl.h>
 using namespace concurrency;
 
 namespace CppTest
-{		
+{
+	// tolerances scale with the precision geometry is built in
+	const real epsilon = std::numeric_limits<real>::epsilon();
+		
 	TEST_CLASS(_vec3)
 	{
 	public:		
 		TEST_METHOD(_size)
 		{
-			Assert::AreEqual(sizeof(vec3), 3 * sizeof(float));
+#if defined(_M_X64) && !defined(VEC3_SIMD)
+			// CppTest builds with /arch:AVX as the renderer does, so the vec3 it ships is the one tested
+			Assert::IsTrue(false, L"CppTest built without the SIMD vec3");
+#endif
+#ifdef VEC3_SIMD
+			// one SSE register, 4th lane is padding
+			Assert::AreEqual(sizeof(vec3_t<float>), sizeof(__m128));
+#else
+			Assert::AreEqual(sizeof(vec3_t<float>), 3 * sizeof(float));
+#endif
+			Assert::AreEqual(sizeof(vec3_t<double>), 3 * sizeof(double));
 		}
 
 		TEST_METHOD(_dot)
 		{
 			auto d = dot(vec3(1, 1, 0), vec3(1, 1, 0));
-			Assert::AreEqual(d, 2.0);
+			Assert::AreEqual(d, real(2));
 		}
 
 		TEST_METHOD(_cross)
 		{
 			auto c = cross(vec3(1, 0, 0), vec3(0, 1, 0));
-			Assert::AreEqual(c.x, 0.0);
-			Assert::AreEqual(c.y, 0.0);
-			Assert::AreEqual(c.z, 1.0);
+			Assert::AreEqual(c.x, real(0));
+			Assert::AreEqual(c.y, real(0));
+			Assert::AreEqual(c.z, real(1));
 		}
 
 		TEST_METHOD(_ctor)
 		{
 			auto r = ray(vec3(1, 1, 1), vec3(2, 2, 2), 0.0);
-			Assert::AreEqual(r.point_at_parameter(3).x, 7.0);
-			Assert::AreEqual(r.point_at_parameter(3).y, 7.0);
-			Assert::AreEqual(r.point_at_parameter(3).z, 7.0);
+			Assert::AreEqual(r.point_at_parameter(3).x, real(7));
+			Assert::AreEqual(r.point_at_parameter(3).y, real(7));
+			Assert::AreEqual(r.point_at_parameter(3).z, real(7));
 		}
 	};
 
@@ -64,6 +86,349 @@ namespace CppTest
 			Assert::AreEqual(distribution.min(), 0.0);
 			Assert::AreEqual(distribution.max(), 1.0);
 		}
+
+		TEST_METHOD(_rng)
+		{
+			// same pixel and sample draw the same sequence, whatever traced it before
+			rng a = rng::for_sample(7, 3), b = rng::for_sample(7, 3);
+			for (int i = 0; i < 100; i++)
+			{
+				real u = a.uniform();
+				Assert::AreEqual(u, b.uniform());
+				Assert::IsTrue(u >= 0 && u < 1);
+			}
+
+			// neighbor pixels and samples do not
+			Assert::AreNotEqual(rng::for_sample(7, 3).next_uint(), rng::for_sample(8, 3).next_uint());
+			Assert::AreNotEqual(rng::for_sample(7, 3).next_uint(), rng::for_sample(7, 4).next_uint());
+		}
+
+		TEST_METHOD(_sampler)
+		{
+			// one sample per 1d stratum of a dimension over the samples of a pixel
+			const int spp = 64;
+			for (int type = 0; type < 3; type++)
+			{
+				std::vector<int> strata_1d(spp, 0), strata_2d(spp, 0);
+				for (int s = 0; s < spp; s++)
+				{
+					stratified_sampler stratified(spp);
+					halton_sampler halton(spp);
+					sobol_sampler sobol(spp);
+					sampler* samplers[] = { &stratified, &halton, &sobol };
+					sampler& g = *samplers[type];
+
+					g.start(42, s);
+					g.start_bounce(3);
+					real u = g.get_1d();
+					sample2 p = g.get_2d();
+					Assert::IsTrue(u >= 0 && u < 1 && p.u >= 0 && p.u < 1 && p.v >= 0 && p.v < 1);
+
+					strata_1d[static_cast<int>(u * spp)]++;
+					strata_2d[static_cast<int>(p.v * 8) * 8 + static_cast<int>(p.u * 8)]++;
+				}
+
+				// halton only stratifies per power of its base
+				if (type != 1)
+				{
+					for (int count : strata_1d)
+						Assert::AreEqual(count, 1);
+					for (int count : strata_2d)
+						Assert::AreEqual(count, 1);
+				}
+			}
+		}
+
+		TEST_METHOD(_pixel_estimate)
+		{
+			// x 1..4: mean 2.5, variance 5/3, y flat, z near black alternating 0 and 2e-4
+			pixel_estimate estimate;
+			Assert::AreEqual(estimate.relative_error(), std::numeric_limits<real>::max());
+			for (int i = 0; i < 4; i++)
+			{
+				estimate.add(vec3(real(i + 1), 5, i % 2 ? real(2e-4) : real(0)));
+				if (i == 0)
+					Assert::AreEqual(estimate.relative_error(), std::numeric_limits<real>::max());
+			}
+			Assert::AreEqual(estimate.count, 4);
+			Assert::AreEqual(estimate.sum.x, real(10));
+			Assert::AreEqual(estimate.mean.x, real(2.5), 4 * epsilon);
+			Assert::AreEqual(estimate.mean.y, real(5), 4 * epsilon);
+			Assert::AreEqual(estimate.m2.x / 3, real(5.0 / 3.0), 4 * epsilon);
+			Assert::AreEqual(estimate.m2.y, real(0));
+			// worst channel, sqrt(5/3 / 4) / 2.5
+			Assert::AreEqual(estimate.relative_error(), real(0.258199), real(1e-5));
+
+			// a near black channel is judged against adaptive_black_level, not its own mean of 1e-4
+			pixel_estimate dark;
+			for (int i = 0; i < 4; i++)
+				dark.add(vec3(1, 1, i % 2 ? real(2e-4) : real(0)));
+			Assert::AreEqual(dark.relative_error(), real(sqrt(4e-8 / 3 / 4) / adaptive_black_level), real(1e-5));
+
+			// black converges at once
+			pixel_estimate black;
+			black.add(vec3(0, 0, 0));
+			black.add(vec3(0, 0, 0));
+			Assert::AreEqual(black.relative_error(), real(0));
+		}
+	};
+
+	TEST_CLASS(_pdf)
+	{
+	public:
+		TEST_METHOD(_storage)
+		{
+			vec3 normal = normalize(vec3(1, 2, 3));
+			cosine_pdf reference(normal);
+
+			pdf_storage storage;
+			Assert::IsTrue(storage.get() == nullptr);
+			storage.emplace<cosine_pdf>(normal);
+
+			// mixture over stack pdfs, same value as each half when both are the same
+			mixture_pdf mixed(storage.get(), &reference);
+			independent_sampler g;
+			for (int i = 0; i < 100; i++)
+			{
+				vec3 direction = random_unit_vector(g);
+				Assert::AreEqual(storage.get()->value(direction), reference.value(direction));
+				Assert::AreEqual(mixed.value(direction), reference.value(direction), 16 * epsilon);
+			}
+
+			storage.reset();
+			Assert::IsTrue(storage.get() == nullptr);
+		}
+
+		TEST_METHOD(_alias_table)
+		{
+			alias_table table(std::vector<real>{ 1, 2, 0, 5 });
+			Assert::AreEqual(table.pmf(0), real(0.125));
+			Assert::AreEqual(table.pmf(2), real(0));
+
+			// frequencies follow the weights over evenly spaced u
+			const int n = 8000;
+			std::vector<int> counts(4, 0);
+			for (int i = 0; i < n; i++)
+				counts[table.sample((i + real(0.5)) / n)]++;
+			Assert::AreEqual(counts[0], 1000);
+			Assert::AreEqual(counts[1], 2000);
+			Assert::AreEqual(counts[2], 0);
+			Assert::AreEqual(counts[3], 5000);
+		}
+
+		TEST_METHOD(_light_bvh)
+		{
+			auto light = std::make_shared<diffuse_light>(std::make_shared<constant_texture>(vec3(4, 4, 4)));
+			std::vector<std::shared_ptr<hittable>> objects;
+			objects.push_back(std::make_shared<xz_rect>(-1, 1, -1, 1, 2, light));
+			objects.push_back(std::make_shared<xz_rect>(3, 4, -1, 1, 5, light));
+			objects.push_back(std::make_shared<xz_rect>(-6, -4, 2, 4, 3, light));
+			// emits upwards, away from o
+			objects.push_back(std::make_shared<flip_normals>(std::make_shared<xz_rect>(-1, 1, 4, 6, 2, light)));
+			light_bvh lights(objects, 0, 1);
+			vec3 o(0, 0, 0);
+
+			// probability of picking each light, from the pdf walk
+			std::vector<real> p(3);
+			real sum = 0;
+			for (size_t i = 0; i < 3; i++)
+			{
+				aabb box;
+				objects[i]->bounding_box(0, 1, box);
+				vec3 v = box.centroid() - o;
+				p[i] = lights.pdf_value(o, v) / objects[i]->pdf_value(o, v);
+				sum += p[i];
+			}
+			Assert::AreEqual(sum, real(1), real(1e-4));
+			Assert::AreEqual(lights.pdf_value(o, vec3(0, 2, 5)), real(0));
+
+			// sampled lights follow the same probability
+			independent_sampler g;
+			std::vector<int> counts(objects.size(), 0);
+			const int n = 20000;
+			for (int k = 0; k < n; k++)
+			{
+				g.start(0, k);
+				ray r(o, lights.random(o, g), 0);
+				hit_record rec;
+				if (lights.hit(r, 0.001f, std::numeric_limits<real>::max(), rec))
+					for (size_t i = 0; i < objects.size(); i++)
+						if (rec.object == objects[i].get())
+							counts[i]++;
+			}
+			for (size_t i = 0; i < 3; i++)
+				Assert::AreEqual(real(counts[i]) / n, p[i], real(0.02));
+			Assert::AreEqual(counts[3], 0);
+
+			// power is area times emitted luminance, an object listed only to be sampled (glass) is never picked
+			auto glass = std::make_shared<sphere>(vec3(5, 6, 0), 1, std::make_shared<dielectric>(1.5));
+			Assert::AreEqual(objects[1]->power(), objects[0]->power() / 2, epsilon * objects[0]->power());
+			Assert::AreEqual(glass->power(), real(0));
+			light_bvh with_glass(std::vector<std::shared_ptr<hittable>>{ objects[0], glass }, 0, 1);
+			Assert::AreEqual(with_glass.pdf_value(o, vec3(0, 1, 0)), objects[0]->pdf_value(o, vec3(0, 1, 0)), real(1e-5));
+			Assert::AreEqual(with_glass.pdf_value(o, vec3(5, 6, 0)), real(0));
+		}
+
+		TEST_METHOD(_spherical_rectangle)
+		{
+			xz_rect light(-1, 1, -1, 1, 1, nullptr);
+			independent_sampler g;
+
+			// 2 x 2 at distance 1 subtends 4 asin(1 / 2) = 2 pi / 3, seen from below and above
+			Assert::AreEqual(light.pdf_value(vec3(0, 0, 0), vec3(0.3f, 1, -0.2f)), real(3 / (2 * M_PI)), real(1e-4));
+			Assert::AreEqual(light.pdf_value(vec3(0, 2, 0), vec3(0.3f, -1, -0.2f)), real(3 / (2 * M_PI)), real(1e-4));
+			Assert::AreEqual(light.pdf_value(vec3(0, 0, 0), vec3(2, 1, 0)), real(0));
+			// far enough to fall back to area, distance squared over area
+			Assert::AreEqual(light.pdf_value(vec3(0, -200, 0), vec3(0, 1, 0)), real(201 * 201 / 4.0), real(1e-2));
+
+			// integrates to 1 over sphere of directions, near, grazing and far
+			for (vec3 origin : { vec3(0, 0.5f, 0), vec3(1.5f, 0.8f, 0), vec3(0, -3, 0) })
+			{
+				const int n = 200000;
+				double sum = 0.0;
+				for (int i = 0; i < n; i++)
+				{
+					g.start(0, i);
+					sum += light.pdf_value(origin, random_unit_vector(g));
+				}
+				Assert::AreEqual(sum / n * 4.0 * M_PI, 1.0, 0.03);
+
+				// generated directions end on the light
+				for (int i = 0; i < 100; i++)
+				{
+					vec3 v = light.random(origin, g);
+					Assert::AreEqual(origin.y + v.y, real(1), real(1e-3));
+					Assert::IsTrue(light.pdf_value(origin, v) > 0.0);
+				}
+			}
+		}
+
+		TEST_METHOD(_environment)
+		{
+			// 4 x 2 flat RGBE, one bright pixel in the upper row
+			const char* path = "environment_test.hdr";
+			{
+				std::ofstream file(path, std::ios::binary);
+				file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 2 +X 4\n";
+				for (int k = 0; k < 8; k++)
+				{
+					const unsigned char dim[4] = { 128, 128, 128, 129 }, bright[4] = { 128, 64, 32, 136 };
+					file.write(reinterpret_cast<const char*>(k == 1 ? bright : dim), 4);
+				}
+			}
+			auto environment = environment_light::load_hdr(path);
+			std::remove(path);
+
+			Assert::IsTrue(environment != nullptr);
+			Assert::AreEqual(environment->radiance(environment_light::direction(0.375f, 0.75f)).y, real(64));
+			Assert::AreEqual(environment->radiance(vec3(0, -1, 0.1f)).x, real(1));
+			aabb box;
+			Assert::IsFalse(environment->bounding_box(0, 1, box));
+
+			// integrates to 1 over sphere of directions, the bright pixel takes most samples
+			independent_sampler g;
+			vec3 o(0, 0, 0);
+			const int n = 200000;
+			double sum = 0.0;
+			int bright_count = 0;
+			for (int i = 0; i < n; i++)
+			{
+				g.start(0, i);
+				sum += environment->pdf_value(o, random_unit_vector(g));
+
+				vec3 v = environment->random(o, g);
+				Assert::IsTrue(environment->pdf_value(o, v) > 0.0);
+				real u, w;
+				environment_light::get_uv(normalize(v), u, w);
+				bright_count += u >= 0.25f && u < 0.5f && w >= 0.5f;
+			}
+			Assert::AreEqual(sum / n * 4.0 * M_PI, 1.0, 0.02);
+			// luminance 75.3 against 1 for each of the other 7 pixels, rows weigh the same
+			Assert::AreEqual(real(bright_count) / n, real(75.3 / 82.3), real(0.01));
+		}
+
+		TEST_METHOD(_guiding)
+		{
+			// light recorded around +z, tree refined by it samples there, and integrates to 1 over sphere of directions
+			independent_sampler g;
+			direction_quadtree tree;
+			for (int i = 0; i < 1000; i++)
+			{
+				g.start(0, i);
+				vec3 d = random_unit_vector(g);
+				tree.record(d, d.z > 0.9f ? real(100) : real(1));
+			}
+			direction_quadtree refined = tree.refined(guiding_directional_threshold, guiding_max_directional_depth);
+			Assert::IsTrue(refined.node_count() > 1);
+			for (int i = 0; i < 1000; i++)
+			{
+				g.start(0, i);
+				vec3 d = random_unit_vector(g);
+				refined.record(d, d.z > 0.9f ? real(100) : real(1));
+			}
+
+			const int n = 200000;
+			double sum = 0.0;
+			int near_count = 0;
+			for (int i = 0; i < n; i++)
+			{
+				g.start(1, i);
+				sum += refined.pdf(random_unit_vector(g));
+
+				vec3 v = refined.sample(g.get_2d());
+				Assert::IsTrue(refined.pdf(v) > 0.0);
+				near_count += v.z > 0.9f;
+			}
+			Assert::AreEqual(sum / n * 4.0 * M_PI, 1.0, 0.02);
+			Assert::IsTrue(near_count > n / 2);
+
+			// sums do not depend on the order threads add in
+			shared_sum forward, backward;
+			for (int i = 0; i < 1000; i++)
+			{
+				forward.add(real(1000) / (i + 1));
+				backward.add(real(1000) / (1000 - i));
+			}
+			Assert::AreEqual(forward.load(), backward.load());
+			Assert::AreEqual(forward.load(), real(7485.47), real(0.01));
+
+			// leaf with enough records splits in two
+			path_guide guide;
+			guide.build(aabb(vec3(-1, -1, -1), vec3(1, 1, 1)));
+			guide_record r = { guide.leaf(vec3(0, 0, 0)), vec3(0, 0, 1), 1, vec3(0, 0, 0), vec3(1, 1, 1) };
+			for (int i = 0; i < 2 * guiding_spatial_threshold; i++)
+				guide.record(&r, 1, vec3(1, 1, 1));
+			guide.refine(0);
+			Assert::AreEqual(guide.leaf_count(), size_t(2));
+			Assert::AreNotEqual(guide.leaf(vec3(-0.5f, 0, 0)), guide.leaf(vec3(0.5f, 0, 0)));
+			Assert::IsTrue(guide.sampling(guide.leaf(vec3(0.5f, 0, 0))).total() > 0);
+		}
+
+		TEST_METHOD(_reservoir)
+		{
+			// streamed one at a time, each kept with probability of its share of the weights
+			light_point a, b, c;
+			a.p = vec3(1, 0, 0);
+			b.p = vec3(2, 0, 0);
+			c.p = vec3(3, 0, 0);
+
+			independent_sampler g;
+			const int n = 20000;
+			int counts[3] = {};
+			for (int k = 0; k < n; k++)
+			{
+				g.start(0, k);
+				reservoir r;
+				r.update(a, 1, g.get_1d());
+				r.update(b, 0, g.get_1d());
+				r.update(c, 3, g.get_1d());
+				Assert::AreEqual(r.w_sum, real(4));
+				counts[static_cast<int>(r.y.p.x) - 1]++;
+			}
+			Assert::AreEqual(real(counts[0]) / n, real(0.25), real(0.02));
+			Assert::AreEqual(counts[1], 0);
+			Assert::AreEqual(real(counts[2]) / n, real(0.75), real(0.02));
+		}
 	};
 
 	TEST_CLASS(_aabb)
@@ -99,13 +464,600 @@ namespace CppTest
 
 			auto s = aabb::surrounding(box0, box1);
 
-			Assert::AreEqual(s.min()[0], 0.0);
-			Assert::AreEqual(s.min()[1], 0.0);
-			Assert::AreEqual(s.min()[2], 0.0);
+			Assert::AreEqual(s.min()[0], real(0));
+			Assert::AreEqual(s.min()[1], real(0));
+			Assert::AreEqual(s.min()[2], real(0));
+
+			Assert::AreEqual(s.max()[0], real(4));
+			Assert::AreEqual(s.max()[1], real(4));
+			Assert::AreEqual(s.max()[2], real(4));
+		}
+	};
+
+	TEST_CLASS(_box)
+	{
+	public:
+		TEST_METHOD(_hit)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			// same as 6 rects with outward normals
+			vec3 p0(1, 2, 3), p1(4, 6, 5);
+			box b(p0, p1, nullptr);
+			hittable_list rects(std::vector<std::shared_ptr<hittable>>{
+				std::make_shared<xy_rect>(p0.x, p1.x, p0.y, p1.y, p1.z, nullptr),
+				std::make_shared<flip_normals>(std::make_shared<xy_rect>(p0.x, p1.x, p0.y, p1.y, p0.z, nullptr)),
+				std::make_shared<xz_rect>(p0.x, p1.x, p0.z, p1.z, p1.y, nullptr),
+				std::make_shared<flip_normals>(std::make_shared<xz_rect>(p0.x, p1.x, p0.z, p1.z, p0.y, nullptr)),
+				std::make_shared<yz_rect>(p0.y, p1.y, p0.z, p1.z, p1.x, nullptr),
+				std::make_shared<flip_normals>(std::make_shared<yz_rect>(p0.y, p1.y, p0.z, p1.z, p0.x, nullptr)) });
+
+			for (int i = 0; i < 1000; i++)
+			{
+				// some from inside
+				vec3 origin(uniform(engine) * 8 - 1, uniform(engine) * 10 - 1, uniform(engine) * 6 + 1);
+				vec3 target(uniform(engine) * 4 + 1, uniform(engine) * 5 + 1.5, uniform(engine) * 3 + 2.5);
+				ray r(origin, target - origin, 0.0);
+
+				hit_record box_rec, rects_rec;
+				bool box_hit = b.hit(r, 0.001, FLT_MAX, box_rec);
+				Assert::AreEqual(rects.hit(r, 0.001, FLT_MAX, rects_rec), box_hit);
+				if (box_hit)
+				{
+					Assert::AreEqual(box_rec.t, rects_rec.t, 16 * epsilon);
+					Assert::AreEqual(dot(box_rec.normal, rects_rec.normal), real(1));
+					Assert::AreEqual(box_rec.u, rects_rec.u, 16 * epsilon);
+					Assert::AreEqual(box_rec.v, rects_rec.v, 16 * epsilon);
+				}
+			}
+		}
+
+		TEST_METHOD(_pdf)
+		{
+			box b(vec3(1, 2, 3), vec3(4, 6, 5), nullptr);
+			independent_sampler g;
+
+			// integrates to 1 over sphere of directions
+			for (vec3 origin : { vec3(-3, 1, 0), vec3(2, 3, 4) })
+			{
+				const int n = 200000;
+				double sum = 0.0;
+				for (int i = 0; i < n; i++)
+					sum += b.pdf_value(origin, random_unit_vector(g));
+				Assert::AreEqual(sum / n * 4.0 * M_PI, 1.0, 0.02);
+
+				// generated directions have non-zero pdf
+				for (int i = 0; i < 100; i++)
+					Assert::IsTrue(b.pdf_value(origin, b.random(origin, g)) > 0.0);
+			}
+		}
+	};
+
+	// child test of a wide node against the scalar template, which the SSE and AVX overloads must match bit for bit
+	template <int width>
+	void check_intersect_children(std::minstd_rand& engine)
+	{
+		std::uniform_real_distribution<float> uniform(-1, 1);
+		for (int k = 0; k < 1000; k++)
+		{
+			bvh_wide_node<width> node = {};
+			bvh_wide_bounds<width> end = {};
+			for (int i = 0; i < width; i++)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					float a = uniform(engine), b = uniform(engine);
+					node.bounds_min[axis][i] = std::min(a, b);
+					node.bounds_max[axis][i] = std::max(a, b);
+					end.bounds_min[axis][i] = node.bounds_min[axis][i] + 0.5f * uniform(engine);
+					end.bounds_max[axis][i] = node.bounds_max[axis][i] + 0.5f * uniform(engine);
+				}
+				// empty slot, inverted bounds
+				if (i == k % width)
+				{
+					node.bounds_min[0][i] = end.bounds_min[0][i] = std::numeric_limits<float>::max();
+					node.bounds_max[0][i] = end.bounds_max[0][i] = -std::numeric_limits<float>::max();
+				}
+			}
+
+			bvh_wide_ray r;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				// some directions along an axis, infinite inverse on the others
+				float direction = k % 5 == 0 && axis != k % 3 ? 0.0f : uniform(engine);
+				r.inv_direction[axis] = 1.0f / direction;
+				r.direction_is_negative[axis] = r.inv_direction[axis] < 0;
+				float origin = 2 * uniform(engine);
+				float origin_down = std::nextafter(origin, -std::numeric_limits<float>::max());
+				float origin_up = std::nextafter(origin, std::numeric_limits<float>::max());
+				r.origin_near[axis] = r.direction_is_negative[axis] ? origin_down : origin_up;
+				r.origin_far[axis] = r.direction_is_negative[axis] ? origin_up : origin_down;
+			}
+
+			const bvh_wide_bounds<width>* moving = k % 2 ? &end : nullptr;
+			float factor = 0.5f * (uniform(engine) + 1);
+			float t_max = k % 3 ? std::numeric_limits<float>::max() : 2.0f;
+
+			float simd_t[width], scalar_t[width];
+			int simd_mask = intersect_children(node, moving, factor, r, 0.0f, t_max, simd_t);
+			int scalar_mask = intersect_children<width>(node, moving, factor, r, 0.0f, t_max, scalar_t);
+			Assert::AreEqual(simd_mask, scalar_mask);
+			for (int i = 0; i < width; i++)
+				if (scalar_mask & (1 << i))
+					Assert::AreEqual(simd_t[i], scalar_t[i]);
+		}
+	}
+
+	TEST_CLASS(_bvh)
+	{
+	public:
+		TEST_METHOD(_node_size)
+		{
+			Assert::AreEqual(sizeof(bvh_linear_node), (size_t)32);
+		}
+
+		TEST_METHOD(_children)
+		{
+#if defined(_M_X64) && !defined(__AVX__)
+			// CppTest builds with /arch:AVX as the renderer does, else only the scalar kernels would be tested here
+			Assert::IsTrue(false, L"CppTest built without AVX");
+#endif
+			std::minstd_rand engine;
+			check_intersect_children<4>(engine);
+			check_intersect_children<8>(engine);
+		}
 
-			Assert::AreEqual(s.max()[0], 4.0);
-			Assert::AreEqual(s.max()[1], 4.0);
-			Assert::AreEqual(s.max()[2], 4.0);
+		TEST_METHOD(_hit)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			std::vector<std::shared_ptr<hittable>> objects;
+			for (int i = 0; i < 200; i++)
+			{
+				vec3 center(uniform(engine) * 10, uniform(engine) * 10, uniform(engine) * 10);
+				objects.push_back(std::make_shared<sphere>(center, 0.1 + 0.5 * uniform(engine), nullptr));
+			}
+
+			hittable_list list(objects);
+
+			// same closest hit as linear walk, for binary and wide trees
+			for (int width : { 2, 4, 8 })
+			{
+				bvh tree(objects, 0, 1, width);
+				for (int i = 0; i < 1000; i++)
+				{
+					vec3 origin(uniform(engine) * 10, uniform(engine) * 10, -5);
+					vec3 direction = normalize(vec3(uniform(engine) - 0.5, uniform(engine) - 0.5, 1));
+					ray r(origin, direction, 0.0);
+
+					hit_record list_rec, bvh_rec;
+					bool list_hit = list.hit(r, 0.001, FLT_MAX, list_rec);
+					bool bvh_hit = tree.hit(r, 0.001, FLT_MAX, bvh_rec);
+
+					Assert::AreEqual(list_hit, bvh_hit);
+					if (list_hit)
+					{
+						// attributes filled once for the same closest primitive, bvh hits its compiled copy
+						Assert::AreEqual(list_rec.t, bvh_rec.t);
+						Assert::IsTrue(static_cast<const sphere*>(list_rec.object)->center == static_cast<const sphere*>(bvh_rec.object)->center);
+						Assert::IsTrue(list_rec.normal == bvh_rec.normal);
+					}
+				}
+			}
+		}
+
+		TEST_METHOD(_depth)
+		{
+			// geometric spacing, SAH splits off a few boxes at a time, depth stays within the traversal stack
+			std::vector<aabb> boxes;
+			for (int i = 0; i < 900; i++)
+			{
+				real x = std::pow(real(1.1), real(i));
+				boxes.push_back(aabb(vec3(x, 0, 0), vec3(x * 1.05f, 1, 1)));
+			}
+			bvh_tree tree;
+			tree.build(boxes);
+
+			std::vector<int> depth(tree.nodes.size(), 0);
+			int max_depth = 0;
+			for (size_t i = 0; i < tree.nodes.size(); i++)
+			{
+				max_depth = std::max(max_depth, depth[i]);
+				if (!tree.nodes[i].is_leaf())
+				{
+					depth[i + 1] = depth[i] + 1;
+					depth[tree.nodes[i].offset] = depth[i] + 1;
+				}
+			}
+			Assert::IsTrue(max_depth > bvh_tree::max_depth);
+			Assert::IsTrue(max_depth < 64);
+
+			// still finds each box, leaves index primitives in build order
+			std::vector<uint32_t> order = tree.build(boxes);
+			for (int i = 0; i < 900; i += 7)
+			{
+				real x = std::pow(real(1.1), real(i)) * 1.02f;
+				real t_max = FLT_MAX;
+				uint32_t found = UINT32_MAX;
+				tree.traverse(ray(vec3(x, 0.5f, -1), vec3(0, 0, 1), 0), 0, t_max, [&](uint32_t offset, uint32_t count, real&)
+				{
+					for (uint32_t k = offset; k < offset + count; k++)
+						if (boxes[order[k]].min().x <= x && x <= boxes[order[k]].max().x)
+							found = order[k];
+					return false;
+				});
+				Assert::AreEqual(found, uint32_t(i));
+			}
+		}
+
+		TEST_METHOD(_occluded)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			std::vector<std::shared_ptr<hittable>> objects;
+			for (int i = 0; i < 200; i++)
+			{
+				vec3 center(uniform(engine) * 10, uniform(engine) * 10, uniform(engine) * 10);
+				objects.push_back(std::make_shared<sphere>(center, 0.1 + 0.5 * uniform(engine), nullptr));
+			}
+			objects.push_back(std::make_shared<xz_rect>(0, 10, 0, 10, 5, nullptr));
+
+			hittable_list list(objects);
+
+			// any hit agrees with closest hit within segment
+			for (int width : { 2, 4, 8 })
+			{
+				bvh tree(objects, 0, 1, width);
+				for (int i = 0; i < 1000; i++)
+				{
+					vec3 origin(uniform(engine) * 10, uniform(engine) * 10, uniform(engine) * 10);
+					vec3 target(uniform(engine) * 10, uniform(engine) * 10, uniform(engine) * 10);
+					ray r(origin, target - origin, 0.0);
+
+					hit_record rec;
+					bool list_hit = list.hit(r, 0.001, 0.999, rec);
+					Assert::AreEqual(list_hit, list.occluded(r, 0.001, 0.999));
+					Assert::AreEqual(list_hit, tree.occluded(r, 0.001, 0.999));
+				}
+			}
+		}
+
+		TEST_METHOD(_motion)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			std::vector<std::shared_ptr<hittable>> objects;
+			for (int i = 0; i < 200; i++)
+			{
+				vec3 center(uniform(engine) * 10, uniform(engine) * 10, uniform(engine) * 10);
+				auto s = std::make_shared<moving_sphere>(center, 0.1 + 0.3 * uniform(engine), nullptr);
+				movement_linear m;
+				m.center1 = center + vec3(uniform(engine), uniform(engine), uniform(engine)) * 2.0;
+				m.time0 = 0.0;
+				m.time1 = 1.0;
+				s->set_movement(m);
+				objects.push_back(s);
+			}
+
+			hittable_list list(objects);
+
+			// bounds interpolated at ray time still find the same closest hit
+			for (int width : { 2, 4, 8 })
+			{
+				bvh tree(objects, 0, 1, width);
+				Assert::IsTrue(tree.tree.has_motion());
+
+				for (int i = 0; i < 1000; i++)
+				{
+					vec3 origin(uniform(engine) * 10, uniform(engine) * 10, -5);
+					vec3 direction = normalize(vec3(uniform(engine) - 0.5, uniform(engine) - 0.5, 1));
+					ray r(origin, direction, uniform(engine));
+
+					hit_record list_rec, bvh_rec;
+					bool list_hit = list.hit(r, 0.001, FLT_MAX, list_rec);
+					bool bvh_hit = tree.hit(r, 0.001, FLT_MAX, bvh_rec);
+
+					Assert::AreEqual(list_hit, bvh_hit);
+					if (list_hit)
+						Assert::AreEqual(list_rec.t, bvh_rec.t);
+				}
+			}
+		}
+
+		TEST_METHOD(_parallel_build)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			// enough primitives for parallel binning and subtree tasks
+			std::vector<std::shared_ptr<hittable>> objects;
+			for (int i = 0; i < 50000; i++)
+			{
+				vec3 center(uniform(engine) * 100, uniform(engine) * 100, uniform(engine) * 100);
+				objects.push_back(std::make_shared<sphere>(center, 0.2, nullptr));
+			}
+
+			hittable_list list(objects);
+			bvh tree(objects, 0, 1);
+
+			for (int i = 0; i < 200; i++)
+			{
+				vec3 origin(uniform(engine) * 100, uniform(engine) * 100, -5);
+				vec3 direction = normalize(vec3(uniform(engine) - 0.5, uniform(engine) - 0.5, 1));
+				ray r(origin, direction, 0.0);
+
+				hit_record list_rec, bvh_rec;
+				bool list_hit = list.hit(r, 0.001, FLT_MAX, list_rec);
+				bool bvh_hit = tree.hit(r, 0.001, FLT_MAX, bvh_rec);
+
+				Assert::AreEqual(list_hit, bvh_hit);
+				if (list_hit)
+					Assert::AreEqual(list_rec.t, bvh_rec.t);
+			}
+		}
+
+		TEST_METHOD(_primitive_table)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			// one of each table, a nested list and a wrapper that stays behind its pointer
+			auto mat = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)));
+			std::vector<std::shared_ptr<hittable>> objects = {
+				std::make_shared<sphere>(vec3(0, 0, 5), 1.0, mat),
+				std::make_shared<xy_rect>(-3, -1, -1, 1, 6, mat),
+				std::make_shared<xz_rect>(1, 3, 4, 6, -1, mat),
+				std::make_shared<box>(vec3(-1, 1.5, 4), vec3(1, 2.5, 6), mat),
+				std::make_shared<hittable_list>(std::vector<std::shared_ptr<hittable>>{
+					std::make_shared<yz_rect>(-3, -2, 4, 6, 2, mat),
+					std::make_shared<flip_normals>(std::make_shared<xy_rect>(1, 3, 1, 3, 7, mat)) }),
+				std::make_shared<instance>(std::make_shared<sphere>(vec3(0, 0, 0), 0.5, mat), transform::translation(vec3(2.5, -2.5, 5)) * transform::scaling(vec3(1, 2, 1))),
+				std::make_shared<translate>(std::make_shared<sphere>(vec3(0, 0, 0), 0.5, mat), vec3(-2.5, 2.5, 5)),
+			};
+
+			hittable_list list(objects);
+			bvh tree(objects, 0, 1);
+			Assert::AreEqual(tree.primitives.size(), (size_t)8);
+			Assert::AreEqual(tree.primitives.flipped_xy_rects.size(), (size_t)1);
+			Assert::AreEqual(tree.primitives.instances.size(), (size_t)1);
+			Assert::AreEqual(tree.primitives.others.size(), (size_t)1);
+
+			for (int i = 0; i < 1000; i++)
+			{
+				vec3 target(uniform(engine) * 8 - 4, uniform(engine) * 8 - 4, 5);
+				ray r(vec3(0, 0, -5), target - vec3(0, 0, -5), 0.0);
+
+				hit_record list_rec, bvh_rec;
+				bool list_hit = list.hit(r, 0.001, FLT_MAX, list_rec);
+				Assert::AreEqual(list_hit, tree.hit(r, 0.001, FLT_MAX, bvh_rec));
+				Assert::AreEqual(list_hit, tree.occluded(r, 0.001, FLT_MAX));
+				if (list_hit)
+				{
+					// same surface from the compiled copy
+					Assert::AreEqual(list_rec.t, bvh_rec.t);
+					Assert::IsTrue(list_rec.normal == bvh_rec.normal);
+					Assert::IsTrue(list_rec.mat_ptr == bvh_rec.mat_ptr);
+				}
+			}
+		}
+	};
+
+	TEST_CLASS(_instance)
+	{
+	public:
+		TEST_METHOD(_transform)
+		{
+			transform t = transform::translation(vec3(1, 2, 3)) * transform::rotation_y(30.0) * transform::scaling(vec3(2, 3, 4));
+			vec3 p(0.5, -1.5, 2.5);
+			vec3 q = t.inverse_point(t.point(p));
+			for (int i = 0; i < 3; i++)
+				Assert::AreEqual(p[i], q[i], 16 * epsilon);
+
+			// general matrix with shear, inverse from cofactors, rotation about y as rotation_y
+			const real matrix[3][4] = { { 1, 0.5f, 0, 1 }, { 0, 2, 0.25f, -2 }, { 0.3f, 0, 1, 3 } };
+			transform sheared(matrix);
+			vec3 r = sheared.inverse_point(sheared.point(p));
+			vec3 a = transform::rotation(vec3(0, 1, 0), 30.0).point(p);
+			vec3 b = transform::rotation_y(30.0).point(p);
+			vec3 c = transform::rotation(normalize(vec3(1, 2, 3)), 70.0).inverse().point(transform::rotation(normalize(vec3(1, 2, 3)), 70.0).point(p));
+			for (int i = 0; i < 3; i++)
+			{
+				Assert::AreEqual(p[i], r[i], 16 * epsilon);
+				Assert::AreEqual(a[i], b[i], 16 * epsilon);
+				Assert::AreEqual(p[i], c[i], 16 * epsilon);
+			}
+			Assert::IsTrue(transform::rotation(normalize(vec3(1, 2, 3)), 70.0).is_similarity());
+			Assert::IsFalse(sheared.is_similarity());
+		}
+
+		TEST_METHOD(_light)
+		{
+			// rect light under rotation about a tilted axis and non-uniform scale
+			auto light = std::make_shared<diffuse_light>(std::make_shared<constant_texture>(vec3(4, 4, 4)));
+			auto rect = std::make_shared<xz_rect>(-1, 1, -1, 1, 0, light);
+			instance placed(rect, transform::translation(vec3(0, 2, 0)) * transform::rotation(normalize(vec3(1, 0, 1)), 40.0) * transform::scaling(vec3(2, 1, 3)));
+			Assert::AreEqual(placed.power(), 6 * rect->power(), 1e-3f * placed.power());
+
+			// pdf integrates to 1, samples land on it with mean 1 / pdf the solid angle it covers
+			independent_sampler g;
+			vec3 origin(0.5f, 0, 0.2f);
+			const int n = 200000;
+			double sum = 0.0, covered = 0.0, inverse_sum = 0.0;
+			for (int i = 0; i < n; i++)
+			{
+				g.start(0, i);
+				real p = placed.pdf_value(origin, random_unit_vector(g));
+				sum += p;
+				covered += p > 0;
+
+				vec3 v = placed.random(origin, g);
+				real sample_pdf = placed.pdf_value(origin, v);
+				Assert::IsTrue(sample_pdf > 0.0);
+				inverse_sum += 1 / sample_pdf;
+			}
+			Assert::AreEqual(sum / n * 4.0 * M_PI, 1.0, 0.03);
+			Assert::AreEqual(inverse_sum / n, covered / n * 4.0 * M_PI, 0.03 * covered / n * 4.0 * M_PI);
+		}
+
+		TEST_METHOD(_hit)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			auto b = std::make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), nullptr);
+			translate wrapped(std::make_shared<rotate_y>(b, 15.0), vec3(265, 0, 295));
+
+			// copies share one bottom level bvh
+			auto blas = std::make_shared<bvh>(std::vector<std::shared_ptr<hittable>>{ b }, 0, 1);
+			instance placed(blas, transform::translation(vec3(265, 0, 295)) * transform::rotation_y(15.0));
+			instance copy(blas, transform::translation(vec3(0, 0, 1000)));
+			Assert::IsTrue(placed.blas == copy.blas);
+
+			for (int i = 0; i < 1000; i++)
+			{
+				vec3 origin(uniform(engine) * 555, uniform(engine) * 555, -800);
+				vec3 direction = normalize(vec3(350, 165, 400) - origin);
+				ray r(origin, direction, 0.0);
+
+				hit_record wrapped_rec, instance_rec;
+				bool wrapped_hit = wrapped.hit(r, 0.001, FLT_MAX, wrapped_rec);
+				bool instance_hit = placed.hit(r, 0.001, FLT_MAX, instance_rec);
+
+				Assert::AreEqual(wrapped_hit, instance_hit);
+				if (wrapped_hit)
+				{
+					Assert::AreEqual(wrapped_rec.t, instance_rec.t, wrapped_rec.t * 64 * epsilon);
+					Assert::AreEqual(dot(wrapped_rec.normal, instance_rec.normal), real(1), 16 * epsilon);
+				}
+			}
+		}
+
+		TEST_METHOD(_deferred)
+		{
+			// counts attribute work of the primitive under the instances
+			struct counting_sphere : public sphere
+			{
+				counting_sphere() : sphere(vec3(0, 0, 0), 1, nullptr) {}
+				void surface(const ray& r, hit_record& rec) const override { surfaces++; sphere::surface(r, rec); }
+				mutable int surfaces = 0;
+			};
+			auto counted = std::make_shared<counting_sphere>();
+			auto blas = std::make_shared<hittable_list>(std::vector<std::shared_ptr<hittable>>{ counted });
+
+			// far to near along the ray, each one beats the closest so far
+			std::vector<std::shared_ptr<hittable>> copies;
+			for (int i = 7; i >= 0; i--)
+				copies.push_back(std::make_shared<translate>(std::make_shared<instance>(blas, transform::translation(vec3(0, 0, 4.0f * i)) * transform::scaling(vec3(1, 1, 0.5f))), vec3(0, 0, 0)));
+			hittable_list world(copies);
+
+			hit_record rec;
+			Assert::IsTrue(world.hit(ray(vec3(0, 0, -10), vec3(0, 0, 1), 0.0), 0.001, FLT_MAX, rec));
+			Assert::AreEqual(counted->surfaces, 1);
+			Assert::AreEqual(rec.p.z, real(-0.5), 16 * epsilon);
+			Assert::AreEqual(rec.normal.z, real(-1), 16 * epsilon);
+		}
+
+		TEST_METHOD(_nesting)
+		{
+			// chains deeper than the stack in hit_record, a flipped sphere moved by 1 per level
+			for (int levels : { hit_record::max_nesting, hit_record::max_nesting + 1, 3 * hit_record::max_nesting + 2 })
+			{
+				std::shared_ptr<hittable> chain = std::make_shared<flip_normals>(std::make_shared<sphere>(vec3(0, 0, 0), 1, nullptr));
+				for (int i = 0; i < levels; i++)
+					chain = std::make_shared<translate>(chain, vec3(0, 0, 1));
+
+				hit_record rec;
+				Assert::IsTrue(chain->hit(ray(vec3(0, 0, -10), vec3(0, 0, 1), 0.0), 0.001, FLT_MAX, rec));
+				Assert::AreEqual(rec.t, real(levels + 9), 16 * epsilon);
+				Assert::AreEqual(rec.p.z, real(levels - 1), 16 * epsilon);
+				Assert::AreEqual(rec.normal.z, real(1), 16 * epsilon);
+				Assert::IsTrue(chain->occluded(ray(vec3(0, 0, -10), vec3(0, 0, 1), 0.0), 0.001, FLT_MAX));
+			}
+		}
+	};
+
+	TEST_CLASS(_triangle_mesh)
+	{
+	public:
+		TEST_METHOD(_watertight)
+		{
+			std::uniform_real_distribution<double> uniform;
+			std::minstd_rand engine;
+
+			for (int width : { 2, 4, 8 })
+			{
+				// grid of 2 triangles per cell, shared vertices
+				const int n = 16;
+				triangle_mesh mesh(nullptr, width);
+				for (int j = 0; j <= n; j++)
+					for (int i = 0; i <= n; i++)
+						mesh.add_vertex(vec3(i, j, 0));
+				for (int j = 0; j < n; j++)
+				{
+					for (int i = 0; i < n; i++)
+					{
+						uint32_t v = j * (n + 1) + i;
+						mesh.add_triangle(v, v + 1, v + n + 2);
+						mesh.add_triangle(v, v + n + 2, v + n + 1);
+					}
+				}
+				mesh.build();
+				Assert::AreEqual(mesh.triangle_count(), (size_t)(2 * n * n));
+
+				// rays exactly through shared edges and vertices never slip through
+				for (int k = 0; k < 1000; k++)
+				{
+					int i = 1 + k % (n - 1);
+					int j = 1 + (k / (n - 1)) % (n - 1);
+					vec3 target(i, j, 0);
+					if (k % 3 == 1)
+						target.x += uniform(engine); // horizontal edge
+					else if (k % 3 == 2)
+						target = vec3(i + 0.5, j + 0.5, 0); // diagonal
+					vec3 origin(uniform(engine) * n, uniform(engine) * n, -1 - uniform(engine) * 10);
+					hit_record rec;
+					Assert::IsTrue(mesh.hit(ray(origin, target - origin, 0.0), 0.001, FLT_MAX, rec));
+					Assert::AreEqual(rec.t, real(1), 16 * epsilon);
+				}
+			}
+		}
+
+		TEST_METHOD(_load_obj)
+		{
+			const char* path = "triangle_mesh_test.obj";
+			{
+				std::ofstream file(path);
+				file << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n";
+				file << "vt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n";
+				file << "f 1/1 2/2 3/3 4/4\n";
+			}
+			auto mesh = triangle_mesh::load_obj(path, nullptr);
+			std::remove(path);
+
+			Assert::IsTrue(mesh != nullptr);
+			Assert::AreEqual(mesh->triangle_count(), (size_t)2);
+			Assert::AreEqual(mesh->vertex_count(), (size_t)4);
+
+			hit_record rec;
+			Assert::IsTrue(mesh->hit(ray(vec3(0.25, 0.75, -1), vec3(0, 0, 1), 0.0), 0.001, FLT_MAX, rec));
+			Assert::AreEqual(rec.u, real(0.25), 16 * epsilon);
+			Assert::AreEqual(rec.v, real(0.75), 16 * epsilon);
+			Assert::AreEqual(rec.normal.z, real(1), 16 * epsilon);
+
+			// indices past 2^21 share vertices too, a missing uv reads as 0 so no 3M line file is needed
+			{
+				std::ofstream file(path);
+				file << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n";
+				file << "f 1/3000000 2/3000000 3/3000000\nf 1/3000000 3/3000000 4/3000000\n";
+			}
+			mesh = triangle_mesh::load_obj(path, nullptr);
+			std::remove(path);
+			Assert::IsTrue(mesh != nullptr);
+			Assert::AreEqual(mesh->vertex_count(), (size_t)4);
 		}
 	};
-}
\ No newline at end of file
+}
@@ -311,6 +311,7 @@ int main()
 
 	// for Plot
 	{
+		independent_sampler g;
 		std::cout << "[";
 		for (int i = 0; i < 1000; i++)
 		{
@@ -321,9 +322,9 @@ int main()
 
 			onb uvw;
 			uvw.build_from_w(vec3(0, 0, 1));
-			v = uvw.local(random_cosine_direction());
+			v = uvw.local(random_cosine_direction(g));
 
-			// v = normalize(random_in_hemisphere(vec3(0,0,1)));
+			// v = normalize(random_in_hemisphere(g, vec3(0,0,1)));
 
 			std::cout << "[" << v.x << ", " << v.y << ", " << v.z << "]";
 		}
@@ -8,6 +8,8 @@
 #include <chrono>
 #include <random>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
 #define _CRTDBG_MAP_ALLOC
 #include <cstdlib>
 
@@ -20,12 +22,15 @@ using namespace concurrency;
 #include "vec3.h"
 #include "onb.h"
 #include "ray.h"
+#include "sampler.h"
 #include "pdf.h"
 #include "sphere.h"
 #include "hittable_list.h"
 #include "camera.h"
 #include "material.h"
 #include "utility.h"
+#include "restir.h"
+#include "guiding.h"
 
 #include "Scene/scene.h"
 
@@ -37,126 +42,253 @@ const int ny = 100 * size_multiplier;
 
 //#define DEBUG_RAY
 #ifdef DEBUG_RAY
-const int max_depth = 1;
+const int default_max_depth = 1;
 #else
-const int max_depth = 100;
+const int default_max_depth = 100;
 #endif
 
-vec3 color(const ray& r, const scene *s, int depth)
+// bounces before Russian roulette starts, short paths are never cut
+const int roulette_depth = 3;
+
+// shadow rays end this fraction short of the light, so they do not hit it
+const real shadow_epsilon = 1e-3f;
+
+// adaptive sampling, -adaptive <relative error> turns it on
+// a pixel takes batches of samples until the standard error of its mean drops below
+// the relative error, flat and black regions stop after the first batch, noisy ones go on up to the cap
+const int adaptive_batch = subPixelCount / 4;
+const int adaptive_max_samples = subPixelCount * 4;
+
+// resampled direct light at first hits, -restir turns it on
+// candidates streamed per pixel, then neighbors within the radius (in pixels) resampled into it
+const int restir_candidates = 32;
+const int restir_neighbors = 5;
+const real restir_radius = 10.0f;
+// reservoir passes draw from streams no pixel sample uses
+const uint32_t restir_streams = 0x80000000u;
+
+// path guiding, -guiding turns it on
+// training passes of 1, 2, 4.. samples per pixel take up to this many, each refines the guide and
+// its image is dropped, a last pass takes the rest of subPixelCount with what was learned
+const int guiding_training_samples = subPixelCount / 4;
+
+vec3 background(const ray& r, const scene *s)
 {
-	if (depth <= 0)
-		return vec3(0.0);
+	switch (s->GetBackgroundType())
+	{
+		case BackgroundType::Gradient:
+		{
+			// Gradient background along y-axis
+			vec3 unit_direction = normalize(r.direction());
+			real t = 0.5f * (unit_direction.y + 1.0);
+			return lerp(vec3(0.5f, 0.7f, 1.0), vec3(1.0, 1.0, 1.0), t);
+		}
+		case BackgroundType::Environment:
+		{
+			return s->GetEnvironment()->radiance(r.direction());
+		}
+		case BackgroundType::Black:
+		default:
+		{
+			// Black background
+			return vec3(0, 0, 0);
+		}
+	}
+}
+
+// iterative path tracing
+// throughput is the product of attenuation * scattering_pdf / pdf along the path so far,
+// each bounce adds what it emits weighted by it, nothing is kept per bounce.
+// From roulette_depth bounces on a path survives with probability of its throughput and is
+// reweighted by 1 / probability, so dim paths end early without bias.
+// See pbrt 3rd edition, 13.7 Russian Roulette and Splitting
+// Each vertex with a material pdf takes a light sample and a material sample, emission found by either
+// is weighted with the power heuristic against the pdf the other strategy would have had for it.
+// See pbrt 3rd edition, 14.3.1 Estimating the Direct Lighting Integral
+// camera_vertex_direct false leaves direct light of lights at a first hit with a material pdf to the caller (ReSTIR),
+// emission the material sample finds there is then weighted against the tree lights the caller resampled,
+// as restir_weight() weights the caller's sample, and taken as is where those could not reach.
+// With a guide, directions come from a one sample mixture of the material pdf and the light learned
+// around the vertex, and while training the guide learns what the path brings in along each of them.
+vec3 color(const ray& camera_ray, const scene *s, int max_depth, sampler& g, bool camera_vertex_direct = true, path_guide* guide = nullptr)
+{
+	vec3 radiance(0, 0, 0);
+	vec3 throughput(1, 1, 1);
+	ray r = camera_ray;
 
-	hit_record rec;
-	// z_min = 0 will cause hit same point while reflection
-	if (s->GetWorld().hit(r, 0.001f, std::numeric_limits<double>::max(), rec))
+	const light_bvh& lights = s->GetLights();
+	const bool sample_lights = !lights.empty(); // in case there is no light specified
+
+	// material pdf of the direction r was sampled in, 0 when the light could not have been sampled
+	// there (camera ray, specular bounce), then its emission is taken as is
+	real material_pdf_of_r = 0;
+	vec3 origin_of_r;
+
+	guide_record records[guiding_max_vertices];
+	int record_count = 0;
+
+	for (int depth = 0; depth < max_depth; depth++)
 	{
-		switch (s->GetRenderType())
+		g.start_bounce(depth);
+
+		hit_record rec;
+		// z_min = 0 will cause hit same point while reflection
+		if (!s->GetWorld().hit(r, 0.001f, std::numeric_limits<real>::max(), rec))
+		{
+			// environment is among the lights, weighted as emission below, ReSTIR does not sample it
+			vec3 missed = background(r, s);
+			if (material_pdf_of_r > 0 && s->GetEnvironment() != nullptr && (depth > 1 || camera_vertex_direct))
+				missed *= power_heuristic(material_pdf_of_r, lights.pdf_value(origin_of_r, r.direction()));
+			radiance += throughput * missed;
+			break;
+		}
+
+		if (s->GetRenderType() == RenderType::Normal)
+		{
+			radiance += throughput * 0.5f * (rec.normal + 1);
+			break;
+		}
+		if (s->GetRenderType() != RenderType::Shaded)
+			break;
+
+		vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+		if (material_pdf_of_r > 0 && depth == 1 && !camera_vertex_direct)
+		{
+			// an emitter that is no light, or the environment, ReSTIR never samples
+			hit_record light_rec;
+			real light_pdf_of_r = emitted != vec3(0, 0, 0)
+				&& lights.intersect(r, 0.001f, std::numeric_limits<real>::max(), light_rec)
+				&& light_rec.t > rec.t * (1 - restir_light_epsilon) && light_rec.t < std::numeric_limits<real>::max()
+				? lights.bounded_pdf_value(origin_of_r, r.direction()) : real(0);
+			emitted *= power_heuristic(material_pdf_of_r, light_pdf_of_r);
+		}
+		else if (material_pdf_of_r > 0)
 		{
-		case RenderType::Shaded:
+			real light_pdf_of_r = lights.pdf_value(origin_of_r, r.direction());
+			emitted *= power_heuristic(material_pdf_of_r, light_pdf_of_r);
+		}
+		radiance += throughput * emitted;
+
+		// after emission is taken, so a path sampled towards a light still reaches it
+		if (depth >= roulette_depth)
 		{
-			vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-			vec3 albedo;
-			scatter_record srec;
+			real survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), real(1));
+			if (random_double(g) >= survival)
+				break;
+			throughput /= survival;
+		}
 
-			if (!rec.mat_ptr->scatter(r, rec, srec))
-				return emitted;
+		scatter_record srec;
+		if (!rec.mat_ptr->scatter(r, rec, srec, g))
+			break;
 
-			{
 #if 0 // book3.chapter9 - hard-coded light pdf
-				auto on_light = vec3(random_double(213, 343), 554, random_double(227, 332));
-				auto to_light = on_light - rec.p;
-				auto distance_squared = to_light.length_squared();
-				to_light.make_unit_vector();
+		auto on_light = vec3(random_double(g, 213, 343), 554, random_double(g, 227, 332));
+		auto to_light = on_light - rec.p;
+		auto distance_squared = to_light.length_squared();
+		to_light.make_unit_vector();
 
-				if (dot(to_light, rec.normal) < 0)
-					return emitted;
+		if (dot(to_light, rec.normal) < 0)
+			return radiance;
 
-				double light_area = (343 - 213) * (332 - 227);
-				auto light_cosine = fabs(to_light.y);
-				if (light_cosine < 0.000001)
-					return emitted;
+		real light_area = (343 - 213) * (332 - 227);
+		auto light_cosine = fabs(to_light.y);
+		if (light_cosine < 0.000001)
+			return radiance;
 
-				pdf_val = distance_squared / (light_cosine * light_area);
-				scattered = ray(rec.p, to_light, r.time());
+		pdf_val = distance_squared / (light_cosine * light_area);
+		scattered = ray(rec.p, to_light, r.time());
 #endif // book3.chapter9
 
 #if 0 // book3.chapter10.2 - hard-coded light pdf using pdf class
-				std::shared_ptr<hittable> light_shape = std::make_shared<xz_rect>(213, 343, 227, 332, 554, nullptr);
-				hittable_pdf p(light_shape, rec.p);
-				scattered = ray(rec.p, p.generate(), r.time());
-				pdf_val = p.value(scattered.direction());
+		xz_rect light_shape(213, 343, 227, 332, 554, nullptr);
+		hittable_pdf p(&light_shape, rec.p);
+		scattered = ray(rec.p, p.generate(g), r.time());
+		pdf_val = p.value(scattered.direction());
 #endif // book3.chapter10.2
 
-				// notice only sampling light make roof appear black!
+		// notice only sampling light make roof appear black!
 
 #if 0 // book3.chapter10.1 - hard-coded cosine pdf
-				cosine_pdf p(rec.normal);
-				scattered = ray(rec.p, p.generate(), r.time());
-				pdf_val = p.value(scattered.direction());
+		cosine_pdf p(rec.normal);
+		scattered = ray(rec.p, p.generate(g), r.time());
+		pdf_val = p.value(scattered.direction());
 #endif // // book3.chapter10.1
 
 #if 0 // book3.chapter10.3 - hard-coded mixture pdf
-				std::shared_ptr<hittable> light_shape = std::make_shared<xz_rect>(213, 343, 227, 332, 554, nullptr);
-				auto p0 = std::make_shared<hittable_pdf>(light_shape, rec.p);
-				auto p1 = std::make_shared<cosine_pdf>(rec.normal);
-				mixture_pdf p(p0, p1);
+		xz_rect light_shape(213, 343, 227, 332, 554, nullptr);
+		hittable_pdf p0(&light_shape, rec.p);
+		cosine_pdf p1(rec.normal);
+		mixture_pdf p(&p0, &p1);
 
-				scattered = ray(rec.p, p.generate(), r.time());
-				pdf_val = p.value(scattered.direction());
+		scattered = ray(rec.p, p.generate(g), r.time());
+		pdf_val = p.value(scattered.direction());
 #endif // book3.chapter10.3
 
-				// note that light_pdf is based on material_pdf is uniform (lambertian)
-				// so it won't work with materials such as metal (where light may not be reflected from light at all) 
-				
-				std::shared_ptr<pdf> material_pdf = srec.pdf_ptr;
-
-				if (material_pdf == nullptr)
-					return srec.attenuation * color(srec.scattered_ray_without_pdf, s, depth - 1);
-				
-				std::shared_ptr<pdf> p = material_pdf;
-				if (s->GetLights() != nullptr && !s->GetLights()->objects.empty()) // in case there is no light specified
-					p = std::make_shared<mixture_pdf>(
-						material_pdf, 
-						std::make_shared<hittable_pdf>(s->GetLights(), rec.p));
-				
-				ray scattered = ray(rec.p, p->generate(), r.time());
-				double pdf_val = p->value(scattered.direction());
-
-				if (pdf_val <= 0.0)
-					return emitted;
-
-				return emitted
-					+ srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-					* color(scattered, s, depth - 1)
-					/ pdf_val;
-			}
-		}
-		case RenderType::Normal:
-			return 0.5f * (rec.normal + 1);
-		default:
-			return vec3(0, 0, 0);
+		// all pdfs of this bounce are on the stack, no heap allocation or refcount per bounce
+		const pdf* material_pdf = srec.pdf_ptr.get();
+
+		if (material_pdf == nullptr)
+		{
+			// specular, no light sample can match its direction
+			throughput *= srec.attenuation;
+			r = srec.scattered_ray_without_pdf;
+			material_pdf_of_r = 0;
+			continue;
 		}
-	}
-	else
-	{
-		switch (s->GetBackgroundType())
+
+		// learned light around the vertex in a one sample mixture with the material pdf, once the guide has any
+		uint32_t leaf = guide != nullptr ? guide->leaf(rec.p) : 0;
+		quadtree_pdf learned_pdf(guide != nullptr ? &guide->sampling(leaf) : nullptr);
+		mixture_pdf guided_pdf(&learned_pdf, material_pdf);
+		const pdf* sampling_pdf = guide != nullptr && guide->sampling(leaf).total() > 0 ? &guided_pdf : material_pdf;
+
+		// next event estimation, adds the light sampled if nothing is in between
+		// the point and its emission come from the few light objects, the world only answers
+		// a shadow ray, which stops at any hit and skips attributes
+		if (sample_lights && (depth > 0 || camera_vertex_direct))
 		{
-			case BackgroundType::Gradient:
-			{
-				// Gradient background along y-axis
-				vec3 unit_direction = normalize(r.direction());
-				double t = 0.5f * (unit_direction.y + 1.0);
-				return lerp(vec3(0.5f, 0.7f, 1.0), vec3(1.0, 1.0, 1.0), t);
-			}
-			case BackgroundType::Black:
-			default:
+			hittable_pdf light_pdf(&lights, rec.p);
+			ray to_light(rec.p, light_pdf.generate(g), r.time());
+			real light_pdf_val = light_pdf.value(to_light.direction());
+
+			hit_record light_rec;
+			if (light_pdf_val > 0 && lights.hit(to_light, 0.001f, std::numeric_limits<real>::max(), light_rec))
 			{
-				// Black background
-				return vec3(0, 0, 0);
+				vec3 light_emitted = light_rec.mat_ptr->emitted(to_light, light_rec, light_rec.u, light_rec.v, light_rec.p);
+				real scattering_pdf = rec.mat_ptr->scattering_pdf(r, rec, to_light);
+
+				// not the light itself, which is in the world too
+				if (scattering_pdf > 0 && light_emitted != vec3(0, 0, 0)
+					&& !s->GetWorld().occluded(to_light, 0.001f, light_rec.t * (1 - shadow_epsilon)))
+				{
+					real weight = power_heuristic(light_pdf_val, sampling_pdf->value(to_light.direction()));
+					radiance += throughput * srec.attenuation * scattering_pdf * light_emitted * weight / light_pdf_val;
+				}
 			}
 		}
+
+		// material sample, continues the path, emission it hits is weighted on the next bounce
+		ray scattered = ray(rec.p, sampling_pdf->generate(g), r.time());
+		real pdf_val = sampling_pdf->value(scattered.direction());
+		real scattering_pdf = rec.mat_ptr->scattering_pdf(r, rec, scattered);
+
+		// a learned direction can point below the surface
+		if (pdf_val <= 0.0 || scattering_pdf <= 0.0)
+			break;
+
+		throughput *= srec.attenuation * scattering_pdf / pdf_val;
+		r = scattered;
+		material_pdf_of_r = sample_lights ? pdf_val : 0;
+		origin_of_r = rec.p;
+
+		if (guide != nullptr && guide->training && record_count < guiding_max_vertices)
+			records[record_count++] = { leaf, normalize(scattered.direction()), pdf_val, radiance, throughput };
 	}
+
+	if (record_count > 0)
+		guide->record(records, record_count, radiance);
+	return radiance;
 }
 
 // https://msdn.microsoft.com/en-us/library/dd728080.aspx
@@ -185,8 +317,8 @@ void serial_for(_Index_type _First, _Index_type _Last, _Index_type _Step, const
 template <typename _Index_type, typename _Function>
 void _for(_Index_type _First, _Index_type _Last, _Index_type _Step, const _Function& _Func)
 {
-	// Parallel gives different result every time as RNG should not used across threads
-	// Switch to Serial to get stable result
+	// Each sample draws from its own sampler started at pixel and sample index,
+	// so parallel and serial give the same result
 
 	Concurrency::parallel_for(_First, _Last, _Step, _Func);
 	//serial_for(_First, _Last, _Step, _Func);
@@ -196,52 +328,260 @@ int main(int argc, char* argv[])
 {
 	_CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
 
+	// -depth <n> overrides the bounce limit
+	// -sampler <independent|stratified|halton|sobol> picks the sample sequence
+	// -adaptive <relative error> samples each pixel until it is that precise
+	// -restir resamples direct light at first hits from neighbor pixels, every pixel takes subPixelCount
+	// -guiding learns where light comes from in training passes, then samples directions from it
+	int max_depth = default_max_depth;
+	sampler::sampler_type sampler_type = sampler::sampler_type::sobol;
+	real adaptive_error = 0;
+	bool restir = false;
+	bool guiding = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-restir") == 0)
+			restir = true;
+		else if (strcmp(argv[i], "-guiding") == 0)
+			guiding = true;
+		else if (i + 1 >= argc)
+			break;
+		else if (strcmp(argv[i], "-depth") == 0)
+			max_depth = std::max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "-sampler") == 0)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "independent") == 0)		sampler_type = sampler::sampler_type::independent;
+			else if (strcmp(name, "stratified") == 0)	sampler_type = sampler::sampler_type::stratified;
+			else if (strcmp(name, "halton") == 0)		sampler_type = sampler::sampler_type::halton;
+			else if (strcmp(name, "sobol") == 0)		sampler_type = sampler::sampler_type::sobol;
+		}
+		else if (strcmp(argv[i], "-adaptive") == 0)
+			adaptive_error = static_cast<real>(atof(argv[++i]));
+	}
+
+	// without adaptive every pixel takes one batch of subPixelCount
+	guiding = guiding && !restir;
+	const bool adaptive = adaptive_error > 0 && !restir && !guiding;
+	const int batch_samples = adaptive ? adaptive_batch : subPixelCount;
+	const int max_samples = adaptive ? adaptive_max_samples : subPixelCount;
+
 	//typedef dielectric_scene scene_type;
 	//typedef random_balls_scene scene_type;
 	typedef cornell_box_scene scene_type;
 	//typedef light_sample scene_type;
+	//typedef many_lights_scene scene_type;
+	//typedef mesh_scene scene_type;
+	//typedef environment_scene scene_type;
+	//typedef indirect_box_scene scene_type;
 
 	scene_type scene(nx * 1.0 / ny);
+	__int64 elapsedBuild = time_call([&]
+	{
+		scene.Build();
+	});
 	auto& cam = scene.GetCamera();
 
-	std::uniform_real_distribution<double> uniform;
-	std::minstd_rand engine;
+	// concrete sampler on the stack, used through its interface
+	auto with_sampler = [&](auto&& f)
+	{
+		switch (sampler_type)
+		{
+		case sampler::sampler_type::independent:	{ independent_sampler g(max_samples); f(g); break; }
+		case sampler::sampler_type::stratified:		{ stratified_sampler g(max_samples); f(g); break; }
+		case sampler::sampler_type::halton:			{ halton_sampler g(max_samples); f(g); break; }
+		default:									{ sobol_sampler g(max_samples); f(g); break; }
+		}
+	};
 
 	std::vector<vec3> canvas(nx * ny);
+	std::atomic<long long> total_samples(0);
 	__int64 elapsedTrace = time_call([&]
 	{
-		// random function is not thread-safe... -> parallism may affect distribution
+		if (restir)
+		{
+			// whole image per sample index, a pixel needs reservoirs of its neighbors before shading
+			std::vector<restir_vertex> vertices(nx * ny);
+			std::vector<reservoir> initial(nx * ny);
+			std::vector<vec3> sums(nx * ny, vec3(0, 0, 0));
+			for (int s = 0; s < subPixelCount; s++)
+			{
+				// camera vertex and light candidates
+				_for(0, ny, 1, [&](int j)
+				{
+					for (int i = 0; i < nx; i++)
+					{
+						int pixel = j * nx + i;
+						restir_vertex& x = vertices[pixel];
+						x = restir_vertex();
+						with_sampler([&](sampler& g)
+						{
+							g.start(pixel, s);
+							sample2 jitter = g.get_2d();
+							x.r = cam.get_ray(real(i + jitter.u) / real(nx), real(j + jitter.v) / real(ny), g);
+						});
+
+						independent_sampler g;
+						g.start(pixel | restir_streams, 2 * s);
+						scatter_record srec;
+						x.valid = scene.GetRenderType() == RenderType::Shaded
+							&& scene.GetWorld().hit(x.r, 0.001f, std::numeric_limits<real>::max(), x.rec)
+							&& x.rec.mat_ptr->scatter(x.r, x.rec, srec, g) && srec.pdf_ptr.get() != nullptr;
+						x.attenuation = srec.attenuation;
+						if (x.valid && !scene.GetLights().empty())
+							restir_initial(x, scene.GetLights(), restir_candidates, g, initial[pixel]);
+						else
+							initial[pixel] = reservoir();
+					}
+				});
+
+				// spatial reuse, one shadow ray for what is kept, and the rest of the path
+				_for(0, ny, 1, [&](int j)
+				{
+					for (int i = 0; i < nx; i++)
+					{
+						int pixel = j * nx + i;
+						const restir_vertex& x = vertices[pixel];
+						vec3 direct(0, 0, 0);
+						if (x.valid)
+						{
+							independent_sampler g;
+							g.start(pixel | restir_streams, 2 * s + 1);
+
+							const restir_vertex* neighbors[restir_neighbors];
+							const reservoir* neighbor_reservoirs[restir_neighbors];
+							int count = 0;
+							for (int k = 0; k < restir_neighbors; k++)
+							{
+								sample2 offset = g.get_2d();
+								real radius = restir_radius * sqrt(offset.u);
+								real angle = real(2 * M_PI) * offset.v;
+								int ni = i + static_cast<int>(std::round(radius * cos(angle)));
+								int nj = j + static_cast<int>(std::round(radius * sin(angle)));
+								if (ni < 0 || ni >= nx || nj < 0 || nj >= ny || (ni == i && nj == j))
+									continue;
+								if (!x.similar(vertices[nj * nx + ni]))
+									continue;
+								neighbors[count] = &vertices[nj * nx + ni];
+								neighbor_reservoirs[count] = &initial[nj * nx + ni];
+								count++;
+							}
+
+							reservoir kept = restir_spatial(x, initial[pixel], neighbors, neighbor_reservoirs, count, scene.GetLights(), g);
+							if (kept.W > 0)
+							{
+								ray to_light(x.rec.p, kept.y.p - x.rec.p, x.r.time());
+								if (!scene.GetWorld().occluded(to_light, 0.001f, 1 - shadow_epsilon))
+									direct = x.contribution(kept.y) * kept.W * restir_weight(x, kept.y, scene.GetLights());
+							}
+						}
+
+						with_sampler([&](sampler& g)
+						{
+							g.start(pixel, s);
+							sums[pixel] += direct + color(x.r, &scene, max_depth, g, !x.valid);
+						});
+					}
+				});
+			}
+
+			for (int pixel = 0; pixel < nx * ny; pixel++)
+			{
+				vec3 col = sums[pixel] / static_cast<real>(subPixelCount);
+				canvas[pixel] = vec3(std::min(sqrt(col.x), real(1)), std::min(sqrt(col.y), real(1)), std::min(sqrt(col.z), real(1)));
+			}
+			total_samples = static_cast<long long>(subPixelCount) * nx * ny;
+			return;
+		}
+
+		if (guiding)
+		{
+			aabb bounds;
+			scene.GetWorld().bounding_box(cam.time0, cam.time1, bounds);
+			path_guide guide;
+			guide.build(bounds);
+
+			// sample indices go on from pass to pass, as one sequence of subPixelCount
+			int first = 0;
+			for (int pass = 0; first < subPixelCount; pass++)
+			{
+				int count = 1 << pass;
+				guide.training = first + count <= guiding_training_samples;
+				if (!guide.training)
+					count = subPixelCount - first;
+
+				_for(0, ny, 1, [&](int j)
+				{
+					for (int i = 0; i < nx; i++)
+					{
+						vec3 sum(0, 0, 0);
+						with_sampler([&](sampler& g)
+						{
+							for (int s = first; s < first + count; s++)
+							{
+								g.start(j * nx + i, s);
+								sample2 jitter = g.get_2d();
+								ray r = cam.get_ray(real(i + jitter.u) / real(nx), real(j + jitter.v) / real(ny), g);
+								sum += color(r, &scene, max_depth, g, true, &guide);
+							}
+						});
+
+						vec3 col = sum / static_cast<real>(count);
+						canvas[j * nx + i] = vec3(std::min(sqrt(col.x), real(1)), std::min(sqrt(col.y), real(1)), std::min(sqrt(col.z), real(1)));
+					}
+				});
+
+				first += count;
+				if (guide.training)
+					guide.refine(pass);
+			}
+			std::cout << "Guiding: " << guide.leaf_count() << " regions" << std::endl;
+			total_samples = static_cast<long long>(subPixelCount) * nx * ny;
+			return;
+		}
+
 		_for(0, ny, 1, [&](int j)
 		{
 			_for(0, nx, 1, [&](int i)
 			{
-				vec3 subPixels[subPixelCount];
-				_for(0, subPixelCount, 1, [&](int s)
+				vec3 subPixels[adaptive_max_samples];
+				pixel_estimate estimate;
+				while (estimate.count < max_samples)
 				{
+					int first = estimate.count;
+					_for(first, first + batch_samples, 1, [&](int s)
+					{
 #ifdef DEBUG_RAY
-					// DEBUG_RAY point at center
-					i = nx / 2;
-					j = ny / 2;
+						// DEBUG_RAY point at center
+						i = nx / 2;
+						j = ny / 2;
 #endif
 
-					double u = double(i + uniform(engine)) / double(nx);
-					double v = double(j + uniform(engine)) / double(ny);
+						with_sampler([&](sampler& g)
+						{
+							g.start(j * nx + i, s);
+							sample2 jitter = g.get_2d();
+							real u = real(i + jitter.u) / real(nx);
+							real v = real(j + jitter.v) / real(ny);
 
-					// trace
-					ray r = cam.get_ray(u, v);
-					subPixels[s] = color(r, &scene, max_depth);
-				});
+							// trace
+							ray r = cam.get_ray(u, v, g);
+							subPixels[s] = color(r, &scene, max_depth, g);
+						});
+					});
 
-				vec3 sum(0, 0, 0);
-				for (vec3& c : subPixels) // even slower with parallel_reduce
-				{
-					sum += c;
+					for (int s = first; s < first + batch_samples; s++) // even slower with parallel_reduce
+						estimate.add(subPixels[s]);
+
+					if (adaptive && estimate.relative_error() < adaptive_error)
+						break;
 				}
+				total_samples += estimate.count;
 
-				vec3 col = sum / static_cast<double>(subPixelCount);
+				vec3 col = estimate.sum / static_cast<real>(estimate.count);
 
 				// to gamma 2, and clamp
-				col = vec3(std::min(sqrt(col.x), 1.0), std::min(sqrt(col.y), 1.0), std::min(sqrt(col.z), 1.0));
+				col = vec3(std::min(sqrt(col.x), real(1)), std::min(sqrt(col.y), real(1)), std::min(sqrt(col.z), real(1)));
 
 				// save to canvas
 				canvas[j * nx + i] = col;
@@ -276,8 +616,10 @@ int main(int argc, char* argv[])
 	});
 
 	std::cout.rdbuf(coutbuf); // reset to standard output again
+	std::cout << "Build: " << elapsedBuild << "ms" << std::endl;
 	std::cout << "Trace: " << elapsedTrace << "ms" << std::endl;
 	std::cout << "Write: " << elapsedWrite << "ms" << std::endl;
+	std::cout << "Samples: " << static_cast<double>(total_samples) / (nx * ny) << " per pixel" << std::endl;
 
 	out.close();
 
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "../hittable_list.h"
+#include "../bvh.h"
+#include "../light_bvh.h"
+#include "../environment.h"
+#include "../instance.h"
+#include "../triangle_mesh.h"
 #include "../camera.h"
 
 enum class RenderType
@@ -13,6 +18,14 @@ enum class BackgroundType
 {
 	Black,
 	Gradient,
+	Environment, // lat-long HDR image, also a light
+};
+
+enum class AccelerationType
+{
+	BVH2,
+	BVH4, // SSE
+	BVH8, // AVX if available
 };
 
 class scene
@@ -23,26 +36,57 @@ public:
 
 	void Add(std::shared_ptr<hittable> h) { world.objects.push_back(h); }
 
-	const hittable_list& GetWorld() const { return world; };
-	std::shared_ptr<hittable_list> GetLights() const { return lights; }
+	// background seen by rays that leave the scene, sampled among the lights
+	void SetEnvironment(std::shared_ptr<environment_light> e)
+	{
+		environment = e;
+		background_type = BackgroundType::Environment;
+		lights->objects.push_back(e);
+	}
+
+	// build acceleration structure over world, call after scene is set up
+	// instances in world make it the top level over their shared bottom level bvh
+	void Build()
+	{
+		accel = std::make_shared<bvh>(world.objects, cam.time0, cam.time1, GetAccelerationWidth());
+		light_tree.build(lights->objects, cam.time0, cam.time1);
+	}
+
+	int GetAccelerationWidth() const
+	{
+		switch (acceleration_type)
+		{
+		case AccelerationType::BVH4: return 4;
+		case AccelerationType::BVH8: return 8;
+		default: return 2;
+		}
+	}
+
+	const hittable& GetWorld() const { if (accel != nullptr) return *accel; return world; };
+	const light_bvh& GetLights() const { return light_tree; }
 	RenderType GetRenderType() const { return render_type; }
 	BackgroundType GetBackgroundType() const { return background_type; }
+	const environment_light* GetEnvironment() const { return environment.get(); }
 
 	camera& GetCamera() { return cam; };
 
 protected:
 	hittable_list world;
+	std::shared_ptr<hittable> accel;
 	std::shared_ptr<hittable_list> lights = std::make_shared<hittable_list>();
+	light_bvh light_tree; // over lights, by Build()
+	std::shared_ptr<environment_light> environment; // with BackgroundType::Environment
 	camera cam;
 
 	RenderType render_type = RenderType::Shaded;
 	BackgroundType background_type = BackgroundType::Gradient;
+	AccelerationType acceleration_type = AccelerationType::BVH4;
 };
 
 class light_sample : public scene
 {
 public:
-	light_sample(double aspect) : scene()
+	light_sample(real aspect) : scene()
 	{
 		std::shared_ptr<texture> pertext = std::make_shared<noise_texture>(4.0);
 		std::shared_ptr<texture> four = std::make_shared<constant_texture>(vec3(4, 4, 4)); // color with scale
@@ -72,7 +116,7 @@ public:
 class dielectric_scene : public scene
 {
 public:
-	dielectric_scene(double aspect) : scene()
+	dielectric_scene(real aspect) : scene()
 	{
 		Add(std::make_shared<sphere>(vec3(0, 0, -1), 0.5f,
 			std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.1f, 0.2f, 0.5f)))));
@@ -98,7 +142,7 @@ public:
 class random_balls_scene : public scene
 {
 public:
-	random_balls_scene(double aspect) : scene()
+	random_balls_scene(real aspect) : scene()
 	{
 		std::uniform_real_distribution<double> uniform;
 		std::minstd_rand engine;
@@ -112,7 +156,7 @@ public:
 		for (int a = -11; a < 11; a++)
 			for (int b = -11; b < 11; b++)
 			{
-				double choose_mat = uniform(engine);
+				real choose_mat = uniform(engine);
 				vec3 center(a + 0.9f * uniform(engine), 0.2f, b + 0.9f * uniform(engine));
 				if ((center - vec3(4.0, 0.2f, 0.0)).length() > 0.9f)
 				{
@@ -145,13 +189,13 @@ public:
 							color.r = 0.5f * (1 + uniform(engine));
 							color.g = 0.5f * (1 + uniform(engine));
 							color.b = 0.5f * (1 + uniform(engine));
-							double fuzz = 0.5f * uniform(engine);
+							real fuzz = 0.5f * uniform(engine);
 							Add(std::make_shared<sphere>(center, 0.2f, std::make_shared<metal>(color, fuzz)));
 						}
 						else // glass
 						{
 							vec3 color;
-							double ref_idx = 1.5f;
+							real ref_idx = 1.5f;
 							Add(std::make_shared<sphere>(center, 0.2f, std::make_shared<dielectric>(ref_idx)));
 						}
 					}
@@ -176,7 +220,7 @@ public:
 class cornell_box_scene : public scene
 {
 public:
-	cornell_box_scene(double aspect) : scene()
+	cornell_box_scene(real aspect) : scene()
 	{
 		// Cornell box
 		std::shared_ptr<texture> red_tex = std::make_shared<constant_texture>(vec3(0.65f, 0.05f, 0.05f));
@@ -209,12 +253,12 @@ public:
 			std::make_shared<flip_normals>(
 				std::make_shared<xy_rect>(0.0, 555.0, 0.0, 555.0, 555.0, white)));
 
+		// boxes are instanced, translate(rotate_y(box)) in the book
+		auto short_box = std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 165.0, 165.0), white);
 		objects.push_back(
-			std::make_shared<translate>(
-				std::make_shared<rotate_y>(
-					std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 165.0, 165.0), white),
-					-18.0),
-				vec3(130.0, 0.0, 65.0)));
+			std::make_shared<instance>(
+				short_box,
+				transform::translation(vec3(130.0, 0.0, 65.0)) * transform::rotation_y(-18.0)));
 
 #if 1 // book3.chapter12 - glass sphere
  		objects.pop_back(); // pop short box
@@ -230,12 +274,11 @@ public:
 		tall_box_material = aluminum;
 #endif // book3.chapter12.2
 		
+		auto tall_box = std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 330.0, 165.0), tall_box_material);
 		objects.push_back(
-			std::make_shared<translate>(
-				std::make_shared<rotate_y>(
-					std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 330.0, 165.0), tall_box_material),
-					15.0),
-				vec3(265.0, 0.0, 295.0)));
+			std::make_shared<instance>(
+				tall_box,
+				transform::translation(vec3(265.0, 0.0, 295.0)) * transform::rotation_y(15.0)));
 
 		auto lookfrom = vec3(278.0, 278.0, -800.0);
 		auto lookat = vec3(278.0, 278.0, 0.0);
@@ -247,4 +290,156 @@ public:
 		this->cam = camera(lookfrom, lookat, vec3(0.0, 1.0, 0.0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
 		this->background_type = BackgroundType::Black;
 	}
-};
\ No newline at end of file
+};
+
+// Cornell box with its light turned to the ceiling, what is not under the light only sees the lit ceiling
+// and walls, so nearly all of it is indirect light that light sampling can not find
+class indirect_box_scene : public scene
+{
+public:
+	indirect_box_scene(real aspect) : scene()
+	{
+		auto red = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.65f, 0.05f, 0.05f)));
+		auto white = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.73f, 0.73f, 0.73f)));
+		auto green = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.12f, 0.45f, 0.15f)));
+		auto light = std::make_shared<diffuse_light>(std::make_shared<constant_texture>(vec3(15.0, 15.0, 15.0)));
+
+		// emits upwards, its back is black
+		Add(std::make_shared<flip_normals>(std::make_shared<xz_rect>(213.0, 343.0, 227.0, 332.0, 500.0, light)));
+		lights->objects.push_back(world.objects.back());
+
+		Add(std::make_shared<flip_normals>(std::make_shared<yz_rect>(0.0, 555.0, 0.0, 555.0, 555.0, green)));
+		Add(std::make_shared<yz_rect>(0.0, 555.0, 0.0, 555.0, 0.0, red));
+		Add(std::make_shared<flip_normals>(std::make_shared<xz_rect>(0.0, 555.0, 0.0, 555.0, 555.0, white)));
+		Add(std::make_shared<xz_rect>(0.0, 555.0, 0.0, 555.0, 0.0, white));
+		Add(std::make_shared<flip_normals>(std::make_shared<xy_rect>(0.0, 555.0, 0.0, 555.0, 555.0, white)));
+
+		auto short_box = std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 165.0, 165.0), white);
+		Add(std::make_shared<instance>(short_box, transform::translation(vec3(130.0, 0.0, 65.0)) * transform::rotation_y(-18.0)));
+		auto tall_box = std::make_shared<box>(vec3(0.0, 0.0, 0.0), vec3(165.0, 330.0, 165.0), white);
+		Add(std::make_shared<instance>(tall_box, transform::translation(vec3(265.0, 0.0, 295.0)) * transform::rotation_y(15.0)));
+
+		auto lookfrom = vec3(278.0, 278.0, -800.0);
+		auto lookat = vec3(278.0, 278.0, 0.0);
+		auto dist_to_focus = 10.0;
+		auto aperture = 0.0;
+		auto vfov = 40.0;
+
+		this->cam = camera(lookfrom, lookat, vec3(0.0, 1.0, 0.0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
+		this->background_type = BackgroundType::Black;
+	}
+};
+
+// grid of small lights facing down over a floor, so light sampling cost and noise can be compared by light count
+class many_lights_scene : public scene
+{
+public:
+	many_lights_scene(real aspect, int light_grid = 32) : scene()
+	{
+		std::uniform_real_distribution<double> uniform;
+		std::minstd_rand engine;
+
+		auto white = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.73f, 0.73f, 0.73f)));
+		Add(std::make_shared<xz_rect>(-50.0, 50.0, -50.0, 50.0, 0.0, white));
+		for (int i = -2; i <= 2; i++)
+		{
+			vec3 color(uniform(engine), uniform(engine), uniform(engine));
+			Add(std::make_shared<sphere>(vec3(i * 4.0f, 1.0, 0.0), 1.0, std::make_shared<lambertian>(std::make_shared<constant_texture>(color))));
+		}
+
+		// same total power whatever the count, a few of them much brighter
+		real spacing = 40.0f / light_grid;
+		real half_size = 0.2f * spacing;
+		for (int a = 0; a < light_grid; a++)
+			for (int b = 0; b < light_grid; b++)
+			{
+				vec3 center(-20 + (a + uniform(engine)) * spacing, 4 + 4 * uniform(engine), -20 + (b + uniform(engine)) * spacing);
+				vec3 color(uniform(engine), uniform(engine), uniform(engine));
+				real intensity = (uniform(engine) < 0.02 ? 20.0f : 2.0f) * 100.0f / (light_grid * light_grid);
+				auto light = std::make_shared<diffuse_light>(std::make_shared<constant_texture>(color * intensity / (half_size * half_size)));
+				Add(std::make_shared<xz_rect>(center.x - half_size, center.x + half_size, center.z - half_size, center.z + half_size, center.y, light));
+				lights->objects.push_back(world.objects.back());
+			}
+
+		auto lookfrom = vec3(0.0, 3.0, 22.0);
+		auto lookat = vec3(0.0, 1.0, 0.0);
+		auto dist_to_focus = 10.0;
+		auto aperture = 0.0;
+		auto vfov = 40.0;
+
+		this->cam = camera(lookfrom, lookat, vec3(0.0, 1.0, 0.0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
+		this->background_type = BackgroundType::Black;
+	}
+};
+
+// OBJ or binary PLY framed by its bounds
+class mesh_scene : public scene
+{
+public:
+	mesh_scene(real aspect, const std::string& path = "mesh.obj") : scene()
+	{
+		auto white = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.73f, 0.73f, 0.73f)));
+
+		bool is_ply = path.size() >= 4 && path.compare(path.size() - 4, 4, ".ply") == 0;
+		std::shared_ptr<triangle_mesh> mesh = is_ply ?
+			triangle_mesh::load_ply(path, white, GetAccelerationWidth()) :
+			triangle_mesh::load_obj(path, white, GetAccelerationWidth());
+
+		aabb box(vec3(-1.0), vec3(1.0));
+		if (mesh != nullptr && mesh->bounding_box(0.0, 1.0, box))
+		{
+			Add(mesh);
+			std::cout << "Mesh: " << mesh->triangle_count() << " triangles" << std::endl;
+		}
+		else
+		{
+			std::cout << "Mesh: failed to load " << path << std::endl;
+		}
+
+		// look from front, far enough to see whole bounds
+		vec3 center = box.centroid();
+		real radius = 0.5 * (box.max() - box.min()).length();
+		auto vfov = 40.0;
+		auto lookat = center;
+		auto lookfrom = center + vec3(0.0, 0.0, 1.2 * radius / tan(0.5 * vfov * M_PI / 180.0));
+		auto dist_to_focus = 10.0;
+		auto aperture = 0.0;
+
+		this->cam = camera(lookfrom, lookat, vec3(0.0, 1.0, 0.0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
+	}
+};
+
+// spheres on a ground lit only by a lat-long HDR image, gradient background if it can not be read
+class environment_scene : public scene
+{
+public:
+	environment_scene(real aspect, const std::string& path = "environment.hdr") : scene()
+	{
+		std::shared_ptr<texture> ground = std::make_shared<constant_texture>(vec3(0.5f, 0.5f, 0.5f));
+		Add(std::make_shared<sphere>(vec3(0, -1000, 0), 1000.0, std::make_shared<lambertian>(ground)));
+
+		Add(std::make_shared<sphere>(vec3(-4, 1, 0), 1.0, std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.4f, 0.2f, 0.1f)))));
+		Add(std::make_shared<sphere>(vec3(0, 1, 0), 1.0, std::make_shared<dielectric>(1.5f)));
+		Add(std::make_shared<sphere>(vec3(4, 1, 0), 1.0, std::make_shared<metal>(vec3(0.7f, 0.6f, 0.5f), 0.1f)));
+		Add(std::make_shared<sphere>(vec3(2, 0.5f, 2.5f), 0.5f, std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.73f, 0.73f, 0.73f)))));
+
+		std::shared_ptr<environment_light> environment_map = environment_light::load_hdr(path);
+		if (environment_map != nullptr)
+		{
+			SetEnvironment(environment_map);
+			std::cout << "Environment: " << environment_map->image->nx << "x" << environment_map->image->ny << std::endl;
+		}
+		else
+		{
+			std::cout << "Environment: failed to load " << path << std::endl;
+		}
+
+		auto lookfrom = vec3(13, 2, 3);
+		auto lookat = vec3(0, 0.5f, 0);
+		auto dist_to_focus = 10.0;
+		auto aperture = 0.0;
+		auto vfov = 30.0;
+
+		this->cam = camera(lookfrom, lookat, vec3(0.0, 1.0, 0.0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
+	}
+};
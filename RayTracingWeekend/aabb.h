@@ -1,66 +1,78 @@
 #pragma once
 
 #include <algorithm>
+#include <limits>
 
 #include "vec3.h"
 #include "ray.h"
 
-class aabb
+template <typename T>
+class aabb_t
 {
 public:
-	aabb() {};
-	aabb(const vec3& a, const vec3 &b) { _min = a; _max = b; }
+	aabb_t() {};
+	aabb_t(const vec3_t<T>& a, const vec3_t<T> &b) { bounds[0] = a; bounds[1] = b; }
 
-	vec3 min() const { return _min; }
-	vec3 max() const { return _max; }
+	const vec3_t<T>& min() const { return bounds[0]; }
+	const vec3_t<T>& max() const { return bounds[1]; }
 
-	bool hit(const ray& r, double tmin, double tmax) const
+	bool hit(const ray_t<T>& r, T tmin, T tmax) const
+	{
+		return hit(traversal_ray_t<T>(r), tmin, tmax);
+	}
+
+	// "slab" method
+	bool hit(const traversal_ray_t<T>& r, T tmin, T tmax) const
 	{
-		// "slab" method
 		for (int axis = 0; axis < 3; axis++)
 		{
-			double invD = 1.0 / r.direction()[axis];
-
 			// calculate t to let ray reach two side of aabb
-			double t0 = (min()[axis] - r.origin()[axis]) * invD;
-			double t1 = (max()[axis] - r.origin()[axis]) * invD;
-
-			if (invD < 0.0)
-			{
-				// flip when ray is towards minus
-				std::swap(t0, t1);
-			}
+			// near side is max when ray is towards minus
+			T t0 = (bounds[r.sign[axis]][axis] - r.origin[axis]) * r.inv_direction[axis];
+			T t1 = (bounds[1 - r.sign[axis]][axis] - r.origin[axis]) * r.inv_direction[axis];
 
 			// no need to use std::fmax since boundary condition is already considered
-			tmin = std::max(t0, tmin);
-			tmax = std::min(t1, tmax);
-
-			// check if there is overlap between slabs (formed by intersections)
-			// slabs are along ray direction (1D range), so compare t is sufficient
-			if (tmax <= tmin)
-			{
-				return false;
-			}
+			// written to compile to min/max without branch
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
 		}
 
-		return true;
+		// check if there is overlap between slabs (formed by intersections)
+		// slabs are along ray direction (1D range), so compare t is sufficient
+		return tmin < tmax;
+	}
+
+	T surface_area() const
+	{
+		vec3_t<T> d = bounds[1] - bounds[0];
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
 	}
 
-	static aabb surrounding(aabb& box0, aabb& box1)
+	vec3_t<T> centroid() const { return T(0.5) * (bounds[0] + bounds[1]); }
+
+	// inverted box, grows to whatever is added first
+	static aabb_t empty()
 	{
-		vec3 small(
+		T floatMax = std::numeric_limits<T>::max();
+		return aabb_t(vec3_t<T>(floatMax, floatMax, floatMax), vec3_t<T>(-floatMax, -floatMax, -floatMax));
+	}
+
+	static aabb_t surrounding(const aabb_t& box0, const aabb_t& box1)
+	{
+		vec3_t<T> small(
 			fmin(box0.min().x, box1.min().x),
 			fmin(box0.min().y, box1.min().y), 
 			fmin(box0.min().z, box1.min().z));
 
-		vec3 big(
+		vec3_t<T> big(
 			fmax(box0.max().x, box1.max().x),
 			fmax(box0.max().y, box1.max().y),
 			fmax(box0.max().z, box1.max().z));
 
-		return aabb(small, big);
+		return aabb_t(small, big);
 	}
 	
-	vec3 _min;
-	vec3 _max;
-};
\ No newline at end of file
+	vec3_t<T> bounds[2]; // min, max, indexed by traversal_ray::sign
+};
+
+typedef aabb_t<real> aabb;
\ No newline at end of file
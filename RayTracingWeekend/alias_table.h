@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "vec3.h"
+
+// Discrete distribution over n items sampled in O(1) from a single uniform number
+// Each of n equal columns holds its own item up to prob and an alias above it.
+// See Vose, "A Linear Algorithm for Generating Random Numbers with a Given Distribution", 1991
+class alias_table
+{
+public:
+	alias_table() {}
+	alias_table(const std::vector<real>& weights) { build(weights); }
+
+	// all weights 0 leaves it empty
+	void build(const std::vector<real>& weights)
+	{
+		size_t n = weights.size();
+		double total = 0;
+		for (real w : weights)
+			total += std::max(w, real(0));
+
+		pmfs.clear();
+		columns.clear();
+		if (n == 0 || total <= 0)
+			return;
+
+		pmfs.resize(n);
+		columns.resize(n);
+		std::vector<double> scaled(n);
+		std::vector<size_t> small, large;
+		for (size_t i = 0; i < n; i++)
+		{
+			pmfs[i] = static_cast<real>(std::max(weights[i], real(0)) / total);
+			scaled[i] = std::max(weights[i], real(0)) * n / total;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			size_t s = small.back(); small.pop_back();
+			size_t l = large.back(); large.pop_back();
+
+			columns[s] = { static_cast<real>(scaled[s]), static_cast<uint32_t>(l) };
+			scaled[l] += scaled[s] - 1;
+			(scaled[l] < 1 ? small : large).push_back(l);
+		}
+
+		// left over only by rounding, full columns
+		for (size_t i : large)
+			columns[i] = { real(1), static_cast<uint32_t>(i) };
+		for (size_t i : small)
+			columns[i] = { real(1), static_cast<uint32_t>(i) };
+	}
+
+	bool empty() const { return columns.empty(); }
+	size_t size() const { return columns.size(); }
+
+	real pmf(size_t i) const { return pmfs[i]; }
+
+	// column from the integer part of u * n, its item or alias from the fraction
+	size_t sample(real u) const
+	{
+		real scaled = u * columns.size();
+		size_t i = std::min(static_cast<size_t>(scaled), columns.size() - 1);
+		return (scaled - i) < columns[i].prob ? i : columns[i].alias;
+	}
+
+private:
+	struct column
+	{
+		real prob;
+		uint32_t alias;
+	};
+
+	std::vector<real> pmfs;
+	std::vector<column> columns;
+};
@@ -0,0 +1,1065 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <array>
+
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "primitive_table.h"
+
+#include <ppl.h>
+#include <immintrin.h>
+
+// Flattened BVH node
+// 32 bytes, so two of them share a cache line
+// Nodes are stored depth-first: the first child of an interior node is always the next node,
+// only the second child needs an index, and leaves reference a contiguous range of primitives.
+struct bvh_linear_node
+{
+	float bounds_min[3];
+	float bounds_max[3];
+	uint32_t offset;	// leaf: first primitive, interior: second child
+	uint16_t count;		// leaf: primitive count, interior: 0
+	uint8_t axis;		// interior: split axis, decides which child to visit first
+	uint8_t moving;		// bounds differ at time0 and time1, see bvh_node_bounds
+
+	bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(bvh_linear_node) == 32, "bvh_linear_node should fit in 32 bytes");
+
+// Node bounds at time1 for motion blur, kept apart so static trees stay 32 bytes per node
+// bvh_linear_node holds bounds at time0, box at ray time is interpolated in between.
+struct bvh_node_bounds
+{
+	float bounds_min[3];
+	float bounds_max[3];
+};
+
+// round outward so float bounds still contain the double ones
+inline float float_round_down(double d)
+{
+	float f = static_cast<float>(d);
+	return f > d ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_round_up(double d)
+{
+	float f = static_cast<float>(d);
+	return f < d ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Primitive agnostic BVH
+// Built from precomputed primitive bounds with binned surface area heuristic (SAH)
+// Owner reorders its primitives with the returned order, then leaf ranges index into them directly.
+// See Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies"
+//
+// Large ranges are binned in parallel chunks, large subtrees are built as parallel tasks into
+// their own node arrays and spliced back in depth-first order.
+//
+// With bounds at both shutter times (motion blur), nodes bound primitives at time0 and time1 separately,
+// instead of their union over the whole shutter, and are interpolated at ray time when traversed.
+// As long as primitives move linearly, interpolated bounds still contain them.
+class bvh_tree
+{
+public:
+	static const int bin_count = 16;
+	static const int max_leaf_size = 4;
+
+	// traversal stacks hold 64 entries, past max_depth splits are at the median, which adds at most 32 more
+	static const int max_depth = 32;
+
+	// cost relative to one primitive intersection
+	static constexpr double traversal_cost = 1.0;
+
+	// below these sizes threading costs more than it saves
+	static const uint32_t parallel_chunk_size = 16 * 1024;
+	static const uint32_t parallel_subtree_size = 4 * 1024;
+
+	std::vector<uint32_t> build(const std::vector<aabb>& boxes)
+	{
+		return build(boxes, std::vector<aabb>(), 0.0, 1.0);
+	}
+
+	// end_boxes: bounds at time1, empty for static primitives
+	std::vector<uint32_t> build(const std::vector<aabb>& boxes, const std::vector<aabb>& end_boxes, real t0, real t1)
+	{
+		nodes.clear();
+		end_bounds.clear();
+		time0 = t0;
+		time1 = t1;
+
+		bool motion = !end_boxes.empty();
+
+		std::vector<uint32_t> order(boxes.size());
+		if (boxes.empty())
+			return order;
+
+		std::vector<vec3> centroids(boxes.size());
+		concurrency::parallel_for(size_t(0), boxes.size(), [&](size_t i)
+		{
+			order[i] = static_cast<uint32_t>(i);
+			// split by position in the middle of shutter
+			centroids[i] = motion ? 0.5 * (boxes[i].centroid() + end_boxes[i].centroid()) : boxes[i].centroid();
+		});
+
+		build_context context = { boxes, motion ? &end_boxes : nullptr, centroids, order };
+		nodes.reserve(2 * boxes.size());
+		if (motion)
+			end_bounds.reserve(2 * boxes.size());
+		build_recursive(context, 0, static_cast<uint32_t>(boxes.size()), 0, nodes, end_bounds);
+
+		return order;
+	}
+
+	bool has_motion() const { return !end_bounds.empty(); }
+
+	// bounds over whole shutter
+	aabb bounds() const
+	{
+		if (nodes.empty())
+			return aabb();
+
+		const bvh_linear_node& root = nodes[0];
+		aabb box(
+			vec3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+			vec3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+		if (has_motion())
+		{
+			const bvh_node_bounds& end = end_bounds[0];
+			box = aabb::surrounding(box, aabb(
+				vec3(end.bounds_min[0], end.bounds_min[1], end.bounds_min[2]),
+				vec3(end.bounds_max[0], end.bounds_max[1], end.bounds_max[2])));
+		}
+		return box;
+	}
+
+	// where ray time is between time0 and time1
+	real time_factor(real time) const
+	{
+		if (time1 <= time0)
+			return 0.0;
+		return clamp((time - time0) / (time1 - time0), real(0), real(1));
+	}
+
+	// leaf(first, count, t_max) tests primitives in [first, first + count), shrinks t_max on hit and returns true
+	// any_hit returns at the first leaf reporting a hit, for occlusion
+	template <bool any_hit = false, typename leaf_function>
+	bool traverse(const ray& r, real t_min, real& t_max, leaf_function&& leaf) const
+	{
+		if (nodes.empty())
+			return false;
+
+		// compute once per ray instead of once per box
+		traversal_ray tr(r);
+
+		bool motion = has_motion();
+		real factor = motion ? time_factor(r.time()) : 0.0;
+
+		bool hit_anything = false;
+
+		uint32_t stack[64];
+		int stack_size = 0;
+		uint32_t current = 0;
+		while (true)
+		{
+			const bvh_linear_node& node = nodes[current];
+
+			// min, max as aabb::bounds
+			real bounds[2][3];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				bounds[0][axis] = node.bounds_min[axis];
+				bounds[1][axis] = node.bounds_max[axis];
+			}
+			if (motion && node.moving)
+			{
+				const bvh_node_bounds& end = end_bounds[current];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					bounds[0][axis] += factor * (end.bounds_min[axis] - bounds[0][axis]);
+					bounds[1][axis] += factor * (end.bounds_max[axis] - bounds[1][axis]);
+				}
+			}
+
+			if (hit_node(bounds, tr, t_min, t_max))
+			{
+				if (node.is_leaf())
+				{
+					if (leaf(node.offset, node.count, t_max))
+					{
+						if (any_hit)
+							return true;
+						hit_anything = true;
+					}
+				}
+				else
+				{
+					// visit near child first so far one can be culled by t_max
+					if (tr.sign[node.axis])
+					{
+						stack[stack_size++] = current + 1;
+						current = node.offset;
+					}
+					else
+					{
+						stack[stack_size++] = node.offset;
+						current = current + 1;
+					}
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+
+		return hit_anything;
+	}
+
+	std::vector<bvh_linear_node> nodes;
+	std::vector<bvh_node_bounds> end_bounds; // same order as nodes, empty if nothing moves
+	real time0 = 0.0;
+	real time1 = 1.0;
+
+private:
+	static bool hit_node(const real bounds[2][3], const traversal_ray& r, real t_min, real t_max)
+	{
+		// "slab" method as aabb::hit
+		// written so that NaN (0 * inf, ray on the slab plane) keeps the previous value
+		for (int axis = 0; axis < 3; axis++)
+		{
+			real t0 = (bounds[r.sign[axis]][axis] - r.origin[axis]) * r.inv_direction[axis];
+			real t1 = (bounds[1 - r.sign[axis]][axis] - r.origin[axis]) * r.inv_direction[axis];
+
+			// 1 + 2 * gamma(3) from pbrt, rounding error may cull a ray grazing the box boundary
+			t1 *= 1.0 + 3.0 * std::numeric_limits<real>::epsilon();
+
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+		}
+
+		return t_min <= t_max;
+	}
+
+	struct build_context
+	{
+		const std::vector<aabb>& boxes;
+		const std::vector<aabb>* end_boxes; // nullptr if static
+		const std::vector<vec3>& centroids;
+		std::vector<uint32_t>& order;
+	};
+
+	struct bin
+	{
+		aabb box = aabb::empty();
+		aabb end_box = aabb::empty();
+		uint32_t count = 0;
+	};
+
+	// SAH with motion takes the average of areas at both ends of shutter
+	static double area(const aabb& box, const aabb& end_box, bool motion)
+	{
+		return motion ? 0.5 * (box.surface_area() + end_box.surface_area()) : box.surface_area();
+	}
+
+	static uint32_t chunk_count(uint32_t begin, uint32_t end)
+	{
+		return (end - begin + parallel_chunk_size - 1) / parallel_chunk_size;
+	}
+
+	// f(chunk, chunk_begin, chunk_end) for each chunk in parallel
+	template <typename chunk_function>
+	static void parallel_for_each_chunk(uint32_t begin, uint32_t end, chunk_function&& f)
+	{
+		concurrency::parallel_for(0u, chunk_count(begin, end), [&](uint32_t chunk)
+		{
+			uint32_t chunk_begin = begin + chunk * parallel_chunk_size;
+			f(chunk, chunk_begin, std::min(chunk_begin + parallel_chunk_size, end));
+		});
+	}
+
+	static void make_leaf(bvh_linear_node& node, const aabb& bounds, uint32_t begin, uint32_t end)
+	{
+		set_bounds(node, bounds);
+		node.offset = begin;
+		node.count = static_cast<uint16_t>(end - begin);
+		node.axis = 0;
+	}
+
+	template <typename node_type>
+	static void set_bounds(node_type& node, const aabb& bounds)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			node.bounds_min[axis] = float_round_down(bounds.min()[axis]);
+			node.bounds_max[axis] = float_round_up(bounds.max()[axis]);
+		}
+	}
+
+	// append subtree built separately, returns index of its root in out
+	static uint32_t append_subtree(
+		std::vector<bvh_linear_node>& out,
+		std::vector<bvh_node_bounds>& out_end,
+		const std::vector<bvh_linear_node>& subtree,
+		const std::vector<bvh_node_bounds>& subtree_end)
+	{
+		uint32_t base = static_cast<uint32_t>(out.size());
+		for (bvh_linear_node node : subtree)
+		{
+			if (!node.is_leaf())
+				node.offset += base;
+			out.push_back(node);
+		}
+		out_end.insert(out_end.end(), subtree_end.begin(), subtree_end.end());
+		return base;
+	}
+
+	// returns index of the subtree root in out
+	static uint32_t build_recursive(
+		build_context& context,
+		uint32_t begin,
+		uint32_t end,
+		int depth,
+		std::vector<bvh_linear_node>& out,
+		std::vector<bvh_node_bounds>& out_end)
+	{
+		const std::vector<aabb>& boxes = context.boxes;
+		const std::vector<vec3>& centroids = context.centroids;
+		std::vector<uint32_t>& order = context.order;
+		bool motion = context.end_boxes != nullptr;
+
+		uint32_t node_index = static_cast<uint32_t>(out.size());
+		out.emplace_back();
+		if (motion)
+			out_end.emplace_back();
+
+		// bounds of primitives (at both ends of shutter) and of their centroids
+		auto accumulate_bounds = [&](uint32_t chunk_begin, uint32_t chunk_end, aabb& b, aabb& e, aabb& c)
+		{
+			for (uint32_t i = chunk_begin; i < chunk_end; i++)
+			{
+				b = aabb::surrounding(b, boxes[order[i]]);
+				if (motion)
+					e = aabb::surrounding(e, (*context.end_boxes)[order[i]]);
+				c = aabb::surrounding(c, aabb(centroids[order[i]], centroids[order[i]]));
+			}
+		};
+
+		aabb bounds = aabb::empty();
+		aabb bounds_end = aabb::empty();
+		aabb centroid_bounds = aabb::empty();
+		if (chunk_count(begin, end) <= 1)
+		{
+			accumulate_bounds(begin, end, bounds, bounds_end, centroid_bounds);
+		}
+		else
+		{
+			std::vector<aabb> chunk_bounds(chunk_count(begin, end), aabb::empty());
+			std::vector<aabb> chunk_end_bounds(chunk_bounds.size(), aabb::empty());
+			std::vector<aabb> chunk_centroid_bounds(chunk_bounds.size(), aabb::empty());
+			parallel_for_each_chunk(begin, end, [&](uint32_t chunk, uint32_t chunk_begin, uint32_t chunk_end)
+			{
+				accumulate_bounds(chunk_begin, chunk_end, chunk_bounds[chunk], chunk_end_bounds[chunk], chunk_centroid_bounds[chunk]);
+			});
+
+			for (size_t chunk = 0; chunk < chunk_bounds.size(); chunk++)
+			{
+				bounds = aabb::surrounding(bounds, chunk_bounds[chunk]);
+				bounds_end = aabb::surrounding(bounds_end, chunk_end_bounds[chunk]);
+				centroid_bounds = aabb::surrounding(centroid_bounds, chunk_centroid_bounds[chunk]);
+			}
+		}
+
+		if (motion)
+		{
+			set_bounds(out_end[node_index], bounds_end);
+			out[node_index].moving = bounds.min() != bounds_end.min() || bounds.max() != bounds_end.max();
+		}
+
+		uint32_t count = end - begin;
+		if (count == 1)
+		{
+			make_leaf(out[node_index], bounds, begin, end);
+			return node_index;
+		}
+
+		// split along the axis centroids spread the most
+		vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+		int axis = 0;
+		if (extent.y > extent[axis])
+			axis = 1;
+		if (extent.z > extent[axis])
+			axis = 2;
+
+		uint32_t mid = begin + count / 2;
+		if (extent[axis] <= 0.0)
+		{
+			// all centroids at the same place, nothing to gain from splitting
+			if (count <= std::numeric_limits<uint16_t>::max())
+			{
+				make_leaf(out[node_index], bounds, begin, end);
+				return node_index;
+			}
+		}
+		else if (depth >= max_depth)
+		{
+			// skewed centroids (e.g. geometric spacing) peel off a few primitives per SAH split
+			std::nth_element(&order[begin], &order[mid], &order[begin] + count, [&](uint32_t a, uint32_t b)
+			{
+				return centroids[a][axis] < centroids[b][axis];
+			});
+		}
+		else
+		{
+			real centroid_min = centroid_bounds.min()[axis];
+			real scale = bin_count / extent[axis];
+			auto bin_index = [&](uint32_t primitive)
+			{
+				int b = static_cast<int>((centroids[primitive][axis] - centroid_min) * scale);
+				return std::min(b, bin_count - 1);
+			};
+
+			auto accumulate_bins = [&](uint32_t chunk_begin, uint32_t chunk_end, bin* b)
+			{
+				for (uint32_t i = chunk_begin; i < chunk_end; i++)
+				{
+					bin& target = b[bin_index(order[i])];
+					target.box = aabb::surrounding(target.box, boxes[order[i]]);
+					if (motion)
+						target.end_box = aabb::surrounding(target.end_box, (*context.end_boxes)[order[i]]);
+					target.count++;
+				}
+			};
+
+			bin bins[bin_count];
+			if (chunk_count(begin, end) <= 1)
+			{
+				accumulate_bins(begin, end, bins);
+			}
+			else
+			{
+				// each chunk fills its own bins, merged afterwards
+				std::vector<std::array<bin, bin_count>> chunk_bins(chunk_count(begin, end));
+				parallel_for_each_chunk(begin, end, [&](uint32_t chunk, uint32_t chunk_begin, uint32_t chunk_end)
+				{
+					accumulate_bins(chunk_begin, chunk_end, chunk_bins[chunk].data());
+				});
+
+				for (const auto& local_bins : chunk_bins)
+				{
+					for (int i = 0; i < bin_count; i++)
+					{
+						bins[i].box = aabb::surrounding(bins[i].box, local_bins[i].box);
+						bins[i].end_box = aabb::surrounding(bins[i].end_box, local_bins[i].end_box);
+						bins[i].count += local_bins[i].count;
+					}
+				}
+			}
+
+			// sweep from right to get area of everything right to each split plane
+			double right_area[bin_count - 1];
+			uint32_t right_count[bin_count - 1];
+			aabb right_box = aabb::empty();
+			aabb right_end_box = aabb::empty();
+			uint32_t right_sum = 0;
+			for (int i = bin_count - 1; i > 0; i--)
+			{
+				right_box = aabb::surrounding(right_box, bins[i].box);
+				right_end_box = aabb::surrounding(right_end_box, bins[i].end_box);
+				right_sum += bins[i].count;
+				right_area[i - 1] = right_sum > 0 ? area(right_box, right_end_box, motion) : 0.0;
+				right_count[i - 1] = right_sum;
+			}
+
+			// then sweep from left and evaluate SAH for each split plane
+			int best_split = -1;
+			double best_cost = std::numeric_limits<double>::max();
+			aabb left_box = aabb::empty();
+			aabb left_end_box = aabb::empty();
+			uint32_t left_sum = 0;
+			for (int i = 0; i < bin_count - 1; i++)
+			{
+				left_box = aabb::surrounding(left_box, bins[i].box);
+				left_end_box = aabb::surrounding(left_end_box, bins[i].end_box);
+				left_sum += bins[i].count;
+				if (left_sum == 0 || right_count[i] == 0)
+					continue;
+
+				double cost = left_sum * area(left_box, left_end_box, motion) + right_count[i] * right_area[i];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = i;
+				}
+			}
+
+			double leaf_cost = count;
+			double split_cost = traversal_cost + best_cost / area(bounds, bounds_end, motion);
+			if (count <= max_leaf_size && leaf_cost <= split_cost)
+			{
+				make_leaf(out[node_index], bounds, begin, end);
+				return node_index;
+			}
+
+			if (best_split >= 0)
+			{
+				uint32_t* middle = std::partition(&order[begin], &order[begin] + count, [&](uint32_t primitive)
+				{
+					return bin_index(primitive) <= best_split;
+				});
+				mid = static_cast<uint32_t>(middle - &order[0]);
+			}
+		}
+
+		if (mid == begin || mid == end)
+			mid = begin + count / 2;
+
+		uint32_t second_child;
+		if (count >= parallel_subtree_size)
+		{
+			std::vector<bvh_linear_node> left_nodes, right_nodes;
+			std::vector<bvh_node_bounds> left_end, right_end;
+			concurrency::parallel_invoke(
+				[&] { build_recursive(context, begin, mid, depth + 1, left_nodes, left_end); },
+				[&] { build_recursive(context, mid, end, depth + 1, right_nodes, right_end); });
+
+			append_subtree(out, out_end, left_nodes, left_end);
+			second_child = append_subtree(out, out_end, right_nodes, right_end);
+		}
+		else
+		{
+			build_recursive(context, begin, mid, depth + 1, out, out_end);
+			second_child = build_recursive(context, mid, end, depth + 1, out, out_end);
+		}
+
+		bvh_linear_node& node = out[node_index];
+		set_bounds(node, bounds);
+		node.offset = second_child;
+		node.count = 0;
+		node.axis = static_cast<uint8_t>(axis);
+		return node_index;
+	}
+};
+
+// Wide BVH node, children bounds stored as SoA so one SIMD op tests a plane for all children
+// Empty slots have inverted bounds and are marked with bvh_wide_empty
+template <int width>
+struct bvh_wide_node
+{
+	float bounds_min[3][width];
+	float bounds_max[3][width];
+	uint32_t child[width];	// interior: node index, leaf: first primitive
+	uint16_t count[width];	// leaf: primitive count, interior: 0
+	uint32_t moving;		// any child bounds differ at time0 and time1, see bvh_wide_bounds
+};
+
+const uint32_t bvh_wide_empty = std::numeric_limits<uint32_t>::max();
+
+// children bounds at time1 for motion blur
+template <int width>
+struct bvh_wide_bounds
+{
+	float bounds_min[3][width];
+	float bounds_max[3][width];
+};
+
+// per-ray data for wide traversal, computed once
+struct bvh_wide_ray
+{
+	// origin rounded to float, towards the side that can only enlarge [t0, t1] of a slab
+	float origin_near[3];
+	float origin_far[3];
+	float inv_direction[3];
+	int direction_is_negative[3];
+};
+
+// 1 + 2 * gamma(3) from pbrt, covers rounding error of float slab test
+const float bvh_robust_scale = 1.0f + 2.0f * (3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+
+// returns bit mask of hit children and their entry distance
+// end: bounds at time1 to interpolate with factor, nullptr if children do not move
+template <int width>
+inline int intersect_children(const bvh_wide_node<width>& node, const bvh_wide_bounds<width>* end, float factor, const bvh_wide_ray& r, float t_min, float t_max, float* t_entry)
+{
+	int mask = 0;
+	for (int i = 0; i < width; i++)
+	{
+		float child_t_min = t_min;
+		float child_t_max = t_max;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int negative = r.direction_is_negative[axis];
+			float near_plane = negative ? node.bounds_max[axis][i] : node.bounds_min[axis][i];
+			float far_plane = negative ? node.bounds_min[axis][i] : node.bounds_max[axis][i];
+			if (end != nullptr)
+			{
+				near_plane += factor * ((negative ? end->bounds_max[axis][i] : end->bounds_min[axis][i]) - near_plane);
+				far_plane += factor * ((negative ? end->bounds_min[axis][i] : end->bounds_max[axis][i]) - far_plane);
+			}
+			float t0 = (near_plane - r.origin_near[axis]) * r.inv_direction[axis];
+			float t1 = (far_plane - r.origin_far[axis]) * r.inv_direction[axis];
+			child_t_min = t0 > child_t_min ? t0 : child_t_min;
+			child_t_max = t1 < child_t_max ? t1 : child_t_max;
+		}
+		t_entry[i] = child_t_min;
+		if (child_t_min <= child_t_max * bvh_robust_scale)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+#if defined(_M_X64) || defined(__SSE2__)
+// SSE: 4 children at once
+inline int intersect_children(const bvh_wide_node<4>& node, const bvh_wide_bounds<4>* end, float factor, const bvh_wide_ray& r, float t_min, float t_max, float* t_entry)
+{
+	__m128 child_t_min = _mm_set1_ps(t_min);
+	__m128 child_t_max = _mm_set1_ps(t_max);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		int negative = r.direction_is_negative[axis];
+		__m128 near_plane = _mm_loadu_ps(negative ? node.bounds_max[axis] : node.bounds_min[axis]);
+		__m128 far_plane = _mm_loadu_ps(negative ? node.bounds_min[axis] : node.bounds_max[axis]);
+		if (end != nullptr)
+		{
+			__m128 f = _mm_set1_ps(factor);
+			__m128 end_near = _mm_loadu_ps(negative ? end->bounds_max[axis] : end->bounds_min[axis]);
+			__m128 end_far = _mm_loadu_ps(negative ? end->bounds_min[axis] : end->bounds_max[axis]);
+			near_plane = _mm_add_ps(near_plane, _mm_mul_ps(f, _mm_sub_ps(end_near, near_plane)));
+			far_plane = _mm_add_ps(far_plane, _mm_mul_ps(f, _mm_sub_ps(end_far, far_plane)));
+		}
+
+		__m128 inv_direction = _mm_set1_ps(r.inv_direction[axis]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(near_plane, _mm_set1_ps(r.origin_near[axis])), inv_direction);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(far_plane, _mm_set1_ps(r.origin_far[axis])), inv_direction);
+
+		// min/max return second operand for NaN, keeps previous value as scalar version
+		child_t_min = _mm_max_ps(t0, child_t_min);
+		child_t_max = _mm_min_ps(t1, child_t_max);
+	}
+	child_t_max = _mm_mul_ps(child_t_max, _mm_set1_ps(bvh_robust_scale));
+
+	_mm_storeu_ps(t_entry, child_t_min);
+	return _mm_movemask_ps(_mm_cmple_ps(child_t_min, child_t_max));
+}
+#endif
+
+#if defined(__AVX__)
+// AVX: 8 children at once
+inline int intersect_children(const bvh_wide_node<8>& node, const bvh_wide_bounds<8>* end, float factor, const bvh_wide_ray& r, float t_min, float t_max, float* t_entry)
+{
+	__m256 child_t_min = _mm256_set1_ps(t_min);
+	__m256 child_t_max = _mm256_set1_ps(t_max);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		int negative = r.direction_is_negative[axis];
+		__m256 near_plane = _mm256_loadu_ps(negative ? node.bounds_max[axis] : node.bounds_min[axis]);
+		__m256 far_plane = _mm256_loadu_ps(negative ? node.bounds_min[axis] : node.bounds_max[axis]);
+		if (end != nullptr)
+		{
+			__m256 f = _mm256_set1_ps(factor);
+			__m256 end_near = _mm256_loadu_ps(negative ? end->bounds_max[axis] : end->bounds_min[axis]);
+			__m256 end_far = _mm256_loadu_ps(negative ? end->bounds_min[axis] : end->bounds_max[axis]);
+			near_plane = _mm256_add_ps(near_plane, _mm256_mul_ps(f, _mm256_sub_ps(end_near, near_plane)));
+			far_plane = _mm256_add_ps(far_plane, _mm256_mul_ps(f, _mm256_sub_ps(end_far, far_plane)));
+		}
+
+		__m256 inv_direction = _mm256_set1_ps(r.inv_direction[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near_plane, _mm256_set1_ps(r.origin_near[axis])), inv_direction);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far_plane, _mm256_set1_ps(r.origin_far[axis])), inv_direction);
+
+		child_t_min = _mm256_max_ps(t0, child_t_min);
+		child_t_max = _mm256_min_ps(t1, child_t_max);
+	}
+	child_t_max = _mm256_mul_ps(child_t_max, _mm256_set1_ps(bvh_robust_scale));
+
+	_mm256_storeu_ps(t_entry, child_t_min);
+	return _mm256_movemask_ps(_mm256_cmp_ps(child_t_min, child_t_max, _CMP_LE_OQ));
+}
+#endif
+
+// 4 or 8-ary BVH collapsed from binary bvh_tree
+// Fewer, wider nodes: less traversal steps and memory traffic, children tested together with SIMD
+// and visited front to back.
+// Leaf primitive ranges are the same as the binary tree, so the owner keeps its primitive order.
+template <int width>
+class bvh_wide_tree
+{
+public:
+	void build(const bvh_tree& binary)
+	{
+		nodes.clear();
+		end_nodes.clear();
+		time0 = binary.time0;
+		time1 = binary.time1;
+		if (binary.nodes.empty())
+			return;
+
+		nodes.reserve(binary.nodes.size() / (width / 2) + 1);
+		collapse(binary, 0);
+	}
+
+	template <bool any_hit = false, typename leaf_function>
+	bool traverse(const ray& r, real t_min, real& t_max, leaf_function&& leaf) const
+	{
+		if (nodes.empty())
+			return false;
+
+		traversal_ray tr(r);
+		bvh_wide_ray wide_ray;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			wide_ray.inv_direction[axis] = static_cast<float>(tr.inv_direction[axis]);
+			wide_ray.direction_is_negative[axis] = tr.sign[axis];
+
+			float origin_down = float_round_down(r.origin()[axis]);
+			float origin_up = float_round_up(r.origin()[axis]);
+			wide_ray.origin_near[axis] = wide_ray.direction_is_negative[axis] ? origin_down : origin_up;
+			wide_ray.origin_far[axis] = wide_ray.direction_is_negative[axis] ? origin_up : origin_down;
+		}
+
+		float t_min_float = float_round_down(t_min);
+		float t_max_float = float_round_up(t_max);
+
+		bool motion = !end_nodes.empty();
+		float factor = motion && time1 > time0 ? static_cast<float>(clamp((r.time() - time0) / (time1 - time0), real(0), real(1))) : 0.0f;
+
+		bool hit_anything = false;
+
+		// children pushed far to near, so the nearest is popped first
+		struct entry
+		{
+			uint32_t child;
+			uint32_t count;
+			float t;
+		};
+		entry stack[64 * (width - 1) + 1];
+		int stack_size = 0;
+		stack[stack_size++] = { 0, 0, t_min_float };
+
+		while (stack_size > 0)
+		{
+			entry current = stack[--stack_size];
+
+			// something closer was found since it was pushed
+			if (current.t > t_max_float)
+				continue;
+
+			if (current.count > 0)
+			{
+				if (leaf(current.child, current.count, t_max))
+				{
+					if (any_hit)
+						return true;
+					hit_anything = true;
+					t_max_float = float_round_up(t_max);
+				}
+				continue;
+			}
+
+			const bvh_wide_node<width>& node = nodes[current.child];
+			float t_entry[width];
+			// children bounds interpolated at ray time if they move
+			const bvh_wide_bounds<width>* end = motion && node.moving ? &end_nodes[current.child] : nullptr;
+			int mask = intersect_children(node, end, factor, wide_ray, t_min_float, t_max_float, t_entry);
+
+			// sort hit children by entry distance, far first
+			entry hits[width];
+			int hit_count = 0;
+			for (int i = 0; i < width; i++)
+			{
+				// empty slot may still pass when interpolated bounds became NaN
+				if ((mask & (1 << i)) == 0 || node.child[i] == bvh_wide_empty)
+					continue;
+
+				entry e = { node.child[i], node.count[i], t_entry[i] };
+				int j = hit_count++;
+				while (j > 0 && hits[j - 1].t < e.t)
+				{
+					hits[j] = hits[j - 1];
+					j--;
+				}
+				hits[j] = e;
+			}
+
+			for (int i = 0; i < hit_count; i++)
+				stack[stack_size++] = hits[i];
+		}
+
+		return hit_anything;
+	}
+
+	std::vector<bvh_wide_node<width>> nodes;
+	std::vector<bvh_wide_bounds<width>> end_nodes; // same order as nodes, empty if nothing moves
+	real time0 = 0.0;
+	real time1 = 1.0;
+
+private:
+	uint32_t collapse(const bvh_tree& binary, uint32_t binary_index)
+	{
+		uint32_t node_index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+		if (binary.has_motion())
+			end_nodes.emplace_back();
+
+		// keep opening the largest interior child until node is full
+		uint32_t children[width];
+		int child_count = 0;
+		const bvh_linear_node& root = binary.nodes[binary_index];
+		if (root.is_leaf())
+		{
+			children[child_count++] = binary_index;
+		}
+		else
+		{
+			children[child_count++] = binary_index + 1;
+			children[child_count++] = root.offset;
+		}
+
+		while (child_count < width)
+		{
+			int best = -1;
+			double best_area = -1.0;
+			for (int i = 0; i < child_count; i++)
+			{
+				const bvh_linear_node& child = binary.nodes[children[i]];
+				if (child.is_leaf())
+					continue;
+
+				double area = surface_area(child);
+				if (area > best_area)
+				{
+					best_area = area;
+					best = i;
+				}
+			}
+
+			if (best < 0)
+				break;
+
+			uint32_t opened = children[best];
+			children[best] = opened + 1;
+			children[child_count++] = binary.nodes[opened].offset;
+		}
+
+		// recursion may reallocate nodes, fill slots through index
+		for (int i = 0; i < width; i++)
+		{
+			uint32_t child_index = bvh_wide_empty;
+			uint16_t count = 0;
+			if (i < child_count)
+			{
+				const bvh_linear_node& child = binary.nodes[children[i]];
+				if (child.is_leaf())
+				{
+					child_index = child.offset;
+					count = child.count;
+				}
+				else
+				{
+					child_index = collapse(binary, children[i]);
+				}
+			}
+
+			bvh_wide_node<width>& node = nodes[node_index];
+			node.child[i] = child_index;
+			node.count[i] = count;
+			if (i == 0)
+				node.moving = 0;
+			if (i < child_count && binary.has_motion() && binary.nodes[children[i]].moving)
+				node.moving = 1;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (i < child_count)
+				{
+					node.bounds_min[axis][i] = binary.nodes[children[i]].bounds_min[axis];
+					node.bounds_max[axis][i] = binary.nodes[children[i]].bounds_max[axis];
+				}
+				else
+				{
+					node.bounds_min[axis][i] = std::numeric_limits<float>::infinity();
+					node.bounds_max[axis][i] = -std::numeric_limits<float>::infinity();
+				}
+			}
+
+			if (binary.has_motion())
+			{
+				bvh_wide_bounds<width>& end = end_nodes[node_index];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					if (i < child_count)
+					{
+						end.bounds_min[axis][i] = binary.end_bounds[children[i]].bounds_min[axis];
+						end.bounds_max[axis][i] = binary.end_bounds[children[i]].bounds_max[axis];
+					}
+					else
+					{
+						end.bounds_min[axis][i] = std::numeric_limits<float>::infinity();
+						end.bounds_max[axis][i] = -std::numeric_limits<float>::infinity();
+					}
+				}
+			}
+		}
+
+		return node_index;
+	}
+
+	static double surface_area(const bvh_linear_node& node)
+	{
+		double dx = node.bounds_max[0] - node.bounds_min[0];
+		double dy = node.bounds_max[1] - node.bounds_min[1];
+		double dz = node.bounds_max[2] - node.bounds_min[2];
+		return 2.0 * (dx * dy + dy * dz + dz * dx);
+	}
+};
+
+// BVH over hittables
+// Replaces a linear walk through hittable_list with O(log n) traversal
+// width 2 traverses the binary tree, 4 and 8 traverse it collapsed into a wide tree.
+// Leaves index primitives compiled into per type tables, the scene objects are only read at build.
+class bvh : public hittable
+{
+public:
+	bvh() {}
+	bvh(const std::vector<std::shared_ptr<hittable>>& scene_objects, real time0, real time1, int width = 2) : width(width)
+	{
+		std::vector<std::shared_ptr<hittable>> objects;
+		primitive_table::flatten(scene_objects, objects);
+
+		// query each bounding box once, builder only works on the copies
+		// boxes at the two ends of shutter instead of one over whole shutter
+		std::vector<aabb> object_boxes(objects.size());
+		std::vector<aabb> object_end_boxes(objects.size());
+		std::vector<char> has_box(objects.size());
+		concurrency::parallel_for(size_t(0), objects.size(), [&](size_t i)
+		{
+			has_box[i] =
+				objects[i]->bounding_box(time0, time0, object_boxes[i]) &&
+				objects[i]->bounding_box(time1, time1, object_end_boxes[i]);
+		});
+
+		std::vector<aabb> boxes;
+		std::vector<aabb> end_boxes;
+		std::vector<std::shared_ptr<hittable>> bounded;
+		bool motion = false;
+		for (size_t i = 0; i < objects.size(); i++)
+		{
+			if (has_box[i])
+			{
+				boxes.push_back(object_boxes[i]);
+				end_boxes.push_back(object_end_boxes[i]);
+				bounded.push_back(objects[i]);
+
+				if (object_boxes[i].min() != object_end_boxes[i].min() || object_boxes[i].max() != object_end_boxes[i].max())
+					motion = true;
+			}
+			else
+			{
+				unbounded.push_back(objects[i]);
+			}
+		}
+
+		// motion bounds only when something moves
+		if (!motion)
+			end_boxes.clear();
+		std::vector<uint32_t> order = tree.build(boxes, end_boxes, time0, time1);
+
+		// store in leaf order, so leaf is a range
+		primitives.reserve(order.size());
+		for (uint32_t index : order)
+			primitives.add(bounded[index]);
+
+		if (width == 4)
+			tree4.build(tree);
+		else if (width == 8)
+			tree8.build(tree);
+	}
+
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		bool hit_anything = false;
+		for (const auto& object : unbounded)
+		{
+			if (object->intersect(r, t_min, t_max, rec))
+			{
+				hit_anything = true;
+				t_max = rec.t;
+			}
+		}
+
+		auto leaf = [&](uint32_t first, uint32_t count, real& closest_so_far)
+		{
+			bool hit_leaf = false;
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				if (primitives.intersect(i, r, t_min, closest_so_far, rec))
+				{
+					hit_leaf = true;
+					closest_so_far = rec.t;
+				}
+			}
+			return hit_leaf;
+		};
+
+		bool hit_tree;
+		switch (width)
+		{
+		case 4:
+			hit_tree = tree4.traverse(r, t_min, t_max, leaf);
+			break;
+		case 8:
+			hit_tree = tree8.traverse(r, t_min, t_max, leaf);
+			break;
+		default:
+			hit_tree = tree.traverse(r, t_min, t_max, leaf);
+			break;
+		}
+
+		return hit_anything || hit_tree;
+	}
+
+	bool occluded(const ray& r, real t_min, real t_max) const override
+	{
+		for (const auto& object : unbounded)
+			if (object->occluded(r, t_min, t_max))
+				return true;
+
+		auto leaf = [&](uint32_t first, uint32_t count, real& leaf_t_max)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+				if (primitives.occluded(i, r, t_min, leaf_t_max))
+					return true;
+			return false;
+		};
+
+		switch (width)
+		{
+		case 4: return tree4.traverse<true>(r, t_min, t_max, leaf);
+		case 8: return tree8.traverse<true>(r, t_min, t_max, leaf);
+		default: return tree.traverse<true>(r, t_min, t_max, leaf);
+		}
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
+	{
+		if (!unbounded.empty() || tree.nodes.empty())
+			return false;
+
+		box = tree.bounds();
+		return true;
+	}
+
+	int width = 2;
+	bvh_tree tree;
+	bvh_wide_tree<4> tree4;
+	bvh_wide_tree<8> tree8;
+	primitive_table primitives; // in leaf order
+	std::vector<std::shared_ptr<hittable>> unbounded; // without bounding box, tested linearly
+};
@@ -3,6 +3,7 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include "ray.h"
+#include "utility.h"
 
 class camera
 {
@@ -10,7 +11,7 @@ public:
 	camera() {}
 
 	// vfov is top of bottom in degree
-	camera(const vec3& lookfrom, const vec3& lookat, const vec3& vup, double vfov, double aspect, double aperture, double focus_dist, double t0, double t1)
+	camera(const vec3& lookfrom, const vec3& lookat, const vec3& vup, real vfov, real aspect, real aperture, real focus_dist, real t0, real t1)
 	{
 		time0 = t0;
 		time1 = t1;
@@ -18,9 +19,9 @@ public:
 		// so aperture is diameter...
 		lens_radius = aperture / 2;
 
-		double theta = vfov * static_cast<double>(M_PI) / 180.0;
-		double half_height = tan(theta / 2);
-		double half_width = aspect * half_height;
+		real theta = vfov * static_cast<real>(M_PI) / 180.0;
+		real half_height = tan(theta / 2);
+		real half_width = aspect * half_height;
 
 		origin = lookfrom;
 		w = normalize(lookfrom - lookat);
@@ -33,12 +34,13 @@ public:
 		vertical = 2.0 * half_height * focus_dist * v;		
 	}
 
-	ray get_ray(double s, double t)
+	// const, lens and shutter are sampled from the sampler of the path
+	ray get_ray(real s, real t, sampler& g) const
 	{
-		vec3 rd = lens_radius * random_in_unit_disk();
+		vec3 rd = lens_radius * random_in_unit_disk(g);
 		vec3 offset = u * rd.x + v * rd.y;
 
-		double time = time0 + uniform(timeEngine) * (time1 - time0);
+		real time = time0 + random_double(g) * (time1 - time0);
 
 		auto dir = lower_left_corner
 			+ s * horizontal
@@ -54,21 +56,31 @@ public:
 	vec3 horizontal;
 	vec3 vertical;
 	vec3 u, v, w;
-	double time0, time1;
-	double lens_radius;
+	real time0, time1;
+	real lens_radius;
 
 private:
-	vec3 random_in_unit_disk()
+	// concentric mapping keeps strata of the 2d sample together on the lens
+	// See Shirley and Chiu, "A Low Distortion Map Between Disk and Square", 1997
+	static vec3 random_in_unit_disk(sampler& g)
 	{
-		vec3 p;
-		do
+		sample2 s = g.get_2d();
+		real a = 2 * s.u - 1;
+		real b = 2 * s.v - 1;
+		if (a == 0 && b == 0)
+			return vec3(0, 0, 0);
+
+		real r, phi;
+		if (fabs(a) > fabs(b))
+		{
+			r = a;
+			phi = real(M_PI / 4) * (b / a);
+		}
+		else
 		{
-			p = 2.0 * vec3(uniform(rayEngine), uniform(rayEngine), 0) - vec3(1, 1, 0);
-		} while (dot(p, p) >= 1.0);
-		return p;
+			r = b;
+			phi = real(M_PI / 2) - real(M_PI / 4) * (a / b);
+		}
+		return vec3(r * cos(phi), r * sin(phi), 0);
 	}
-
-	std::uniform_real_distribution<double> uniform;
-	std::minstd_rand rayEngine;
-	std::minstd_rand timeEngine;
 };
\ No newline at end of file
@@ -0,0 +1,217 @@
+#pragma once
+
+#define _USE_MATH_DEFINES
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "math.h"
+
+#include "vec3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+#include "alias_table.h"
+
+// Distant light all around the scene from a lat-long (equirectangular) HDR image
+// Rows go from up (+y) to down, columns once around y. A ray that leaves the scene sees it as background.
+// As a light it has no bounds, light_bvh keeps it beside the tree, and it is sampled by pixel
+// with probability of luminance times the solid angle of the pixel, then uniformly inside the pixel.
+// See pbrt 3rd edition, 14.2.4 Infinite Area Lights
+class environment_light : public hittable
+{
+public:
+	environment_light(std::shared_ptr<hdr_texture> image) : image(image), mp(std::make_shared<diffuse_light>(image))
+	{
+		int nx = image->nx, ny = image->ny;
+		std::vector<real> weights(nx * ny);
+		double total = 0;
+		for (int j = 0; j < ny; j++)
+		{
+			real sin_theta = sin(M_PI * (j + 0.5) / ny);
+			for (int i = 0; i < nx; i++)
+			{
+				weights[i + nx * j] = std::max(luminance((*image->data)[i + nx * j]), real(0)) * sin_theta;
+				total += weights[i + nx * j];
+			}
+		}
+		distribution.build(weights);
+
+		// rows weigh sin(theta), which averages 2 / pi
+		average = static_cast<real>(total / (nx * ny) * M_PI / 2);
+	}
+
+	// Radiance RGBE (.hdr) with -Y +X resolution, flat or run length encoded scanlines
+	// returns nullptr if file can not be read
+	// See Ward, "Real Pixels", Graphics Gems II, 1991
+	static std::shared_ptr<environment_light> load_hdr(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return nullptr;
+
+		std::string line;
+		if (!std::getline(file, line) || line.compare(0, 2, "#?") != 0)
+			return nullptr;
+		bool rgbe = true;
+		while (std::getline(file, line) && !line.empty())
+		{
+			if (line.compare(0, 7, "FORMAT=") == 0)
+				rgbe = line == "FORMAT=32-bit_rle_rgbe";
+		}
+
+		int width = 0, height = 0;
+		char y_axis[3] = {}, x_axis[3] = {};
+		if (!rgbe || !std::getline(file, line)
+			|| sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &height, x_axis, &width) != 4
+			|| strcmp(y_axis, "-Y") != 0 || strcmp(x_axis, "+X") != 0 || width <= 0 || height <= 0)
+			return nullptr;
+
+		auto pixels = std::make_shared<std::vector<vec3>>(static_cast<size_t>(width) * height);
+		std::vector<uint8_t> scanline(4 * width);
+		for (int j = 0; j < height; j++)
+		{
+			uint8_t head[4];
+			if (!file.read(reinterpret_cast<char*>(head), 4))
+				return nullptr;
+
+			if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80) != 0)
+			{
+				// flat, head is the first pixel
+				std::memcpy(scanline.data(), head, 4);
+				if (!file.read(reinterpret_cast<char*>(scanline.data() + 4), 4 * (width - 1)))
+					return nullptr;
+			}
+			else
+			{
+				// each channel of the row in turn, count above 128 repeats one byte, else copies that many
+				if (((head[2] << 8) | head[3]) != width)
+					return nullptr;
+				for (int c = 0; c < 4; c++)
+				{
+					int i = 0;
+					while (i < width)
+					{
+						int count = file.get();
+						if (count == EOF)
+							return nullptr;
+						bool run = count > 128;
+						if (run)
+							count -= 128;
+						if (count == 0 || i + count > width)
+							return nullptr;
+						int value = run ? file.get() : 0;
+						for (int k = 0; k < count; k++, i++)
+							scanline[4 * i + c] = static_cast<uint8_t>(run ? value : file.get());
+					}
+				}
+				if (!file)
+					return nullptr;
+			}
+
+			// shared exponent
+			for (int i = 0; i < width; i++)
+			{
+				const uint8_t* rgbe_pixel = &scanline[4 * i];
+				real scale = rgbe_pixel[3] == 0 ? real(0) : static_cast<real>(ldexp(1.0, rgbe_pixel[3] - (128 + 8)));
+				(*pixels)[i + width * j] = vec3(rgbe_pixel[0] * scale, rgbe_pixel[1] * scale, rgbe_pixel[2] * scale);
+			}
+		}
+
+		return std::make_shared<environment_light>(std::make_shared<hdr_texture>(pixels, width, height));
+	}
+
+	vec3 radiance(const vec3& direction) const
+	{
+		real u, v;
+		get_uv(normalize(direction), u, v);
+		return image->value(u, v, direction);
+	}
+
+	// only a ray that goes on forever reaches it, at t of max, so any light in the way is closer
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		if (t_max < std::numeric_limits<real>::max())
+			return false;
+		rec.t = std::numeric_limits<real>::max();
+		rec.object = this;
+		return true;
+	}
+
+	// no point at infinity, p is the direction, normal along the ray so diffuse_light sees its front
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rec.normal = normalize(r.direction());
+		rec.p = rec.normal;
+		get_uv(rec.normal, rec.u, rec.v);
+		rec.mat_ptr = mp.get();
+	}
+
+	bool occluded(const ray& r, real t_min, real t_max) const override { return false; }
+	bool bounding_box(real t0, real t1, aabb& box) const override { return false; }
+
+	real pdf_value(const vec3& o, const vec3& v) const override
+	{
+		if (distribution.empty())
+			return 0;
+
+		real u, w;
+		vec3 direction = normalize(v);
+		get_uv(direction, u, w);
+		real sin_theta = sqrt(direction.x * direction.x + direction.z * direction.z); // 1 - y^2 is 0 near the poles
+		if (sin_theta <= 0)
+			return 0;
+
+		// density over the image, to solid angle by d omega = 2 pi^2 sin(theta) du dv
+		int nx = image->nx, ny = image->ny;
+		int i = clamp(static_cast<int>(u * nx), 0, nx - 1);
+		int j = clamp(static_cast<int>((1 - w) * ny), 0, ny - 1);
+		return distribution.pmf(i + nx * j) * nx * ny / real(2 * M_PI * M_PI * sin_theta);
+	}
+
+	vec3 random(const vec3& o, sampler& g) const override
+	{
+		real pick = g.get_1d();
+		sample2 s = g.get_2d();
+		if (distribution.empty())
+			return vec3(0, 1, 0);
+
+		int nx = image->nx, ny = image->ny;
+		size_t pixel = distribution.sample(pick);
+		real u = (pixel % nx + s.u) / nx;
+		real v = 1 - (pixel / nx + s.v) / ny;
+		return direction(u, v);
+	}
+
+	// mean radiance, as a light of unit area, light_bvh only needs it above 0 and splits by count
+	real power() const override { return average; }
+	const material* surface_material() const override { return mp.get(); }
+
+	// u once around y from -x, v from down (0) to up (1), as the rows of the image
+	static void get_uv(const vec3& d, real& u, real& v)
+	{
+		real phi = atan2(d.z, d.x);
+		u = static_cast<real>((phi + M_PI) / (2 * M_PI));
+		v = static_cast<real>(1 - acos(clamp(d.y, real(-1), real(1))) / M_PI);
+	}
+
+	static vec3 direction(real u, real v)
+	{
+		real phi = static_cast<real>(u * 2 * M_PI - M_PI);
+		real theta = static_cast<real>((1 - v) * M_PI);
+		real sin_theta = sin(theta);
+		return vec3(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+	}
+
+	std::shared_ptr<hdr_texture> image;
+
+private:
+	std::shared_ptr<material> mp;
+	alias_table distribution;
+	real average;
+};
@@ -0,0 +1,357 @@
+#pragma once
+
+#define _USE_MATH_DEFINES
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include "math.h"
+
+#include "vec3.h"
+#include "aabb.h"
+#include "pdf.h"
+#include "sampler.h"
+
+// Path guiding, directions sampled from incident light learned while rendering
+// Space is a binary tree over the scene bounds, each leaf holds a quadtree over directions.
+// A training pass records what paths bring in along each direction into building quadtrees, which
+// then become the sampling quadtrees of the next pass, and are refined where most light comes from.
+// Leaves that get many records split, so busy regions learn apart.
+// See Muller et al., "Practical Path Guiding for Efficient Light-Transport Simulation", EGSR 2017
+// directional thresholds below are theirs
+
+// leaf records before a split, times sqrt(2^pass) as passes double
+// they use 12000 for megapixel passes, images here record far fewer paths per leaf
+const real guiding_spatial_threshold = 1000;
+// quadrant with this fraction of all light is split, one with less merges back
+const real guiding_directional_threshold = 0.01f;
+const int guiding_max_directional_depth = 20;
+// vertices of one path recorded at most
+const int guiding_max_vertices = 32;
+
+// value many threads add to, relaxed, copies as its value so trees holding it can be copied between passes
+// kept in fixed point, integers add up to the same whatever order threads come in, so a parallel training pass
+// learns the very trees a serial one does. Steps of 2^-16, an addition is capped at 2^32 so a sum overflows
+// only after 2^16 capped ones
+struct shared_sum
+{
+	shared_sum(real v = 0) : value(to_fixed(v)) {}
+	shared_sum(const shared_sum& other) : value(other.value.load(std::memory_order_relaxed)) {}
+	shared_sum& operator=(const shared_sum& other) { value.store(other.value.load(std::memory_order_relaxed), std::memory_order_relaxed); return *this; }
+
+	real load() const { return static_cast<real>(value.load(std::memory_order_relaxed)) / scale; }
+	void add(real v) { value.fetch_add(to_fixed(v), std::memory_order_relaxed); }
+
+	static constexpr real scale = 65536;
+	static uint64_t to_fixed(real v) { return static_cast<uint64_t>(std::min(std::max(v, real(0)), real(4294967296.0)) * scale + 0.5f); }
+
+	std::atomic<uint64_t> value;
+};
+
+// piecewise constant distribution over the sphere of directions
+// directions map to the unit square by cos(theta) and phi, which keeps area, so density on
+// the square over 4 pi is density in solid angle. Each node splits its square into 4 quadrants.
+class direction_quadtree
+{
+public:
+	direction_quadtree() : nodes(1) {}
+
+	real total() const { return nodes[0].total(); }
+
+	// solid angle density, 0 where nothing was recorded
+	real pdf(const vec3& direction) const
+	{
+		sample2 p = to_square(direction);
+		real density = 1;
+		uint32_t index = 0;
+		for (;;)
+		{
+			const node& n = nodes[index];
+			real node_total = n.total();
+			if (node_total <= 0)
+				return 0;
+
+			int q = quadrant(p);
+			density *= 4 * n.sum[q].load() / node_total;
+			if (n.child[q] == 0)
+				break;
+			index = n.child[q];
+		}
+		return density / real(4 * M_PI);
+	}
+
+	// unit direction, down by the sums of each node then uniform in the leaf quadrant, needs total() > 0
+	vec3 sample(sample2 s) const
+	{
+		real x = 0, y = 0, size = 1;
+		uint32_t index = 0;
+		for (;;)
+		{
+			const node& n = nodes[index];
+
+			// column, then row within it, one number each rescaled after the choice
+			real left = n.sum[0].load() + n.sum[2].load();
+			real right = n.sum[1].load() + n.sum[3].load();
+			int qx = choose(right / (left + right), s.u);
+			real bottom = n.sum[qx].load();
+			real top = n.sum[qx + 2].load();
+			int qy = choose(top / (bottom + top), s.v);
+
+			size *= 0.5f;
+			x += qx * size;
+			y += qy * size;
+			uint32_t child = n.child[qx + 2 * qy];
+			if (child == 0)
+				return from_square({ x + s.u * size, y + s.v * size });
+			index = child;
+		}
+	}
+
+	// adds to the sums of every node down to the leaf quadrant of direction
+	void record(const vec3& direction, real value)
+	{
+		sample2 p = to_square(direction);
+		uint32_t index = 0;
+		for (;;)
+		{
+			node& n = nodes[index];
+			int q = quadrant(p);
+			n.sum[q].add(value);
+			if (n.child[q] == 0)
+				return;
+			index = n.child[q];
+		}
+	}
+
+	// empty tree with quadrants split where this one recorded more than threshold of its total
+	// a new quadrant without recorded sums of its own takes a quarter of its parent's to decide
+	direction_quadtree refined(real threshold, int max_depth) const
+	{
+		direction_quadtree result;
+		real t = total();
+		if (t <= 0)
+			return result;
+
+		struct entry
+		{
+			uint32_t from;		// node here, if has_from
+			bool has_from;
+			uint32_t to;		// node in result
+			int depth;
+			real inherited;		// sum of the quadrant it splits, if not has_from
+		};
+		std::vector<entry> stack = { { 0, true, 0, 1, 0 } };
+		while (!stack.empty())
+		{
+			entry e = stack.back();
+			stack.pop_back();
+			for (int q = 0; q < 4; q++)
+			{
+				real sum = e.has_from ? nodes[e.from].sum[q].load() : e.inherited / 4;
+				if (sum <= threshold * t || e.depth >= max_depth)
+					continue;
+
+				uint32_t child = static_cast<uint32_t>(result.nodes.size());
+				result.nodes.emplace_back();
+				result.nodes[e.to].child[q] = child;
+				bool has_from = e.has_from && nodes[e.from].child[q] != 0;
+				stack.push_back({ has_from ? nodes[e.from].child[q] : 0, has_from, child, e.depth + 1, sum });
+			}
+		}
+		return result;
+	}
+
+	size_t node_count() const { return nodes.size(); }
+
+	// cos(theta) along z and phi over 2 pi
+	static sample2 to_square(const vec3& d)
+	{
+		real phi = atan2(d.y, d.x);
+		if (phi < 0)
+			phi += real(2 * M_PI);
+		return { clamp((d.z + 1) * 0.5f, real(0), one_minus_epsilon()), std::min(phi / real(2 * M_PI), one_minus_epsilon()) };
+	}
+
+	static vec3 from_square(sample2 p)
+	{
+		real cos_theta = 2 * p.u - 1;
+		real sin_theta = sqrt(std::max(1 - cos_theta * cos_theta, real(0)));
+		real phi = real(2 * M_PI) * p.v;
+		return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+	}
+
+private:
+	struct node
+	{
+		real total() const { return sum[0].load() + sum[1].load() + sum[2].load() + sum[3].load(); }
+
+		// quadrant x + 2 y
+		shared_sum sum[4];
+		uint32_t child[4] = { 0, 0, 0, 0 }; // 0 for a leaf quadrant, root is never a child
+	};
+
+	static real one_minus_epsilon() { return real(1) - std::numeric_limits<real>::epsilon(); }
+
+	// quadrant p is in, and p rescaled to it
+	static int quadrant(sample2& p)
+	{
+		int qx = p.u >= 0.5f;
+		int qy = p.v >= 0.5f;
+		p.u = std::min(2 * p.u - qx, one_minus_epsilon());
+		p.v = std::min(2 * p.v - qy, one_minus_epsilon());
+		return qx + 2 * qy;
+	}
+
+	// 1 with probability p_one, u rescaled to what is left of its range
+	static int choose(real p_one, real& u)
+	{
+		real p_zero = 1 - p_one;
+		if (u < p_zero)
+		{
+			u = std::min(u / p_zero, one_minus_epsilon());
+			return 0;
+		}
+		u = std::min((u - p_zero) / p_one, one_minus_epsilon());
+		return 1;
+	}
+
+	std::vector<node> nodes;
+};
+
+class quadtree_pdf : public pdf
+{
+public:
+	quadtree_pdf(const direction_quadtree* t) : tree(t) {}
+
+	real value(const vec3& direction) const override { return tree->pdf(normalize(direction)); }
+	vec3 generate(sampler& g) const override { return tree->sample(g.get_2d()); }
+
+private:
+	const direction_quadtree* tree;
+};
+
+// vertex of a path that sampled a direction, what the path gathers after it over throughput
+// is the radiance that came in along that direction
+struct guide_record
+{
+	uint32_t leaf;
+	vec3 direction;
+	real pdf;			// of the direction as it was sampled
+	vec3 radiance;		// gathered by the path up to here
+	vec3 throughput;	// including this vertex
+};
+
+class path_guide
+{
+public:
+	void build(const aabb& scene_bounds)
+	{
+		bounds = scene_bounds;
+		nodes.assign(1, node());
+		leaves.assign(1, leaf_data());
+		training = true;
+	}
+
+	// leaf of the spatial tree p is in, a point outside the bounds takes the closest
+	uint32_t leaf(const vec3& p) const
+	{
+		vec3 lo = bounds.min(), hi = bounds.max();
+		uint32_t index = 0;
+		while (nodes[index].child != 0)
+		{
+			int axis = nodes[index].axis;
+			real middle = 0.5f * (lo[axis] + hi[axis]);
+			if (p[axis] < middle)
+			{
+				hi[axis] = middle;
+				index = nodes[index].child;
+			}
+			else
+			{
+				lo[axis] = middle;
+				index = nodes[index].child + 1;
+			}
+		}
+		return nodes[index].leaf;
+	}
+
+	const direction_quadtree& sampling(uint32_t leaf) const { return leaves[leaf].sampling; }
+
+	// splats each vertex of a finished path with what it brought in over its pdf, Monte Carlo estimate over the quadrant
+	void record(const guide_record* records, int count, const vec3& radiance)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			const guide_record& r = records[i];
+			vec3 incident = radiance - r.radiance;
+			for (int c = 0; c < 3; c++)
+				incident[c] = r.throughput[c] > 0 ? incident[c] / r.throughput[c] : real(0);
+			real value = luminance(incident) / r.pdf;
+			if (!(value >= 0) || !std::isfinite(value))
+				continue;
+
+			leaf_data& l = leaves[r.leaf];
+			l.building.record(r.direction, value);
+			l.records.add(1);
+		}
+	}
+
+	// after a training pass, single threaded
+	// leaves split while recorded more than the threshold, children start from a copy and half the records
+	// then each leaf samples what it recorded, and records next into a tree refined by it
+	void refine(int pass)
+	{
+		const real threshold = guiding_spatial_threshold * sqrt(real(uint64_t(1) << pass));
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].child != 0 || leaves[nodes[i].leaf].records.load() <= threshold)
+				continue;
+
+			uint32_t first = static_cast<uint32_t>(nodes.size());
+			uint32_t kept = nodes[i].leaf;
+			leaves[kept].records = shared_sum(leaves[kept].records.load() / 2);
+			leaves.push_back(leaves[kept]);
+
+			node lower, upper;
+			lower.axis = upper.axis = (nodes[i].axis + 1) % 3;
+			lower.leaf = kept;
+			upper.leaf = static_cast<uint32_t>(leaves.size() - 1);
+			nodes[i].child = first;
+			nodes.push_back(lower);
+			nodes.push_back(upper);
+		}
+
+		for (leaf_data& l : leaves)
+		{
+			l.sampling = l.building;
+			l.building = l.sampling.refined(guiding_directional_threshold, guiding_max_directional_depth);
+			l.records = shared_sum(0);
+		}
+	}
+
+	size_t leaf_count() const { return leaves.size(); }
+
+	// color() records paths while set
+	bool training = true;
+
+private:
+	struct node
+	{
+		uint32_t child = 0; // first of two, 0 for a leaf, lower half along axis first
+		int axis = 0;
+		uint32_t leaf = 0;
+	};
+
+	struct leaf_data
+	{
+		direction_quadtree sampling;
+		direction_quadtree building;
+		shared_sum records;
+	};
+
+	aabb bounds;
+	std::vector<node> nodes = std::vector<node>(1);
+	std::vector<leaf_data> leaves = std::vector<leaf_data>(1);
+};
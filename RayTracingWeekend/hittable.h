@@ -2,6 +2,8 @@
 
 #define _USE_MATH_DEFINES
 
+#include <cassert>
+#include <cstdint>
 #include <iostream>
 #include "math.h"
 
@@ -10,284 +12,539 @@
 #include "aabb.h"
 #include "texture.h"
 #include "utility.h"
+#include "spherical_rectangle.h"
 
 class material;
 
+class hittable;
+
 struct hit_record
 {
 	hit_record()
 	{
 		mat_ptr = nullptr;
 		t = 0;
+		u = 0;
+		v = 0;
+		object = nullptr;
+		primitive = 0;
+		b1 = 0;
+		b2 = 0;
+		nesting = 0;
 	}
-	double t;
+	real t;
 	vec3 p;
 	vec3 normal; // should filled with normalized normal
-	double u;
-	double v;
+	real u;
+	real v;
 	material *mat_ptr;
+
+	// from intersect(), enough to fill the rest later
+	const hittable* object;	// closest primitive
+	uint32_t primitive;		// index inside object, e.g. triangle or box face
+	real b1, b2;			// barycentrics
+
+	// wrappers (instance, translate..) hit on the way to the primitive, object is the outermost
+	// each pushes what its wrapped object recorded, its surface() takes it back
+	// one that finds the stack full fills the attributes of what it wraps right away and starts over from nullptr,
+	// so chains of any depth work, only those deeper than max_nesting pay for attributes per candidate
+	static const int max_nesting = 4;
+	const hittable* inner[max_nesting];
+	int nesting;
 };
 
-class hittable
+// directions around axis within the angle of cos_theta, all directions by default
+struct direction_cone
 {
-public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-	virtual bool bounding_box(double t0, double t1, aabb& box) const = 0;
-	virtual double pdf_value(const vec3& o, const vec3& v) const { return 0.0; }
-	virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0); }
-	virtual ~hittable() {}
+	direction_cone() : axis(0, 0, 1), cos_theta(-1) {}
+	direction_cone(const vec3& w, real c) : axis(w), cos_theta(c) {}
+
+	vec3 axis;
+	real cos_theta;
 };
 
-class bvh_node : public hittable
+class hittable
 {
 public:
-	bvh_node() {}
-	bvh_node(hittable **l, int n, double time0, double time1)
+	// closest hit with attributes, evaluated once after the closest one is known
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 	{
-		auto comparer_gen = [](int i)
-		{
-			return [=](hittable* lhs, hittable* rhs)
-			{
-				aabb box_left, box_right;
-				if (
-					!lhs->bounding_box(0, 0, box_left) ||
-					!rhs->bounding_box(0, 0, box_right))
-				{
-					std::cerr << "no bouding box in bvh_node constructor\n";
-				}
-				return box_left.min()[i] < box_right.min()[i];
-			};
-		};
+		if (!intersect(r, t_min, t_max, rec))
+			return false;
+		rec.object->surface(r, rec);
+		return true;
+	}
 
-		// sort along axis
-		static std::uniform_int_distribution<int> uniform(0, 2);
-		static std::minstd_rand engine;
-		int axis = uniform(engine); // get 0, 1, 2
-		std::sort(&l[0], &l[n - 1], comparer_gen(axis));
+	// closest hit, records only t, object and what surface() needs, rec is untouched on miss
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+	// point, normal, uv and material for a hit recorded by intersect()
+	// wrappers that transform attributes do so here, once, for the closest hit
+	virtual void surface(const ray& r, hit_record& rec) const {}
+	// any hit in (t_min, t_max) for visibility, stops early and skips attributes
+	virtual bool occluded(const ray& r, real t_min, real t_max) const { hit_record rec; return intersect(r, t_min, t_max, rec); }
+	virtual bool bounding_box(real t0, real t1, aabb& box) const = 0;
+	virtual real pdf_value(const vec3& o, const vec3& v) const { return 0.0; }
+	virtual vec3 random(const vec3& o, sampler& g) const { return vec3(1, 0, 0); }
+
+	// for light selection, surfaces report area and material, groups and wrappers their power
+	virtual real area() const { return 0.0; }
+	virtual const material* surface_material() const { return nullptr; }
+	// emitted power up to the factor pi all diffuse emitters share, 0 when not known (media, meshes)
+	// defined in material.h, where material is complete
+	virtual real power() const;
+	// directions normals of the surface point in, lets a light tree skip lights facing away
+	virtual direction_cone normal_cone() const { return direction_cone(); }
 
-		if (n == 1)
-		{
-			// left = right
-			left = right = l[0];
-		}
-		else if (n == 2)
-		{
-			// left, right
-			left = l[0];
-			right = l[1];
-		}
-		else
+	virtual ~hittable() {}
+
+protected:
+	// for wrappers, closest hit of the wrapped object in a record of its own, so nothing a previous
+	// candidate left behind stays, then this as the object hit
+	// only what surface() needs is copied, attributes too only when they were filled ahead of time
+	bool intersect_wrapped(const hittable& wrapped, const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		hit_record wrapped_rec;
+		if (!wrapped.intersect(r, t_min, t_max, wrapped_rec))
+			return false;
+
+		if (wrapped_rec.nesting == hit_record::max_nesting)
 		{
-			// left, right as sub-tree recursively
-			left = new bvh_node(l, n / 2, time0, time1);
-			left = new bvh_node(l +  n / 2, n - n / 2, time0, time1);
+			// attributes in the space of r now, nullptr tells surface_wrapped not to fill them again
+			wrapped_rec.object->surface(r, wrapped_rec);
+			wrapped_rec.object = nullptr;
+			wrapped_rec.nesting = 0;
 		}
 
-		// check and compute aabb
-		aabb box_left, box_right;
-		if (
-			!left->bounding_box(time0, time1, box_left) ||
-			!right->bounding_box(time0, time1, box_right))
+		rec.t = wrapped_rec.t;
+		rec.object = this;
+		rec.primitive = wrapped_rec.primitive;
+		rec.b1 = wrapped_rec.b1;
+		rec.b2 = wrapped_rec.b2;
+		for (int i = 0; i < wrapped_rec.nesting; i++)
+			rec.inner[i] = wrapped_rec.inner[i];
+		rec.inner[wrapped_rec.nesting] = wrapped_rec.object;
+		rec.nesting = wrapped_rec.nesting + 1;
+
+		if (rec.inner[0] == nullptr)
 		{
-			std::cerr << "no bouding box in bvh_node constructor\n";
+			rec.p = wrapped_rec.p;
+			rec.normal = wrapped_rec.normal;
+			rec.u = wrapped_rec.u;
+			rec.v = wrapped_rec.v;
+			rec.mat_ptr = wrapped_rec.mat_ptr;
 		}
-		box = aabb::surrounding(box_left, box_right);
+		return true;
 	}
 
-	bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const override
+	// attributes of what intersect_wrapped recorded, r in the space of the wrapped object
+	void surface_wrapped(const ray& r, hit_record& rec) const
 	{
-		if (box.hit(r, tmin, tmax))
+		const hittable* wrapped = rec.inner[--rec.nesting];
+		if (wrapped != nullptr)
 		{
-			hit_record left_rec, right_rec;
-			bool hit_left = left->hit(r, tmin, tmax, left_rec);
-			bool hit_right = left->hit(r, tmin, tmax, right_rec);
-
-			if (hit_left && hit_right)
-			{
-				rec = left_rec.t < right_rec.t ? left_rec : right_rec;
-				return true;
-			}
-			else if (hit_left)
-			{
-				rec = left_rec;
-				return true;
-			}
-			else if (hit_right)
-			{
-				rec = right_rec;
-				return true;
-			}
-			else
-			{
-				return false;
-			}
-		}
-		else
-		{
-			return false;
+			rec.object = wrapped;
+			wrapped->surface(r, rec);
+			rec.object = this;
 		}
+		rec.inner[rec.nesting++] = wrapped;
 	}
-
-	bool bounding_box(double t0, double t1, aabb& b) const override
-	{
-		b = box;
-		return true;
-	}
-
-	hittable* left;
-	hittable* right;
-	aabb box;
 };
 
 class xy_rect : public hittable
 {
 public:
 	xy_rect() {}
-	xy_rect(double _x0, double _x1, double _y0, double _y1,
-		double _k, std::shared_ptr<material> mat) :
+	xy_rect(real _x0, real _x1, real _y0, real _y1,
+		real _k, std::shared_ptr<material> mat) :
 			x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	bool intersect(const ray& r, real t0, real t1, hit_record& rec) const override
 	{
-		double t = (k - r.origin().z) / r.direction().z;
+		real t = (k - r.origin().z) / r.direction().z;
 		if (t < t0 || t > t1)
 			return false;
-		double x = r.origin().x + t * r.direction().x;
-		double y = r.origin().y + t * r.direction().y;
+		real x = r.origin().x + t * r.direction().x;
+		real y = r.origin().y + t * r.direction().y;
 		if (x < x0 || x > x1 || y < y0 || y > y1)
 			return false;
-		rec.u = (x - x0) / (x1 - x0);
-		rec.v = (y - y0) / (y1 - y0);
 		rec.t = t;
+		rec.object = this;
+		return true;
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rec.p = r.point_at_parameter(rec.t);
+		rec.u = (rec.p.x - x0) / (x1 - x0);
+		rec.v = (rec.p.y - y0) / (y1 - y0);
 		rec.mat_ptr = mp.get();
-		rec.p = r.point_at_parameter(t);
 		rec.normal = vec3(0, 0, 1);
-		return true;
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		box = aabb(vec3(x0, y0, k - 0.0001f), vec3(x1, y1, k + 0.0001f));
 		return true;
 	}
 
-	double x0, x1, y0, y1, k;
+	// area light: uniform in solid angle, see spherical_rectangle
+	real pdf_value(const vec3& origin, const vec3& v) const override { return seen_from(origin).pdf(v); }
+	vec3 random(const vec3& origin, sampler& g) const override { return seen_from(origin).sample(g.get_2d()) - origin; }
+
+	real area() const override { return (x1 - x0) * (y1 - y0); }
+	direction_cone normal_cone() const override { return direction_cone(vec3(0, 0, 1), 1); }
+	const material* surface_material() const override { return mp.get(); }
+
+	real x0, x1, y0, y1, k;
 	std::shared_ptr<material> mp;
+
+private:
+	spherical_rectangle seen_from(const vec3& origin) const
+	{
+		return spherical_rectangle(origin, vec3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0));
+	}
 };
 
 class xz_rect : public hittable
 {
 public:
 	xz_rect() {}
-	xz_rect(double _x0, double _x1, double _z0, double _z1,
-		double _k, std::shared_ptr<material> mat) :
+	xz_rect(real _x0, real _x1, real _z0, real _z1,
+		real _k, std::shared_ptr<material> mat) :
 			x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	bool intersect(const ray& r, real t0, real t1, hit_record& rec) const override
 	{
-		double t = (k - r.origin().y) / r.direction().y;
+		real t = (k - r.origin().y) / r.direction().y;
 		if (t < t0 || t > t1)
 			return false;
-		double x = r.origin().x + t * r.direction().x;
-		double z = r.origin().z + t * r.direction().z;
+		real x = r.origin().x + t * r.direction().x;
+		real z = r.origin().z + t * r.direction().z;
 		if (x < x0 || x > x1 || z < z0 || z > z1)
 			return false;
-		rec.u = (x - x0) / (x1 - x0);
-		rec.v = (z - z0) / (z1 - z0);
 		rec.t = t;
+		rec.object = this;
+		return true;
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rec.p = r.point_at_parameter(rec.t);
+		rec.u = (rec.p.x - x0) / (x1 - x0);
+		rec.v = (rec.p.z - z0) / (z1 - z0);
 		rec.mat_ptr = mp.get();
-		rec.p = r.point_at_parameter(t);
 		rec.normal = vec3(0, 1, 0);
-		return true;
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		box = aabb(vec3(x0, k - 0.0001f, z0), vec3(x1, k + 0.0001f, z1));
 		return true;
 	}
 
-	virtual double pdf_value(const vec3& origin, const vec3& v) const override
-	{
-		// same as hard-coded version in book3.chapter9
-
-		hit_record rec;
-		// ensure hit if direction is right by letting 0.001 < FLT_MAX < +inf
-		if (!this->hit(ray(origin, v, FLT_MAX), 0.001, std::numeric_limits<double>::infinity(), rec))
-			return 0;
+	// area light: uniform in solid angle, see spherical_rectangle
+	real pdf_value(const vec3& origin, const vec3& v) const override { return seen_from(origin).pdf(v); }
+	vec3 random(const vec3& origin, sampler& g) const override { return seen_from(origin).sample(g.get_2d()) - origin; }
 
-		auto area = (x1 - x0) * (z1 - z0);
-		auto distance_squared = rec.t * rec.t * v.length_squared();
-		auto cosine = fabs(dot(v, rec.normal) / v.length());
+	real area() const override { return (x1 - x0) * (z1 - z0); }
+	direction_cone normal_cone() const override { return direction_cone(vec3(0, 1, 0), 1); }
+	const material* surface_material() const override { return mp.get(); }
 
-		return distance_squared / (cosine * area);
-	}
+	real x0, x1, z0, z1, k;
+	std::shared_ptr<material> mp;
 
-	virtual vec3 random(const vec3& origin) const override
+private:
+	spherical_rectangle seen_from(const vec3& origin) const
 	{
-		auto random = vec3(random_double(x0, x1), k, random_double(z0, z1));
-		return random - origin;
+		return spherical_rectangle(origin, vec3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0));
 	}
-
-	double x0, x1, z0, z1, k;
-	std::shared_ptr<material> mp;
 };
 
 class yz_rect : public hittable
 {
 public:
 	yz_rect() {}
-	yz_rect(double _y0, double _y1, double _z0, double _z1,
-		double _k, std::shared_ptr<material> mat) :
+	yz_rect(real _y0, real _y1, real _z0, real _z1,
+		real _k, std::shared_ptr<material> mat) :
 			y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	bool intersect(const ray& r, real t0, real t1, hit_record& rec) const override
 	{
-		double t = (k - r.origin().x) / r.direction().x;
+		real t = (k - r.origin().x) / r.direction().x;
 		if (t < t0 || t > t1)
 			return false;
-		double y = r.origin().y + t * r.direction().y;
-		double z = r.origin().z + t * r.direction().z;
+		real y = r.origin().y + t * r.direction().y;
+		real z = r.origin().z + t * r.direction().z;
 		if (y < y0 || y > y1 || z < z0 || z > z1)
 			return false;
-		rec.u = (y - y0) / (y1 - y0);
-		rec.v = (z - z0) / (z1 - z0);
 		rec.t = t;
+		rec.object = this;
+		return true;
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rec.p = r.point_at_parameter(rec.t);
+		rec.u = (rec.p.y - y0) / (y1 - y0);
+		rec.v = (rec.p.z - z0) / (z1 - z0);
 		rec.mat_ptr = mp.get();
-		rec.p = r.point_at_parameter(t);
 		rec.normal = vec3(1, 0, 0);
-		return true;
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		box = aabb(vec3(k - 0.0001f, y0, z0), vec3(k + 0.0001f, y1, z1));
 		return true;
 	}
 
-	double y0, y1, z0, z1, k;
+	// area light: uniform in solid angle, see spherical_rectangle
+	real pdf_value(const vec3& origin, const vec3& v) const override { return seen_from(origin).pdf(v); }
+	vec3 random(const vec3& origin, sampler& g) const override { return seen_from(origin).sample(g.get_2d()) - origin; }
+
+	real area() const override { return (y1 - y0) * (z1 - z0); }
+	direction_cone normal_cone() const override { return direction_cone(vec3(1, 0, 0), 1); }
+	const material* surface_material() const override { return mp.get(); }
+
+	real y0, y1, z0, z1, k;
 	std::shared_ptr<material> mp;
+
+private:
+	spherical_rectangle seen_from(const vec3& origin) const
+	{
+		return spherical_rectangle(origin, vec3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0));
+	}
 };
 
-class flip_normals : public hittable
+// axis aligned box as one primitive, one slab test instead of 6 rects
+// normals point outward, uv per face as the rect on that face
+class box : public hittable
 {
 public:
-	flip_normals(std::shared_ptr<hittable> p) : ptr(p) {}
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	box() {}
+	box(const vec3& p0, const vec3& p1, std::shared_ptr<material> mat) : pmin(p0), pmax(p1), mp(mat) {}
+
+	// entry and exit distance along ray with the axis of the face crossed, false if the line misses
+	bool slab(const ray& r, real& t_enter, int& axis_enter, real& t_exit, int& axis_exit) const
 	{
-		if (ptr->hit(r, t0, t1, rec))
+		traversal_ray tr(r);
+		const vec3* bounds[2] = { &pmin, &pmax };
+		t_enter = -std::numeric_limits<real>::infinity();
+		t_exit = std::numeric_limits<real>::infinity();
+		axis_enter = axis_exit = 0;
+		for (int axis = 0; axis < 3; axis++)
 		{
-			rec.normal = -rec.normal;
-			return true;
+			real t0 = ((*bounds[tr.sign[axis]])[axis] - tr.origin[axis]) * tr.inv_direction[axis];
+			real t1 = ((*bounds[1 - tr.sign[axis]])[axis] - tr.origin[axis]) * tr.inv_direction[axis];
+
+			// NaN (ray on the slab plane) keeps the previous value
+			if (t0 > t_enter)
+			{
+				t_enter = t0;
+				axis_enter = axis;
+			}
+			if (t1 < t_exit)
+			{
+				t_exit = t1;
+				axis_exit = axis;
+			}
+		}
+		return t_enter <= t_exit;
+	}
+
+	// primitive is face index, axis * 2 + (1 for max side)
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		real t_enter, t_exit;
+		int axis_enter, axis_exit;
+		if (!slab(r, t_enter, axis_enter, t_exit, axis_exit))
+			return false;
+
+		// entry face from outside, exit face from inside
+		int max_side = 0;
+		if (t_enter >= t_min && t_enter <= t_max)
+		{
+			rec.t = t_enter;
+			max_side = r.direction()[axis_enter] < 0.0;
+			rec.primitive = axis_enter * 2 + max_side;
+		}
+		else if (t_exit >= t_min && t_exit <= t_max)
+		{
+			rec.t = t_exit;
+			max_side = r.direction()[axis_exit] >= 0.0;
+			rec.primitive = axis_exit * 2 + max_side;
 		}
 		else
 		{
 			return false;
 		}
+
+		rec.object = this;
+		return true;
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		int axis = rec.primitive / 2;
+		rec.p = r.point_at_parameter(rec.t);
+		rec.normal = vec3(0, 0, 0);
+		rec.normal[axis] = rec.primitive % 2 == 1 ? 1.0 : -1.0;
+		rec.mat_ptr = mp.get();
+
+		// same as xy_rect, xz_rect, yz_rect
+		int u_axis = axis == 0 ? 1 : 0;
+		int v_axis = axis == 2 ? 1 : 2;
+		rec.u = (rec.p[u_axis] - pmin[u_axis]) / (pmax[u_axis] - pmin[u_axis]);
+		rec.v = (rec.p[v_axis] - pmin[v_axis]) / (pmax[v_axis] - pmin[v_axis]);
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
+	{
+		box = aabb(pmin, pmax);
+		return true;
+	}
+
+	// faces seen from origin, all 6 from inside
+	int visible_faces(const vec3& origin, int faces[6]) const
+	{
+		int count = 0;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (origin[axis] < pmin[axis])
+				faces[count++] = axis * 2;
+			else if (origin[axis] > pmax[axis])
+				faces[count++] = axis * 2 + 1;
+		}
+		if (count == 0)
+		{
+			for (int face = 0; face < 6; face++)
+				faces[face] = face;
+			count = 6;
+		}
+		return count;
+	}
+
+	real face_area(int face) const
+	{
+		int axis = face / 2;
+		vec3 d = pmax - pmin;
+		return d[(axis + 1) % 3] * d[(axis + 2) % 3];
+	}
+
+	// area light: uniform over visible faces by area, in solid angle
+	real pdf_value(const vec3& origin, const vec3& v) const override
+	{
+		real t_enter, t_exit;
+		int axis_enter, axis_exit;
+		ray r(origin, v, FLT_MAX);
+		if (!slab(r, t_enter, axis_enter, t_exit, axis_exit))
+			return 0.0;
+
+		// the one visible face this direction goes through
+		real t;
+		int axis;
+		if (t_enter > 0.001)
+		{
+			t = t_enter;
+			axis = axis_enter;
+		}
+		else if (t_exit > 0.001)
+		{
+			t = t_exit;
+			axis = axis_exit;
+		}
+		else
+		{
+			return 0.0;
+		}
+
+		int faces[6];
+		int count = visible_faces(origin, faces);
+		real area = 0.0;
+		for (int i = 0; i < count; i++)
+			area += face_area(faces[i]);
+
+		auto distance_squared = t * t * v.length_squared();
+		auto cosine = fabs(v[axis] / v.length());
+		return distance_squared / (cosine * area);
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	vec3 random(const vec3& origin, sampler& g) const override
+	{
+		int faces[6];
+		int count = visible_faces(origin, faces);
+		real area = 0.0;
+		for (int i = 0; i < count; i++)
+			area += face_area(faces[i]);
+
+		// pick face by area
+		real pick = random_double(g, 0.0, area);
+		int face = faces[count - 1];
+		for (int i = 0; i < count; i++)
+		{
+			pick -= face_area(faces[i]);
+			if (pick < 0.0)
+			{
+				face = faces[i];
+				break;
+			}
+		}
+
+		// point on the face from one 2d sample
+		int axis = face / 2;
+		int a0 = (axis + 1) % 3, a1 = (axis + 2) % 3;
+		sample2 s = g.get_2d();
+		vec3 p;
+		p[axis] = face % 2 == 1 ? pmax[axis] : pmin[axis];
+		p[a0] = pmin[a0] + s.u * (pmax[a0] - pmin[a0]);
+		p[a1] = pmin[a1] + s.v * (pmax[a1] - pmin[a1]);
+		return p - origin;
+	}
+
+	real area() const override
+	{
+		vec3 d = pmax - pmin;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+	const material* surface_material() const override { return mp.get(); }
+
+	vec3 pmin, pmax;
+	std::shared_ptr<material> mp;
+};
+
+class flip_normals : public hittable
+{
+public:
+	flip_normals(std::shared_ptr<hittable> p) : ptr(p) {}
+	bool intersect(const ray& r, real t0, real t1, hit_record& rec) const override
+	{
+		return intersect_wrapped(*ptr, r, t0, t1, rec);
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		surface_wrapped(r, rec);
+		rec.normal = -rec.normal;
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		return ptr->bounding_box(t0, t1, box);
 	}
 
+	bool occluded(const ray& r, real t0, real t1) const override
+	{
+		return ptr->occluded(r, t0, t1);
+	}
+
+	real power() const override
+	{
+		return ptr->power();
+	}
+
+	direction_cone normal_cone() const override
+	{
+		direction_cone cone = ptr->normal_cone();
+		cone.axis = -cone.axis;
+		return cone;
+	}
+
 	std::shared_ptr<hittable> ptr;
 };
 
@@ -296,21 +553,23 @@ class translate : public hittable
 {
 public:
 	translate(std::shared_ptr<hittable> p, const vec3& displacement) : ptr(p), offset(displacement) {}
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	bool intersect(const ray& r, real t0, real t1, hit_record& rec) const override
 	{
-		ray move_r(r.origin() - offset, r.direction(), r.time());
-		if (ptr->hit(move_r, t0, t1, rec))
-		{
-			rec.p += offset;
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+		return intersect_wrapped(*ptr, ray(r.origin() - offset, r.direction(), r.time()), t0, t1, rec);
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		surface_wrapped(ray(r.origin() - offset, r.direction(), r.time()), rec);
+		rec.p += offset;
+	}
+
+	bool occluded(const ray& r, real t0, real t1) const override
+	{
+		return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t0, t1);
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		if (ptr->bounding_box(t0, t1, box))
 		{
@@ -323,6 +582,16 @@ public:
 		}
 	}
 
+	real power() const override
+	{
+		return ptr->power();
+	}
+
+	direction_cone normal_cone() const override
+	{
+		return ptr->normal_cone();
+	}
+
 	std::shared_ptr<hittable> ptr;
 	vec3 offset;
 };
@@ -331,13 +600,13 @@ public:
 class rotate_y : public hittable
 {
 public:
-	rotate_y(std::shared_ptr<hittable> p, double angle) : ptr(p)
+	rotate_y(std::shared_ptr<hittable> p, real angle) : ptr(p)
 	{
 		// calculate new aabb
-		double radians = ((double)M_PI / 180.0) * angle;
+		real radians = ((real)M_PI / 180.0) * angle;
 		sin_theta = sin(radians);
 		cos_theta = cos(radians);
-		double floatMax = std::numeric_limits<double>::max();
+		real floatMax = std::numeric_limits<real>::max();
 		hasbox = ptr->bounding_box(0, 1, bbox);
 		vec3 min(floatMax, floatMax, floatMax);
 		vec3 max(-floatMax, -floatMax, -floatMax);
@@ -347,12 +616,12 @@ public:
 			{
 				for (int k = 0; k < 2; k++)
 				{
-					double x = i * bbox.max().x + (1 - i) * bbox.min().x;
-					double y = i * bbox.max().y + (1 - i) * bbox.min().y;
-					double z = i * bbox.max().z + (1 - i) * bbox.min().z;
+					real x = i * bbox.max().x + (1 - i) * bbox.min().x;
+					real y = j * bbox.max().y + (1 - j) * bbox.min().y;
+					real z = k * bbox.max().z + (1 - k) * bbox.min().z;
 
-					double newx = cos_theta * x + sin_theta * z;
-					double newz = -sin_theta * x + cos_theta * z;
+					real newx = cos_theta * x + sin_theta * z;
+					real newz = -sin_theta * x + cos_theta * z;
 					vec3 tester(newx, y, newz);
 					for (int c = 0; c < 3; c++)
 					{
@@ -370,7 +639,7 @@ public:
 		}
 		bbox = aabb(min, max);
 	}
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+	ray rotate_ray(const ray& r) const
 	{
 		vec3 origin = r.origin();
 		vec3 direction = r.direction();
@@ -381,36 +650,54 @@ public:
 		direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
 		direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-		ray rotated_r(origin, direction, r.time());
-		if (ptr->hit(rotated_r, t_min, t_max, rec))
-		{
-			vec3 p = rec.p;
-			vec3 normal = rec.normal;
+		return ray(origin, direction, r.time());
+	}
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		return intersect_wrapped(*ptr, rotate_ray(r), t_min, t_max, rec);
+	}
+	virtual void surface(const ray& r, hit_record& rec) const
+	{
+		surface_wrapped(rotate_ray(r), rec);
 
-			p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-			p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
+		vec3 p = rec.p;
+		vec3 normal = rec.normal;
 
-			normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-			normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+		p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
+		p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
 
-			rec.p = p;
-			rec.normal = normal;
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+		normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
+		normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+
+		rec.p = p;
+		rec.normal = normal;
+	}
+	virtual bool occluded(const ray& r, real t_min, real t_max) const
+	{
+		return ptr->occluded(rotate_ray(r), t_min, t_max);
 	}
-	virtual bool bounding_box(double t0, double t1, aabb& box) const
+	virtual bool bounding_box(real t0, real t1, aabb& box) const
 	{
 		box = bbox;
 		return hasbox;
 	}
+	// rotation keeps area
+	real power() const override
+	{
+		return ptr->power();
+	}
+	direction_cone normal_cone() const override
+	{
+		direction_cone cone = ptr->normal_cone();
+		vec3 axis = cone.axis;
+		cone.axis[0] = cos_theta * axis[0] + sin_theta * axis[2];
+		cone.axis[2] = -sin_theta * axis[0] + cos_theta * axis[2];
+		return cone;
+	}
 	virtual ~rotate_y() {}
 	std::shared_ptr<hittable> ptr;
-	double sin_theta;
-	double cos_theta;
+	real sin_theta;
+	real cos_theta;
 	bool hasbox;
 	aabb bbox;
 };
@@ -422,30 +709,27 @@ class constant_medium : public hittable
 public:
 	constant_medium(
 		std::shared_ptr<hittable> b,
-		double d,
+		real d,
 		std::shared_ptr<material> mat) : boundary(b), density(d), mp(mat)
 	{
 	}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const
 	{
-		static std::uniform_real_distribution<double> uniform;
-		static std::minstd_rand engine;
-
 		hit_record rec1, rec2;
 
 		// hit the volume
-		if (boundary->hit(
+		if (boundary->intersect(
 			r,
-			-std::numeric_limits<double>::max(),
-			std::numeric_limits<double>::max(),
+			-std::numeric_limits<real>::max(),
+			std::numeric_limits<real>::max(),
 			rec1))
 		{
 			// take a small step
-			if(boundary->hit(
+			if(boundary->intersect(
 				r,
 				rec1.t + 0.0001f,
-				std::numeric_limits<double>::max(),
+				std::numeric_limits<real>::max(),
 				rec2))
 			{
 				// out of bound
@@ -460,16 +744,15 @@ public:
 				if (rec1.t < 0)
 					rec1.t = 0;
 
-				double distance_inside_boundary =
+				real distance_inside_boundary =
 					(rec2.t - rec1.t) * r.direction().length();
-				double hit_distance = -(1 / density) * log(uniform(engine));
+				// intersect takes no generator, draw one keyed by the ray
+				real hit_distance = -(1 / density) * log(1 - rng::for_ray(r).uniform());
 
 				if (hit_distance < distance_inside_boundary)
 				{
 					rec.t = rec1.t + hit_distance / r.direction().length();
-					rec.p = r.point_at_parameter(rec.t);
-					rec.normal = vec3(1, 0, 0); // arbitrary
-					rec.mat_ptr = mp.get();
+					rec.object = this;
 					return true;
 				}
 			}
@@ -478,13 +761,20 @@ public:
 		return false;
 	}
 
-	virtual bool bounding_box(double t0, double t1, aabb& box) const
+	virtual void surface(const ray& r, hit_record& rec) const
+	{
+		rec.p = r.point_at_parameter(rec.t);
+		rec.normal = vec3(1, 0, 0); // arbitrary
+		rec.mat_ptr = mp.get();
+	}
+
+	virtual bool bounding_box(real t0, real t1, aabb& box) const
 	{
 		return boundary->bounding_box(t0, t1, box);
 	}
 
 	std::shared_ptr<hittable> boundary;
-	double density;
+	real density;
 	std::shared_ptr<material> mp;
 };
 
@@ -8,107 +8,72 @@ public:
 	hittable_list() {}
 	hittable_list(const std::vector<std::shared_ptr<hittable>>& l) : objects(l) {}
 
-	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
 	{
-		hit_record temp_rec;
+		// rec only changes on a closer hit, no copy needed
 		bool hit_anything = false;
-		double closet_so_far = t_max;
-		for (size_t i = 0; i < objects.size(); i++)
-		{
-			if (objects[i]->hit(r, t_min, closet_so_far, temp_rec))
-			{
-				hit_anything = true;
-				closet_so_far = temp_rec.t;
-				rec = temp_rec;
-			}
-		}
-
+		real closet_so_far = t_max;
 		for (auto& p : objects)
 		{
-			if (p->hit(r, t_min, closet_so_far, temp_rec))
+			if (p->intersect(r, t_min, closet_so_far, rec))
 			{
 				hit_anything = true;
-				closet_so_far = temp_rec.t;
-				rec = temp_rec;
+				closet_so_far = rec.t;
 			}
 		}
 
 		return hit_anything;
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	bool occluded(const ray& r, real t_min, real t_max) const override
 	{
-		return true;
+		for (const auto& object : objects)
+			if (object->occluded(r, t_min, t_max))
+				return true;
+		return false;
 	}
 
-	double hittable_list::pdf_value(const vec3& o, const vec3& v) const override
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
-		double weight = 1.0 / objects.size();
-		double sum = 0.0;
+		if (objects.empty())
+			return false;
 
+		box = aabb::empty();
 		for (const auto& object : objects)
-			sum += weight * object->pdf_value(o, v);
-
-		return sum;
-	}
-
-	vec3 hittable_list::random(const vec3& o) const override
-	{
-		int int_size = static_cast<int>(objects.size());
-		return objects[random_int(0, int_size - 1)]->random(o);
+		{
+			aabb object_box;
+			if (!object->bounding_box(t0, t1, object_box))
+				return false;
+			box = aabb::surrounding(box, object_box);
+		}
+		return true;
 	}
 
-	std::vector<std::shared_ptr<hittable>> objects;
-};
-
-// AABB
-class box : public hittable
-{
-public:
-	box() {}
-	box(const vec3& p0, const vec3& p1, std::shared_ptr<material> mat)
+	// as light, objects are picked uniformly, scene lights go through light_bvh which picks by power
+	real hittable_list::pdf_value(const vec3& o, const vec3& v) const override
 	{
-		pmin = p0;
-		pmax = p1;
-
-		// AABB composed with 6 planes
-		std::vector<std::shared_ptr<hittable>> objects;
-		objects.push_back(
-			std::make_shared<xy_rect>(
-				p0.x, p1.x, p0.y, p1.y, p1.z, mat));
-		objects.push_back(std::make_shared<flip_normals>(
-			std::make_shared<xy_rect>(
-				p0.x, p1.x, p0.y, p1.y, p0.z, mat)));
-
-		objects.push_back(
-			std::make_shared<xz_rect>(
-				p0.x, p1.x, p0.z, p1.z, p1.y, mat));
-		objects.push_back(std::make_shared<flip_normals>(
-			std::make_shared<xz_rect>(
-				p0.x, p1.x, p0.z, p1.z, p0.y, mat)));
+		real weight = real(1.0) / objects.size();
+		real sum = 0.0;
 
-		objects.push_back(
-			std::make_shared<yz_rect>(
-				p0.y, p1.y, p0.z, p1.z, p1.x, mat));
-		objects.push_back(std::make_shared<flip_normals>(
-			std::make_shared<yz_rect>(
-				p0.y, p1.y, p0.z, p1.z, p0.x, mat)));
+		for (const auto& object : objects)
+			sum += weight * object->pdf_value(o, v);
 
-		list_ptr = hittable_list(objects);
+		return sum;
 	}
 
-	bool hit(const ray& r, double t0, double t1, hit_record& rec) const override
+	vec3 hittable_list::random(const vec3& o, sampler& g) const override
 	{
-		// test hit with each plane
-		return list_ptr.hit(r, t0, t1, rec);
+		int int_size = static_cast<int>(objects.size());
+		return objects[random_int(g, 0, int_size - 1)]->random(o, g);
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	real power() const override
 	{
-		box = aabb(pmin, pmax);
-		return true;
+		real sum = 0.0;
+		for (const auto& object : objects)
+			sum += object->power();
+		return sum;
 	}
 
-	vec3 pmin, pmax;
-	hittable_list list_ptr; // hold 6 planes
+	std::vector<std::shared_ptr<hittable>> objects;
 };
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "hittable.h"
+#include "transform.h"
+
+// object placed in world by an affine transform
+// blas (bottom level acceleration structure) is shared, so many copies of one mesh cost one bvh,
+// scene bvh over instances serves as top level
+class instance : public hittable
+{
+public:
+	instance(std::shared_ptr<hittable> p, const transform& t) : blas(p), object_to_world(t), inverse_determinant(std::fabs(1 / t.determinant())) {}
+
+	// direction is not normalized, t stays the same in both spaces
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		return intersect_wrapped(*blas, object_ray(r), t_min, t_max, rec);
+	}
+
+	// attributes of the blas primitive hit, taken to world once for the closest hit
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		surface_wrapped(object_ray(r), rec);
+		rec.p = object_to_world.point(rec.p);
+		rec.normal = normalize(object_to_world.normal(rec.normal));
+	}
+
+	bool occluded(const ray& r, real t_min, real t_max) const override
+	{
+		return blas->occluded(object_ray(r), t_min, t_max);
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
+	{
+		if (!blas->bounding_box(t0, t1, box))
+			return false;
+		box = object_to_world.box(box);
+		return true;
+	}
+
+	// directions from o map to directions from its object space point, solid angle density then
+	// changes by |det B| / |B v|^3 for unit v with B the inverse, 1 for a rigid transform
+	real pdf_value(const vec3& o, const vec3& v) const override
+	{
+		vec3 object_v = object_to_world.inverse_vector(normalize(v));
+		real object_pdf = blas->pdf_value(object_to_world.inverse_point(o), object_v);
+		if (object_pdf <= 0)
+			return 0;
+		real length = object_v.length();
+		return object_pdf * inverse_determinant / (length * length * length);
+	}
+
+	vec3 random(const vec3& o, sampler& g) const override
+	{
+		return object_to_world.vector(blas->random(object_to_world.inverse_point(o), g));
+	}
+
+	// scaled by area, a plane of unit normal n takes |det| |inverse transpose n|, which is exact for a flat blas
+	// any other takes |det|^(2/3), exact for a similarity and only picks lights worse otherwise
+	real power() const override
+	{
+		direction_cone cone = blas->normal_cone();
+		real area_scale = cone.cos_theta >= 1
+			? object_to_world.normal(cone.axis).length() / inverse_determinant
+			: std::pow(1 / inverse_determinant, real(2) / 3);
+		return blas->power() * area_scale;
+	}
+
+	// axis as a normal, angle kept by a similarity, otherwise widened to every direction
+	direction_cone normal_cone() const override
+	{
+		direction_cone cone = blas->normal_cone();
+		if (cone.cos_theta > -1)
+			cone.axis = normalize(object_to_world.normal(cone.axis));
+		if (cone.cos_theta < 1 && !object_to_world.is_similarity())
+			cone.cos_theta = -1;
+		return cone;
+	}
+
+	std::shared_ptr<hittable> blas;
+	transform object_to_world;
+
+private:
+	ray object_ray(const ray& r) const
+	{
+		return ray(object_to_world.inverse_point(r.origin()), object_to_world.inverse_vector(r.direction()), r.time());
+	}
+
+	real inverse_determinant;
+};
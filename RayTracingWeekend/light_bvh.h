@@ -0,0 +1,479 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "hittable.h"
+
+// What a light tree node knows of the lights below it
+// Emission leaves diffuse_light against the surface normal and only on that side (half angle pi / 2 around each normal),
+// so axis is the opposite of the normal cone and cos_theta_o its spread.
+struct light_bounds
+{
+	aabb box;
+	vec3 axis;
+	real cos_theta_o;
+	real phi;			// power, see hittable::power
+
+	// contribution expected at p, an upper bound of power * cos / distance^2 over every point and direction in bounds
+	// receiving surface is not known to pdf_value, so its cosine is left out
+	// See pbrt 4th edition, 12.6.3 Bounds for Light Samples
+	real importance(const vec3& p) const
+	{
+		vec3 center = box.centroid();
+		vec3 to_p = p - center;
+		real distance_squared = to_p.length_squared();
+		real radius_squared = (box.max() - center).length_squared();
+
+		// cos of the largest angle between axis and a direction from bounds to p, 1 when p is inside
+		real cos_theta_p = 1;
+		if (distance_squared > radius_squared)
+		{
+			real cos_theta_w = dot(axis, to_p) / std::sqrt(distance_squared);
+			real sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+			real sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+			real cos_theta_b = safe_sqrt(1 - radius_squared / distance_squared);
+			real sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+			// theta_w - theta_o - theta_b, clamped at 0
+			real cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+			real sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+			cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+		}
+
+		// beyond theta_e = pi / 2 nothing is emitted
+		if (cos_theta_p <= 0)
+			return 0;
+
+		// near or inside bounds distance is not meaningful, half the diagonal keeps it from blowing up
+		distance_squared = std::max(distance_squared, (box.max() - box.min()).length() / 2);
+		return phi * cos_theta_p / distance_squared;
+	}
+
+	static light_bounds surrounding(const light_bounds& a, const light_bounds& b)
+	{
+		if (a.phi == 0)
+			return b;
+		if (b.phi == 0)
+			return a;
+
+		light_bounds result;
+		result.box = aabb::surrounding(a.box, b.box);
+		result.phi = a.phi + b.phi;
+		surrounding_cone(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, result.axis, result.cos_theta_o);
+		return result;
+	}
+
+	// solid angle the bounds emit into, weighted by cosine, pi for a single one sided rect
+	// See pbrt 4th edition, 12.6.3 Bounding Volume Hierarchy for Lights
+	real orientation_measure() const
+	{
+		real theta_o = std::acos(clamp(cos_theta_o, real(-1), real(1)));
+		real theta_w = std::min(theta_o + real(M_PI / 2), real(M_PI));
+		real sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+		return real(2 * M_PI) * (1 - cos_theta_o) +
+			real(M_PI / 2) * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_theta_o + cos_theta_o);
+	}
+
+private:
+	static real safe_sqrt(real x) { return std::sqrt(std::max(x, real(0))); }
+
+	// cos(max(0, theta_a - theta_b)) and sin of the same
+	static real cos_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b)
+	{
+		if (cos_a > cos_b)
+			return 1;
+		return cos_a * cos_b + sin_a * sin_b;
+	}
+
+	static real sin_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b)
+	{
+		if (cos_a > cos_b)
+			return 0;
+		return sin_a * cos_b - cos_a * sin_b;
+	}
+
+	// smallest cone around both, rotated from a towards b
+	static void surrounding_cone(const vec3& a, real cos_a, const vec3& b, real cos_b, vec3& axis, real& cos_theta)
+	{
+		real theta_a = std::acos(clamp(cos_a, real(-1), real(1)));
+		real theta_b = std::acos(clamp(cos_b, real(-1), real(1)));
+		real theta_d = std::acos(clamp(dot(a, b), real(-1), real(1)));
+
+		axis = a;
+		cos_theta = cos_a;
+		if (std::min(theta_d + theta_b, real(M_PI)) <= theta_a)
+			return;
+
+		axis = b;
+		cos_theta = cos_b;
+		if (std::min(theta_d + theta_a, real(M_PI)) <= theta_b)
+			return;
+
+		axis = vec3(0, 0, 1);
+		cos_theta = -1;
+		real theta_o = (theta_a + theta_d + theta_b) / 2;
+		vec3 k = cross(a, b);
+		if (theta_o >= M_PI || k.length_squared() == 0)
+			return;
+
+		real theta_r = theta_o - theta_a;
+		k = normalize(k);
+		axis = normalize(a * std::cos(theta_r) + cross(k, a) * std::sin(theta_r));
+		cos_theta = std::cos(theta_o);
+	}
+};
+
+// Light hierarchy, lights picked by importance to the shading point
+// A light is picked walking down from the root, each child with probability of its importance,
+// so lights far away, dim or facing away get few samples however many lights there are.
+// pdf of a direction walks the same tree, down every node whose box the direction passes through.
+// One light per leaf, built top down with the surface area orientation heuristic over 12 buckets.
+// Lights without bounds are picked beside the tree, zero power lights never (glass listed for caustics).
+// See Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018
+// and pbrt 4th edition, 12.6.3 BVH Light Sampling
+class light_bvh : public hittable
+{
+public:
+	light_bvh() {}
+	light_bvh(const std::vector<std::shared_ptr<hittable>>& objects, real t0, real t1) { build(objects, t0, t1); }
+
+	void build(const std::vector<std::shared_ptr<hittable>>& objects, real t0, real t1)
+	{
+		lights.clear();
+		unbounded.clear();
+		nodes.clear();
+
+		// none reports power (meshes, media), all of them count the same as a plain list would
+		bool any_power = false;
+		for (const auto& object : objects)
+			any_power |= object->power() > 0;
+
+		std::vector<light_bounds> items;
+		for (const auto& object : objects)
+		{
+			light_bounds b;
+			b.phi = any_power ? object->power() : real(1);
+			if (b.phi <= 0)
+				continue;
+
+			if (!object->bounding_box(t0, t1, b.box))
+			{
+				unbounded.push_back(object);
+				continue;
+			}
+
+			direction_cone normals = object->normal_cone();
+			b.axis = -normals.axis;
+			b.cos_theta_o = normals.cos_theta;
+			lights.push_back(object);
+			items.push_back(b);
+		}
+
+		if (items.empty())
+			return;
+
+		std::vector<uint32_t> order(items.size());
+		for (uint32_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		nodes.reserve(2 * items.size() - 1);
+		build_node(items, order, 0, order.size(), 0);
+	}
+
+	bool empty() const { return nodes.empty() && unbounded.empty(); }
+	size_t light_count() const { return lights.size() + unbounded.size(); }
+
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		bool hit_anything = false;
+		for (const auto& object : unbounded)
+		{
+			if (object->intersect(r, t_min, t_max, rec))
+			{
+				hit_anything = true;
+				t_max = rec.t;
+			}
+		}
+
+		if (nodes.empty())
+			return hit_anything;
+
+		traversal_ray tr(r);
+		uint32_t stack[64];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const node& n = nodes[stack[--stack_size]];
+			if (!n.bounds.box.hit(tr, t_min, t_max))
+				continue;
+
+			if (n.leaf)
+			{
+				if (lights[n.index]->intersect(r, t_min, t_max, rec))
+				{
+					hit_anything = true;
+					t_max = rec.t;
+				}
+				continue;
+			}
+
+			stack[stack_size++] = n.index;
+			stack[stack_size++] = static_cast<uint32_t>(&n - nodes.data()) + 1;
+		}
+		return hit_anything;
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
+	{
+		if (nodes.empty() || !unbounded.empty())
+			return false;
+		box = nodes[0].bounds.box;
+		return true;
+	}
+
+	real pdf_value(const vec3& o, const vec3& v) const override
+	{
+		real p_unbounded = unbounded_probability();
+		real sum = bounded_pdf_value(o, v);
+		for (const auto& object : unbounded)
+			sum += p_unbounded / unbounded.size() * object->pdf_value(o, v);
+		return sum;
+	}
+
+	// part of pdf_value from lights in the tree, the only ones with points to resample (restir.h)
+	real bounded_pdf_value(const vec3& o, const vec3& v) const
+	{
+		real sum = 0;
+		if (nodes.empty())
+			return sum;
+
+		// probability of reaching a node, multiplied by each choice on the way down
+		struct entry
+		{
+			uint32_t index;
+			real probability;
+		};
+		entry stack[64];
+		int stack_size = 0;
+		real p_root = nodes[0].leaf && nodes[0].bounds.importance(o) <= 0 ? 0 : 1 - unbounded_probability();
+		if (p_root > 0)
+			stack[stack_size++] = { 0, p_root };
+
+		traversal_ray tr(ray(o, v, 0));
+		while (stack_size > 0)
+		{
+			entry e = stack[--stack_size];
+			const node& n = nodes[e.index];
+			if (!n.bounds.box.hit(tr, real(0.001), std::numeric_limits<real>::max()))
+				continue;
+
+			if (n.leaf)
+			{
+				sum += e.probability * lights[n.index]->pdf_value(o, v);
+				continue;
+			}
+
+			real p_first;
+			if (!child_probability(e.index, o, p_first))
+				continue;
+			if (p_first > 0)
+				stack[stack_size++] = { e.index + 1, e.probability * p_first };
+			if (p_first < 1)
+				stack[stack_size++] = { n.index, e.probability * (1 - p_first) };
+		}
+		return sum;
+	}
+
+	vec3 random(const vec3& o, sampler& g) const override
+	{
+		real u = g.get_1d();
+		real p_unbounded = unbounded_probability();
+		if (u < p_unbounded)
+		{
+			size_t i = std::min(static_cast<size_t>(u / p_unbounded * unbounded.size()), unbounded.size() - 1);
+			return unbounded[i]->random(o, g);
+		}
+
+		// one number for the whole walk, rescaled after each choice
+		u = std::min((u - p_unbounded) / (1 - p_unbounded), one_minus_epsilon());
+		if (nodes[0].leaf && nodes[0].bounds.importance(o) <= 0)
+			return vec3(1, 0, 0); // pdf_value is 0 for it
+
+		uint32_t index = 0;
+		while (!nodes[index].leaf)
+		{
+			real p_first;
+			if (!child_probability(index, o, p_first))
+				return vec3(1, 0, 0);
+
+			if (u < p_first)
+			{
+				u = std::min(u / p_first, one_minus_epsilon());
+				index = index + 1;
+			}
+			else
+			{
+				u = std::min((u - p_first) / (1 - p_first), one_minus_epsilon());
+				index = nodes[index].index;
+			}
+		}
+		return lights[nodes[index].index]->random(o, g);
+	}
+
+	real power() const override
+	{
+		real sum = nodes.empty() ? real(0) : nodes[0].bounds.phi;
+		for (const auto& object : unbounded)
+			sum += object->power();
+		return sum;
+	}
+
+private:
+	// depth-first, first child of an interior node is the next node
+	struct node
+	{
+		light_bounds bounds;
+		uint32_t index;		// leaf: light, interior: second child
+		bool leaf;
+	};
+
+	static real one_minus_epsilon() { return real(1) - std::numeric_limits<real>::epsilon(); }
+
+	// as pbrt, the tree is one more candidate beside each unbounded light
+	real unbounded_probability() const
+	{
+		if (unbounded.empty())
+			return 0;
+		return real(unbounded.size()) / (unbounded.size() + (nodes.empty() ? 0 : 1));
+	}
+
+	// probability of the first child, false when neither matters at o
+	bool child_probability(uint32_t index, const vec3& o, real& p_first) const
+	{
+		real first = nodes[index + 1].bounds.importance(o);
+		real second = nodes[nodes[index].index].bounds.importance(o);
+		if (first + second <= 0)
+			return false;
+		p_first = first / (first + second);
+		return true;
+	}
+
+	// traversal stacks hold 64 entries, past max_depth splits are balanced
+	static const int max_depth = 32;
+
+	light_bounds build_node(const std::vector<light_bounds>& items, std::vector<uint32_t>& order, size_t begin, size_t end, int depth)
+	{
+		uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(node());
+
+		if (end - begin == 1)
+		{
+			nodes[index] = { items[order[begin]], order[begin], true };
+			return nodes[index].bounds;
+		}
+
+		aabb centroid_box = aabb::empty();
+		aabb box = aabb::empty();
+		for (size_t i = begin; i < end; i++)
+		{
+			vec3 c = items[order[i]].box.centroid();
+			centroid_box = aabb::surrounding(centroid_box, aabb(c, c));
+			box = aabb::surrounding(box, items[order[i]].box);
+		}
+
+		// cost of a split is power * orientation measure * surface area of each side,
+		// scaled up for boxes thin along the split axis (Kr in pbrt)
+		const int bucket_count = 12;
+		real best_cost = std::numeric_limits<real>::max();
+		int best_axis = -1;
+		int best_bucket = 0;
+		vec3 extent = box.max() - box.min();
+		real max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+		for (int axis = 0; axis < 3; axis++)
+		{
+			real lo = centroid_box.min()[axis];
+			real hi = centroid_box.max()[axis];
+			if (hi <= lo)
+				continue;
+
+			light_bounds buckets[bucket_count] = {};
+			for (size_t i = begin; i < end; i++)
+			{
+				light_bounds& bucket = buckets[bucket_of(items[order[i]], axis, lo, hi, bucket_count)];
+				bucket = light_bounds::surrounding(bucket, items[order[i]]);
+			}
+
+			real kr = extent[axis] > 0 ? max_extent / extent[axis] : real(1);
+			for (int split = 0; split < bucket_count - 1; split++)
+			{
+				light_bounds below = {}, above = {};
+				for (int b = 0; b <= split; b++)
+					below = light_bounds::surrounding(below, buckets[b]);
+				for (int b = split + 1; b < bucket_count; b++)
+					above = light_bounds::surrounding(above, buckets[b]);
+
+				real cost = kr * (cost_of(below) + cost_of(above));
+				if (cost > 0 && cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bucket = split;
+				}
+			}
+		}
+
+		size_t mid = (begin + end) / 2;
+		if (depth >= max_depth)
+		{
+			int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b)
+			{
+				return items[a].box.centroid()[axis] < items[b].box.centroid()[axis];
+			});
+		}
+		else if (best_axis >= 0)
+		{
+			real lo = centroid_box.min()[best_axis];
+			real hi = centroid_box.max()[best_axis];
+			auto it = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t i)
+			{
+				return bucket_of(items[i], best_axis, lo, hi, bucket_count) <= best_bucket;
+			});
+			size_t split = it - order.begin();
+			if (split != begin && split != end)
+				mid = split;
+		}
+		// all centroids at one point or an empty side, halves in any order are as good
+
+		light_bounds first = build_node(items, order, begin, mid, depth + 1);
+		uint32_t second_index = static_cast<uint32_t>(nodes.size());
+		light_bounds second = build_node(items, order, mid, end, depth + 1);
+
+		nodes[index] = { light_bounds::surrounding(first, second), second_index, false };
+		return nodes[index].bounds;
+	}
+
+	static int bucket_of(const light_bounds& b, int axis, real lo, real hi, int bucket_count)
+	{
+		int i = static_cast<int>(bucket_count * (b.box.centroid()[axis] - lo) / (hi - lo));
+		return clamp(i, 0, bucket_count - 1);
+	}
+
+	static real cost_of(const light_bounds& b)
+	{
+		if (b.phi == 0)
+			return 0;
+		return b.phi * b.orientation_measure() * b.box.surface_area();
+	}
+
+	std::vector<node> nodes;
+	std::vector<std::shared_ptr<hittable>> lights;		// indexed by leaves
+	std::vector<std::shared_ptr<hittable>> unbounded;	// no box, picked beside the tree
+};
@@ -14,16 +14,16 @@ inline vec3 reflect(const vec3& v, const vec3& n)
 
 // a good reference for the math part
 // http://graphics.stanford.edu/courses/cs148-10-summer/docs/2006--degreve--reflection_refraction.pdf
-inline bool refract(const vec3& v, const vec3& n, double ni_over_nt, vec3& refracted)
+inline bool refract(const vec3& v, const vec3& n, real ni_over_nt, vec3& refracted)
 {
 	vec3 uv = normalize(v);
 	// dt = cos(i)
-	double dt = dot(uv, n);
+	real dt = dot(uv, n);
 	// discriminant = 1 - (ni / nt) ^ 2 * sin(i) ^ 2
 	//              = 1 - (sin(t) / sin(i)) ^ 2 * sin(i) ^2
 	//				= 1 - sin(t) ^ 2
 	//				= cos(t) ^ 2
-	double discriminant = 1.0 - ni_over_nt * ni_over_nt * (1 - dt * dt);
+	real discriminant = 1.0 - ni_over_nt * ni_over_nt * (1 - dt * dt);
 	if (discriminant > 0)
 	{
 		// [Check] refracted = ???
@@ -41,9 +41,9 @@ inline bool refract(const vec3& v, const vec3& n, double ni_over_nt, vec3& refra
 // the schlick approximation for fresnel factor (specular reflection coefficient)
 // R(theta) = R0 + (1 - R0)(1- cos(theta)) ^ 5
 // R0 = ((n1 - n2) / (n1 + n2)) ^ 2
-inline double schlick(double cosine, double ref_idx)
+inline real schlick(real cosine, real ref_idx)
 {
-	double r0 = (1 - ref_idx) / (1 + ref_idx);
+	real r0 = (1 - ref_idx) / (1 + ref_idx);
 	r0 = r0 * r0;
 	return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
@@ -51,7 +51,7 @@ inline double schlick(double cosine, double ref_idx)
 struct scatter_record
 {
 	ray scattered_ray_without_pdf;
-	std::shared_ptr<pdf> pdf_ptr;
+	pdf_storage pdf_ptr; // empty for specular, scattered_ray_without_pdf is used instead
 
 	vec3 attenuation;
 };
@@ -59,41 +59,55 @@ struct scatter_record
 class material
 {
 public:
-	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const = 0;
+	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const = 0;
 
-	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
 	{
 		return 0.0;
 	}
 
-	virtual vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const
+	virtual vec3 emitted(const ray& r_in, const hit_record& rec, real u, real v, const vec3& p) const
 	{
 		return vec3(0, 0, 0);
 	}
 
+	// whether hit_record u, v are read by its textures
+	virtual bool uses_uv() const { return false; }
+
+	// radiance emitted on average over the surface, for light selection
+	virtual vec3 emitted_radiance() const { return vec3(0, 0, 0); }
+
 	virtual ~material() {}
 };
 
+inline real hittable::power() const
+{
+	const material* m = surface_material();
+	if (m == nullptr)
+		return 0.0;
+	return area() * luminance(m->emitted_radiance());
+}
+
 class lambertian : public material
 {
 public:
 	explicit lambertian(std::shared_ptr<texture> a) : albedo(a) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const override
 	{
 #if 0 // random_in_unit_sphere - without normalize, ray concentrate on normal direction
-		vec3 target = rec.p + rec.normal + random_in_unit_sphere();
+		vec3 target = rec.p + rec.normal + random_in_unit_sphere(g);
 		scattered = ray(rec.p, normalize(target - rec.p), r_in.time());
 		sampling_pdf = scattering_pdf(r_in, rec, scattered);
 #endif // random_in_unit_sphere
 
 #if 0 // random_unit_vector
-		vec3 target = rec.p + rec.normal + random_unit_vector();
+		vec3 target = rec.p + rec.normal + random_unit_vector(g);
 		scattered = ray(rec.p, normalize(target - rec.p), r_in.time());
 		sampling_pdf = scattering_pdf(r_in, rec, scattered);
 #endif // random_unit_vector
 
 #if 0 // random_in_hemisphere
-		vec3 direction = random_in_hemisphere(rec.normal);
+		vec3 direction = random_in_hemisphere(g, rec.normal);
 		scattered = ray(rec.p, normalize(direction), r_in.time());
 		sampling_pdf = 1.0f / (2.0f * M_PI);
 #endif // random_in_hemisphere
@@ -101,55 +115,57 @@ public:
 #if 0 // onb
 		onb uvw;
 		uvw.build_from_w(rec.normal);
-		vec3 direction = uvw.local(random_cosine_direction());
+		vec3 direction = uvw.local(random_cosine_direction(g));
 		scattered = ray(rec.p, normalize(direction), r_in.time());
 		sampling_pdf = dot(uvw.w(), scattered.direction()) / M_PI;
 #endif // onb
 
 		srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-		srec.pdf_ptr = std::make_shared<cosine_pdf>(rec.normal);
+		srec.pdf_ptr.emplace<cosine_pdf>(rec.normal);
 
 		return true;
 	}
 
-	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
 	{
-		double cosine = dot(rec.normal, normalize(scattered.direction()));
+		real cosine = dot(rec.normal, normalize(scattered.direction()));
 		return cosine < 0 ? 0 : cosine / M_PI;
 	}
 
+	bool uses_uv() const override { return albedo->uses_uv(); }
+
 	std::shared_ptr<texture> albedo;
 };
 
 class metal : public material
 {
 public:
-	explicit metal(const vec3& a, double f) : albedo(a), fuzz(f) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+	explicit metal(const vec3& a, real f) : albedo(a), fuzz(f) {}
+	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const override
 	{
 		// reflected ray goes to mirror-reflected direction
 		vec3 reflected = reflect(normalize(r_in.direction()), rec.normal);
-		srec.scattered_ray_without_pdf = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+		srec.scattered_ray_without_pdf = ray(rec.p, reflected + fuzz * random_in_unit_sphere(g), r_in.time());
 		srec.attenuation = albedo;
-		srec.pdf_ptr = nullptr;
+		srec.pdf_ptr.reset();
 		return true;
 	}
 
 	vec3 albedo;
-	double fuzz;
+	real fuzz;
 };
 
 class dielectric : public material
 {
 public:
-	explicit dielectric(double ri) : ref_idx(ri) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+	explicit dielectric(real ri) : ref_idx(ri) {}
+	virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const override
 	{
 		srec.attenuation = vec3(1.0, 1.0, 1.0); // reflect / refract all
 				
 		vec3 outward_normal;
-		double ni_over_nt;
-		double cosine;
+		real ni_over_nt;
+		real cosine;
 		if (dot(r_in.direction(), rec.normal) > 0)
 		{
 			// inside -> outside
@@ -193,7 +209,7 @@ public:
 
 		vec3 reflected = reflect(r_in.direction(), rec.normal);
 		vec3 refracted;
-		double reflect_prob; // probability
+		real reflect_prob; // probability
 		if (refract(r_in.direction(), outward_normal, ni_over_nt, refracted))
 		{
 			// refraction or reflection			
@@ -206,9 +222,7 @@ public:
 			reflect_prob = 1.0;
 		}
 
-		static std::uniform_real_distribution<double> uniform;
-		static std::minstd_rand engine;
-		auto rand = uniform(engine);
+		auto rand = random_double(g);
 		if (rand < reflect_prob)
 		{
 			srec.scattered_ray_without_pdf = ray(rec.p, reflected, r_in.time());
@@ -221,7 +235,7 @@ public:
 		return true;
 	}
 
-	double ref_idx;
+	real ref_idx;
 };
 
 class diffuse_light : public material
@@ -229,13 +243,13 @@ class diffuse_light : public material
 public:
 	diffuse_light(std::shared_ptr<texture> a) : emit(a) {}
 
-	bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+	bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const override
 	{
 		// as light source, no reflection
 		return false;
 	}
 
-	vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const override
+	vec3 emitted(const ray& r_in, const hit_record& rec, real u, real v, const vec3& p) const override
 	{
 		if (dot(rec.normal, r_in.direction()) > 0)
 			return emit->value(u, v, p);
@@ -243,6 +257,11 @@ public:
 			return vec3(0, 0, 0);
 	}
 
+	bool uses_uv() const override { return emit->uses_uv(); }
+
+	// exact for constant textures, middle of the surface stands in for the others
+	vec3 emitted_radiance() const override { return emit->value(0.5, 0.5, vec3(0, 0, 0)); }
+
 	std::shared_ptr<texture> emit;
 };
 
@@ -254,12 +273,14 @@ class isotropic : public material
 public:
 	isotropic(std::shared_ptr<texture> t) : albedo(t) {}
 
-	bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+	bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, sampler& g) const override
 	{
-		srec.scattered_ray_without_pdf = ray(rec.p, random_in_unit_sphere(), r_in.time());
+		srec.scattered_ray_without_pdf = ray(rec.p, random_in_unit_sphere(g), r_in.time());
 		srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
 		return true;
 	}
 
+	bool uses_uv() const override { return albedo->uses_uv(); }
+
 	std::shared_ptr<texture> albedo;
 };
\ No newline at end of file
@@ -1,6 +1,6 @@
 #include "noise.h"
 
-double perlin::ranfloat[perlin::SIZE];
+real perlin::ranfloat[perlin::SIZE];
 vec3 perlin::ranvec[perlin::SIZE];
 int perlin::perm_x[perlin::SIZE];
 int perlin::perm_y[perlin::SIZE];
@@ -6,12 +6,12 @@
 #include "vec3.h"
 #include "ray.h"
 
-inline double smoothstep_hermite_cubic(double x)
+inline real smoothstep_hermite_cubic(real x)
 {
 	return x * x * (3 - 2 * x);
 }
 
-inline double smootherstep_perlin(double x)
+inline real smootherstep_perlin(real x)
 {
 	return x * x * x * (x * (x * 6 - 15) + 10);
 }
@@ -19,13 +19,13 @@ inline double smootherstep_perlin(double x)
 #define smooth smoothstep_hermite_cubic
 //#define smooth smootherstep_perlin
 
-inline double trilinear_interp(double c[2][2][2], double u, double v, double w)
+inline real trilinear_interp(real c[2][2][2], real u, real v, real w)
 {
-	double uu = smooth(u);
-	double vv = smooth(v);
-	double ww = smooth(w);
+	real uu = smooth(u);
+	real vv = smooth(v);
+	real ww = smooth(w);
 
-	double accum = 0;
+	real accum = 0;
 	for (int i = 0; i < 2; i++)
 		for (int j = 0; j < 2; j++)
 			for (int k = 0; k < 2; k++)
@@ -37,13 +37,13 @@ inline double trilinear_interp(double c[2][2][2], double u, double v, double w)
 	return accum;
 }
 
-inline double perlin_interp(vec3 c[2][2][2], double u, double v, double w)
+inline real perlin_interp(vec3 c[2][2][2], real u, real v, real w)
 {
-	double uu = smooth(u);
-	double vv = smooth(v);
-	double ww = smooth(w);
+	real uu = smooth(u);
+	real vv = smooth(v);
+	real ww = smooth(w);
 
-	double accum = 0;
+	real accum = 0;
 	for (int i = 0; i < 2; i++)
 		for (int j = 0; j < 2; j++)
 			for (int k = 0; k < 2; k++)
@@ -71,11 +71,11 @@ inline double perlin_interp(vec3 c[2][2][2], double u, double v, double w)
 class perlin
 {
 public:
-	double turb(const vec3& p, int depth = 7) const
+	real turb(const vec3& p, int depth = 7) const
 	{
-		double accum = 0;
+		real accum = 0;
 		vec3 temp_p = p;
-		double weight = 1.0;
+		real weight = 1.0;
 		for (int i = 0; i < depth; i++)
 		{
 			accum += weight * noise(temp_p);
@@ -86,16 +86,16 @@ public:
 	}
 
 	// -1 ~ 1
-	double noise(const vec3& p) const 
+	real noise(const vec3& p) const 
 	{
 		if (!initialized)
 		{
 			initialize();
 		}
 
-		double u = p.x - floor(p.x);
-		double v = p.y - floor(p.y);
-		double w = p.z - floor(p.z);
+		real u = p.x - floor(p.x);
+		real v = p.y - floor(p.y);
+		real w = p.z - floor(p.z);
 
 		enum class InterpolationType
 		{
@@ -114,7 +114,7 @@ public:
 				int j = (int)floor(p.y);
 				int k = (int)floor(p.z);
 
-				double c[2][2][2];
+				real c[2][2][2];
 
 				for (int di = 0; di < 2; di++)
 					for (int dj = 0; dj < 2; dj++)
@@ -186,14 +186,14 @@ private:
 		permute(p, n);
 	}
 
-	static void perlin_generate_float(double* p, int n)
+	static void perlin_generate_float(real* p, int n)
 	{
 		std::uniform_real_distribution<double> uniform;
 		std::minstd_rand engine;
 
 		for (int i = 0; i < n; i++)
 		{
-			p[i] = uniform(engine);
+			p[i] = static_cast<real>(uniform(engine));
 		}
 	}
 
@@ -215,7 +215,7 @@ private:
 	static const int SIZE = 256;
 	
 	// as lookup table
-	static double ranfloat[SIZE];	
+	static real ranfloat[SIZE];	
 	static vec3 ranvec[SIZE];
 	
 	static int perm_x[SIZE];
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <new>
+#include <type_traits>
+#include <utility>
+
 #include "onb.h"
 #include "hittable.h"
 
@@ -8,8 +12,8 @@ class pdf
 public:
 	virtual ~pdf() {}
 
-	virtual double value(const vec3& direction) const = 0;
-	virtual vec3 generate() const = 0;
+	virtual real value(const vec3& direction) const = 0;
+	virtual vec3 generate(sampler& g) const = 0;
 };
 
 class cosine_pdf : public pdf
@@ -17,63 +21,112 @@ class cosine_pdf : public pdf
 public:
 	cosine_pdf(const vec3& w) { uvw.build_from_w(w); }
 
-	virtual double value(const vec3& direction) const override
+	virtual real value(const vec3& direction) const override
 	{
-		double cosine = dot(normalize(direction), uvw.w());
+		real cosine = dot(normalize(direction), uvw.w());
 		return (cosine <= 0) ? 0 : cosine / M_PI;
 	}
 
-	virtual vec3 generate() const override
+	virtual vec3 generate(sampler& g) const override
 	{
-		return uvw.local(random_cosine_direction());
+		return uvw.local(random_cosine_direction(g));
 	}
 
 private:
 	onb uvw;
 };
 
+// weight of a sample drawn from the strategy with pdf f_pdf, when g_pdf could have drawn it too
+// See Veach, "Robust Monte Carlo Methods for Light Transport Simulation", 1997, 9.2.4
+inline real power_heuristic(real f_pdf, real g_pdf)
+{
+	real f = f_pdf * f_pdf;
+	real g = g_pdf * g_pdf;
+	return f / (f + g);
+}
+
+// pdfs below only point at what they combine, all of them live on the stack of one bounce
+
 class hittable_pdf : public pdf
 {
 public:
-	hittable_pdf(std::shared_ptr<hittable> p, const vec3& origin) : ptr(p), o(origin) {}
+	hittable_pdf(const hittable* p, const vec3& origin) : o(origin), ptr(p) {}
 
-	virtual double value(const vec3& direction) const 
+	virtual real value(const vec3& direction) const 
 	{
 		return ptr->pdf_value(o, direction);
 	}
 
-	virtual vec3 generate() const 
+	virtual vec3 generate(sampler& g) const 
 	{
-		return ptr->random(o);
+		return ptr->random(o, g);
 	}
 
 public:
 	vec3 o;
-	std::shared_ptr<hittable> ptr;
+	const hittable* ptr;
 };
 
 class mixture_pdf : public pdf
 {
 public:
-	mixture_pdf(std::shared_ptr<pdf> p0, std::shared_ptr<pdf> p1)
+	mixture_pdf(const pdf* p0, const pdf* p1)
 	{
 		p[0] = p0;
 		p[1] = p1;
 	}
 
-	virtual double value(const vec3& direction) const
+	virtual real value(const vec3& direction) const
 	{
 		return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
 	}
 
-	virtual vec3 generate() const
+	virtual vec3 generate(sampler& g) const
 	{
-		if (random_double() < 0.5)
-			return p[0]->generate();
+		if (random_double(g) < 0.5)
+			return p[0]->generate(g);
 		else
-			return p[1]->generate();
+			return p[1]->generate(g);
 	}
 
 private:
-	std::shared_ptr<pdf> p[2];
+	const pdf* p[2];
+};
+
+// pdf constructed in place of a fixed buffer, so scatter_record carries it without heap
+// sized for the pdfs materials hand out, emplace fails to compile for a bigger one
+class pdf_storage
+{
+public:
+	pdf_storage() {}
+	~pdf_storage() { reset(); }
+
+	// would copy the vtable pointer but not rebind ptr
+	pdf_storage(const pdf_storage&) = delete;
+	pdf_storage& operator=(const pdf_storage&) = delete;
+
+	template <typename pdf_type, typename... args_type>
+	pdf_type& emplace(args_type&&... args)
+	{
+		static_assert(sizeof(pdf_type) <= sizeof(buffer) && alignof(pdf_type) <= alignof(buffer_type), "pdf does not fit pdf_storage");
+
+		reset();
+		pdf_type* p = new (&buffer) pdf_type(std::forward<args_type>(args)...);
+		ptr = p;
+		return *p;
+	}
+
+	void reset()
+	{
+		if (ptr != nullptr)
+			ptr->~pdf();
+		ptr = nullptr;
+	}
+
+	const pdf* get() const { return ptr; }
+
+private:
+	typedef std::aligned_storage<sizeof(cosine_pdf), alignof(cosine_pdf)>::type buffer_type;
+	buffer_type buffer;
+	pdf* ptr = nullptr;
 };
\ No newline at end of file
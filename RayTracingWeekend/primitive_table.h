@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <typeinfo>
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "instance.h"
+
+// rect behind flip_normals, compiled as a rect of its own that turns the normal in surface()
+template <typename rect>
+class flipped_rect : public rect
+{
+public:
+	flipped_rect(const rect& r) : rect(r) {}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rect::surface(r, rec);
+		rec.normal = -rec.normal;
+	}
+};
+
+// Primitives compiled into one contiguous array per type
+// Leaf loop switches on a small tag and calls the concrete type directly,
+// instead of chasing a shared_ptr to the heap and an indirect call per primitive.
+// Types without a table (translate, rotate_y, flip_normals of anything but a rect, meshes, nested bvh,
+// environment) stay behind their pointer. An instance still calls its blas through one.
+class primitive_table
+{
+public:
+	enum class primitive_type : uint32_t
+	{
+		sphere,
+		moving_sphere,
+		xy_rect,
+		xz_rect,
+		yz_rect,
+		flipped_xy_rect,
+		flipped_xz_rect,
+		flipped_yz_rect,
+		box,
+		constant_medium,
+		instance,
+		other,
+	};
+
+	struct primitive_ref
+	{
+		primitive_type type;
+		uint32_t index; // into the table of its type
+	};
+
+	// hittable_list nested in the scene graph become its objects
+	static void flatten(const std::vector<std::shared_ptr<hittable>>& objects, std::vector<std::shared_ptr<hittable>>& out)
+	{
+		for (const auto& object : objects)
+		{
+			if (typeid(*object) == typeid(hittable_list))
+				flatten(static_cast<const hittable_list&>(*object).objects, out);
+			else
+				out.push_back(object);
+		}
+	}
+
+	// copy by exact type, a subclass would be sliced so it goes to others
+	void add(const std::shared_ptr<hittable>& object)
+	{
+		if (add_as(object, spheres, primitive_type::sphere)) return;
+		if (add_as(object, moving_spheres, primitive_type::moving_sphere)) return;
+		if (add_as(object, xy_rects, primitive_type::xy_rect)) return;
+		if (add_as(object, xz_rects, primitive_type::xz_rect)) return;
+		if (add_as(object, yz_rects, primitive_type::yz_rect)) return;
+		if (add_flipped(object, flipped_xy_rects, primitive_type::flipped_xy_rect)) return;
+		if (add_flipped(object, flipped_xz_rects, primitive_type::flipped_xz_rect)) return;
+		if (add_flipped(object, flipped_yz_rects, primitive_type::flipped_yz_rect)) return;
+		if (add_as(object, boxes, primitive_type::box)) return;
+		if (add_as(object, media, primitive_type::constant_medium)) return;
+		if (add_as(object, instances, primitive_type::instance)) return;
+
+		refs.push_back({ primitive_type::other, static_cast<uint32_t>(others.size()) });
+		others.push_back(object);
+	}
+
+	void reserve(size_t count) { refs.reserve(count); }
+	size_t size() const { return refs.size(); }
+
+	bool intersect(uint32_t i, const ray& r, real t_min, real t_max, hit_record& rec) const
+	{
+		const primitive_ref& ref = refs[i];
+		switch (ref.type)
+		{
+		case primitive_type::sphere:			return spheres[ref.index].sphere::intersect(r, t_min, t_max, rec);
+		case primitive_type::moving_sphere:		return moving_spheres[ref.index].moving_sphere::intersect(r, t_min, t_max, rec);
+		case primitive_type::xy_rect:			return xy_rects[ref.index].xy_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::xz_rect:			return xz_rects[ref.index].xz_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::yz_rect:			return yz_rects[ref.index].yz_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::flipped_xy_rect:	return flipped_xy_rects[ref.index].xy_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::flipped_xz_rect:	return flipped_xz_rects[ref.index].xz_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::flipped_yz_rect:	return flipped_yz_rects[ref.index].yz_rect::intersect(r, t_min, t_max, rec);
+		case primitive_type::box:				return boxes[ref.index].box::intersect(r, t_min, t_max, rec);
+		case primitive_type::constant_medium:	return media[ref.index].constant_medium::intersect(r, t_min, t_max, rec);
+		case primitive_type::instance:			return instances[ref.index].instance::intersect(r, t_min, t_max, rec);
+		default:								return others[ref.index]->intersect(r, t_min, t_max, rec);
+		}
+	}
+
+	// none of the table types but instance override occluded, so any hit of intersect answers it
+	bool occluded(uint32_t i, const ray& r, real t_min, real t_max) const
+	{
+		if (refs[i].type == primitive_type::other)
+			return others[refs[i].index]->occluded(r, t_min, t_max);
+		if (refs[i].type == primitive_type::instance)
+			return instances[refs[i].index].instance::occluded(r, t_min, t_max);
+
+		hit_record rec;
+		return intersect(i, r, t_min, t_max, rec);
+	}
+
+	std::vector<primitive_ref> refs; // in the order added, bvh adds in leaf order
+
+	std::vector<sphere> spheres;
+	std::vector<moving_sphere> moving_spheres;
+	std::vector<xy_rect> xy_rects;
+	std::vector<xz_rect> xz_rects;
+	std::vector<yz_rect> yz_rects;
+	std::vector<flipped_rect<xy_rect>> flipped_xy_rects;
+	std::vector<flipped_rect<xz_rect>> flipped_xz_rects;
+	std::vector<flipped_rect<yz_rect>> flipped_yz_rects;
+	std::vector<box> boxes;
+	std::vector<constant_medium> media;
+	std::vector<instance> instances;
+	std::vector<std::shared_ptr<hittable>> others;
+
+private:
+	template <typename T>
+	bool add_as(const std::shared_ptr<hittable>& object, std::vector<T>& table, primitive_type type)
+	{
+		if (typeid(*object) != typeid(T))
+			return false;
+
+		refs.push_back({ type, static_cast<uint32_t>(table.size()) });
+		table.push_back(static_cast<const T&>(*object));
+		return true;
+	}
+
+	template <typename rect>
+	bool add_flipped(const std::shared_ptr<hittable>& object, std::vector<flipped_rect<rect>>& table, primitive_type type)
+	{
+		if (typeid(*object) != typeid(flip_normals))
+			return false;
+		const hittable& wrapped = *static_cast<const flip_normals&>(*object).ptr;
+		if (typeid(wrapped) != typeid(rect))
+			return false;
+
+		refs.push_back({ type, static_cast<uint32_t>(table.size()) });
+		table.push_back(flipped_rect<rect>(static_cast<const rect&>(wrapped)));
+		return true;
+	}
+};
\ No newline at end of file
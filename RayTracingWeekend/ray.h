@@ -2,20 +2,42 @@
 
 #include "vec3.h"
 
-class ray
+template <typename T>
+class ray_t
 {
 public:
-	ray() {};
-	ray(const vec3& a, const vec3 &b, double ti) { _origin = a; _direction = b; _time = ti; }
-	vec3 origin() const { return _origin; }	
-	vec3 direction() const { return _direction; } // direction is not normalized !!!
-	vec3 point_at_parameter(double t) const { return _origin + _direction * t; }
+	ray_t() {};
+	ray_t(const vec3_t<T>& a, const vec3_t<T> &b, T ti) { _origin = a; _direction = b; _time = ti; }
+	const vec3_t<T>& origin() const { return _origin; }
+	const vec3_t<T>& direction() const { return _direction; } // direction is not normalized !!!
+	vec3_t<T> point_at_parameter(T t) const { return _origin + _direction * t; }
 
-	double time() const { return _time; }
+	T time() const { return _time; }
 
 private:
-	vec3 _origin;
-	vec3 _direction;
+	vec3_t<T> _origin;
+	vec3_t<T> _direction;
 
-	double _time;
-};
\ No newline at end of file
+	T _time;
+};
+
+typedef ray_t<real> ray;
+
+// ray prepared for many box tests, reciprocal direction and its sign computed once
+// sign picks near/far side of a box without branch
+// See Williams et al., "An Efficient and Robust Ray-Box Intersection Algorithm", 2005
+template <typename T>
+struct traversal_ray_t
+{
+	traversal_ray_t(const ray_t<T>& r) : origin(r.origin()), inv_direction(T(1) / r.direction())
+	{
+		for (int axis = 0; axis < 3; axis++)
+			sign[axis] = inv_direction[axis] < 0;
+	}
+
+	vec3_t<T> origin;
+	vec3_t<T> inv_direction;
+	int sign[3];
+};
+
+typedef traversal_ray_t<real> traversal_ray;
\ No newline at end of file
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "vec3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "sampler.h"
+#include "light_bvh.h"
+
+// Resampled direct light at camera vertices (ReSTIR, spatial reuse only)
+// Each pixel streams light candidates through a reservoir that keeps one of them with probability
+// proportional to weight, target over source pdf. Reservoirs of neighbor pixels are then resampled
+// into each pixel with its own target, and only the one kept is shadow tested.
+// Target is the unshadowed contribution, candidates come from hittable_pdf over lights.
+// What is kept is MIS weighted against the material sample of the path, as one light sample would be.
+// Samples are points on lights with area measure pdf, so a neighbor's sample means the same thing here.
+// See Bitterli et al., "Spatiotemporal Reservoir Resampling for Real-Time Ray Tracing with Dynamic Direct Lighting", 2020
+// and Wyman et al., "A Gentle Introduction to ReSTIR", SIGGRAPH 2023 Course
+
+// how far short of 1 (the point) a hit along the ray to a light point still counts as that point
+const real restir_light_epsilon = 1e-3f;
+
+// point on a light, radiance is what diffuse_light emits to every direction on its lit side
+struct light_point
+{
+	vec3 p = vec3(0, 0, 0);
+	vec3 normal = vec3(0, 0, 0);
+	vec3 emitted = vec3(0, 0, 0); // 0 for an empty reservoir, so its target is 0 anywhere
+};
+
+struct reservoir
+{
+	// keeps candidate with probability w / w_sum, sample count M is up to the caller
+	bool update(const light_point& candidate, real w, real u)
+	{
+		w_sum += w;
+		if (w <= 0 || u * w_sum >= w)
+			return false;
+		y = candidate;
+		return true;
+	}
+
+	light_point y;
+	real w_sum = 0;
+	real M = 0;
+	real W = 0;		// unbiased contribution weight of y, 1 / pdf in expectation
+};
+
+// first hit that scatters with a pdf, specular ones are left to the path
+struct restir_vertex
+{
+	// unshadowed f * Le * G towards a point on a light, as color() weights a light sample
+	vec3 contribution(const light_point& y) const
+	{
+		vec3 to_light = y.p - rec.p;
+		real distance_squared = to_light.length_squared();
+		if (distance_squared <= 0)
+			return vec3(0, 0, 0);
+
+		to_light /= sqrt(distance_squared);
+		real light_cosine = dot(y.normal, to_light);
+		if (light_cosine <= 0) // back of the light, see diffuse_light::emitted
+			return vec3(0, 0, 0);
+
+		real scattering_pdf = rec.mat_ptr->scattering_pdf(r, rec, ray(rec.p, to_light, r.time()));
+		if (scattering_pdf <= 0)
+			return vec3(0, 0, 0);
+
+		return attenuation * scattering_pdf * y.emitted * (light_cosine / distance_squared);
+	}
+
+	// sum of channels, with luminance a blue light is barely ever kept and stays noisy
+	real target(const light_point& y) const { vec3 c = contribution(y); return c.x + c.y + c.z; }
+
+	// whether light sampling here could find y, it takes the first light along a direction
+	// so a point behind another light never is a candidate, though its target is not 0
+	bool reaches(const light_point& y, const hittable& lights) const
+	{
+		hit_record light_rec;
+		return lights.intersect(ray(rec.p, y.p - rec.p, r.time()), 0.001f, std::numeric_limits<real>::max(), light_rec)
+			&& light_rec.t > real(1) - restir_light_epsilon;
+	}
+
+	// neighbor on about the same surface, else its samples mostly miss here and only add noise
+	bool similar(const restir_vertex& other) const
+	{
+		if (!other.valid)
+			return false;
+		real depth = rec.t * r.direction().length();
+		real other_depth = other.rec.t * other.r.direction().length();
+		return dot(rec.normal, other.rec.normal) > 0.9f && fabs(depth - other_depth) < 0.1f * depth;
+	}
+
+	ray r;
+	hit_record rec;
+	vec3 attenuation;
+	bool valid = false;
+};
+
+// candidates from light sampling, w = target / area pdf
+inline void restir_initial(const restir_vertex& x, const hittable& lights, int count, sampler& g, reservoir& out)
+{
+	out = reservoir();
+	hittable_pdf light_pdf(&lights, x.rec.p);
+	for (int k = 0; k < count; k++)
+	{
+		out.M += 1;
+
+		ray to_light(x.rec.p, light_pdf.generate(g), x.r.time());
+		real pdf_val = light_pdf.value(to_light.direction());
+		real u = g.get_1d();
+
+		hit_record light_rec;
+		if (pdf_val <= 0 || !lights.hit(to_light, 0.001f, std::numeric_limits<real>::max(), light_rec))
+			continue;
+		// environment has no point to share with neighbors, paths find it instead
+		if (light_rec.t >= std::numeric_limits<real>::max())
+			continue;
+
+		light_point candidate;
+		candidate.p = light_rec.p;
+		candidate.normal = light_rec.normal;
+		candidate.emitted = light_rec.mat_ptr->emitted(to_light, light_rec, light_rec.u, light_rec.v, light_rec.p);
+
+		// solid angle to area, cosine at the light over squared distance
+		real distance_squared = (light_rec.p - x.rec.p).length_squared();
+		real light_cosine = fabs(dot(light_rec.normal, normalize(to_light.direction())));
+		real area_pdf = pdf_val * light_cosine / distance_squared;
+		if (area_pdf <= 0)
+			continue;
+
+		out.update(candidate, x.target(candidate) / area_pdf, u);
+	}
+
+	real target = x.target(out.y);
+	out.W = target > 0 ? out.w_sum / (out.M * target) : 0;
+}
+
+// resamples reservoirs of x and its neighbors with the target of x
+// each sample is weighted by the balance heuristic over the targets of all of them, as the density its
+// reservoir picked it with, so a sample that only a few neighbors could have found is not averaged down
+// by those which could not. Targets of others count only where their light sampling could reach y.
+// See Lin et al., "Generalized Resampled Importance Sampling", SIGGRAPH 2022, 5.2
+inline reservoir restir_spatial(const restir_vertex& x, const reservoir& own, const restir_vertex* const* neighbors, const reservoir* const* neighbor_reservoirs, int count, const hittable& lights, sampler& g)
+{
+	const int max_count = 15;
+	count = std::min(count, max_count);
+	const restir_vertex* vertices[max_count + 1] = { &x };
+	const reservoir* reservoirs[max_count + 1] = { &own };
+	for (int k = 0; k < count; k++)
+	{
+		vertices[k + 1] = neighbors[k];
+		reservoirs[k + 1] = neighbor_reservoirs[k];
+	}
+
+	reservoir out;
+	real out_target = 0;
+	for (int i = 0; i <= count; i++)
+	{
+		const light_point& y = reservoirs[i]->y;
+		out.M += reservoirs[i]->M;
+		real u = g.get_1d();
+		if (reservoirs[i]->W <= 0)
+			continue;
+
+		// M times target is how likely each reservoir was to pick y, its own surely could reach it
+		real target = 0;
+		real numerator = 0;
+		real denominator = 0;
+		for (int j = 0; j <= count; j++)
+		{
+			real p = vertices[j]->target(y);
+			if (p > 0 && j != i && !vertices[j]->reaches(y, lights))
+				p = 0;
+			if (j == 0)
+				target = p;
+			if (j == i)
+				numerator = reservoirs[j]->M * p;
+			denominator += reservoirs[j]->M * p;
+		}
+		if (target <= 0 || denominator <= 0)
+			continue;
+
+		if (out.update(y, numerator / denominator * target * reservoirs[i]->W, u))
+			out_target = target;
+	}
+
+	out.W = out_target > 0 ? out.w_sum / out_target : 0;
+	return out;
+}
+
+// MIS weight of the kept sample against the material sample color() takes at the same vertex
+// resampling stands in for one light sample from the tree, the power heuristic is over the same two
+// densities color() weights emission it finds with, so the two weights add up to 1 at every light point
+// material pdf is the scattering pdf, which it is for lambertian, the one material with a pdf
+inline real restir_weight(const restir_vertex& x, const light_point& y, const light_bvh& lights)
+{
+	vec3 to_light = y.p - x.rec.p;
+	real light_pdf = lights.bounded_pdf_value(x.rec.p, to_light);
+	if (light_pdf <= 0)
+		return 0;
+	real material_pdf = x.rec.mat_ptr->scattering_pdf(x.r, x.rec, ray(x.rec.p, to_light, x.r.time()));
+	return power_heuristic(light_pdf, material_pdf);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "vec3.h"
+#include "ray.h"
+
+// PCG32, small state and good statistics
+// See O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for Random Number Generation", 2014
+// One generator per path, owned by its sampler for what is not a low discrepancy dimension.
+// Seeded from pixel and sample index, so a path draws the same numbers no matter
+// which thread traces it or in which order, and no state is shared between threads.
+class rng
+{
+public:
+	rng() : rng(0, 0) {}
+
+	// stream selects one of 2^63 sequences, seed the position in it
+	rng(uint64_t seed, uint64_t stream)
+	{
+		state = 0;
+		inc = (stream << 1) | 1;
+		next_uint();
+		state += seed;
+		next_uint();
+	}
+
+	// pixel picks the stream, sample skips ahead in it, dimension is the n-th draw after that
+	static rng for_sample(uint32_t pixel, uint32_t sample)
+	{
+		return rng(mix(sample), pixel);
+	}
+
+	// keyed by a ray, for code that gets no generator (constant_medium::intersect)
+	// the same ray always draws the same numbers, different paths have different rays
+	static rng for_ray(const ray& r)
+	{
+		uint64_t h = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			h = mix(h ^ bits(r.origin()[i]));
+			h = mix(h ^ bits(r.direction()[i]));
+		}
+		return rng(mix(h ^ bits(r.time())), h);
+	}
+
+	uint32_t next_uint()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = static_cast<uint32_t>(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+
+	// [0, 1), 24 bits so float never rounds up to 1
+	real uniform()
+	{
+		return static_cast<real>(next_uint() >> 8) * static_cast<real>(1.0 / 16777216.0);
+	}
+
+	real uniform(real a, real b)
+	{
+		return a + (b - a) * uniform();
+	}
+
+	// [a, b]
+	int uniform_int(int a, int b)
+	{
+		return a + static_cast<int>(next_uint() % static_cast<uint32_t>(b - a + 1));
+	}
+
+	// SplitMix64 finalizer, spreads nearby seeds (neighbor pixels, consecutive samples) apart
+	static uint64_t mix(uint64_t x)
+	{
+		x += 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		return x ^ (x >> 31);
+	}
+
+private:
+	static uint64_t bits(real value)
+	{
+		uint64_t result = 0;
+		std::memcpy(&result, &value, sizeof(value));
+		return result;
+	}
+
+	uint64_t state;
+	uint64_t inc;
+};
\ No newline at end of file
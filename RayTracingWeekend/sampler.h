@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "vec3.h"
+#include "rng.h"
+
+struct sample2
+{
+	real u, v;
+};
+
+// Source of the numbers one sample of one pixel consumes
+// Every draw takes the next dimension, get_2d takes two that are stratified together.
+// Camera owns the first dimensions, each bounce a fixed block after that, so the same
+// decision (lens, pixel, light pick, bsdf lobe...) sees the same dimension in every sample of a pixel.
+// See pbrt 3rd edition, 7.2 Sampling Theory and 7.4 Stratified Sampling
+class sampler
+{
+public:
+	enum class sampler_type
+	{
+		independent,
+		stratified,
+		halton,
+		sobol,
+	};
+
+	static const uint32_t camera_dimensions = 5; // pixel 2, lens 2, time 1
+	static const uint32_t bounce_dimensions = 8;
+
+	explicit sampler(int samples_per_pixel) : spp(static_cast<uint32_t>(std::max(samples_per_pixel, 1))) {}
+	virtual ~sampler() {}
+
+	void start(uint32_t pixel_index, uint32_t sample_index)
+	{
+		pixel = pixel_index;
+		index = sample_index;
+		dimension = 0;
+		g = rng::for_sample(pixel, index);
+	}
+
+	// never goes back, a bounce that drew more than its block shifts the next one instead of repeating it
+	void start_bounce(int depth)
+	{
+		dimension = std::max(dimension, camera_dimensions + static_cast<uint32_t>(depth) * bounce_dimensions);
+	}
+
+	virtual real get_1d() = 0;
+	virtual sample2 get_2d() = 0;
+
+protected:
+	// i-th element of a random permutation of [0, l) chosen by p, no table
+	// See Kensler, "Correlated Multi-Jittered Sampling", 2013
+	static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+	{
+		uint32_t w = l - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do
+		{
+			i ^= p; i *= 0xe170893d;
+			i ^= p >> 16;
+			i ^= (i & w) >> 4;
+			i ^= p >> 8; i *= 0x0929eb3f;
+			i ^= p >> 23;
+			i ^= (i & w) >> 1; i *= 1 | p >> 27;
+			i *= 0x6935fa69;
+			i ^= (i & w) >> 11; i *= 0x74dcb303;
+			i ^= (i & w) >> 2; i *= 0x9e501cc3;
+			i ^= (i & w) >> 2; i *= 0xc860a3df;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= l);
+		return (i + p) % l;
+	}
+
+	// per pixel and dimension, so neighbor pixels do not repeat the same pattern
+	uint32_t seed(uint32_t d) const
+	{
+		return static_cast<uint32_t>(rng::mix((static_cast<uint64_t>(pixel) << 32) | d));
+	}
+
+	static real one_minus_epsilon() { return real(1) - std::numeric_limits<real>::epsilon(); }
+
+	static real to_unit(uint32_t bits)
+	{
+		// 24 bits so float never rounds up to 1
+		return static_cast<real>(bits >> 8) * static_cast<real>(1.0 / 16777216.0);
+	}
+
+	uint32_t spp;
+	uint32_t pixel = 0;
+	uint32_t index = 0;
+	uint32_t dimension = 0;
+	rng g;
+};
+
+// uniform random numbers, what every other sampler converges like at worst
+class independent_sampler : public sampler
+{
+public:
+	explicit independent_sampler(int samples_per_pixel = 1) : sampler(samples_per_pixel) {}
+
+	real get_1d() override
+	{
+		dimension++;
+		return g.uniform();
+	}
+
+	sample2 get_2d() override
+	{
+		dimension += 2;
+		real u = g.uniform();
+		return { u, g.uniform() };
+	}
+};
+
+// jittered strata, one sample each, strata of a dimension visited in a shuffled order per pixel
+// so dimensions do not line up with each other
+class stratified_sampler : public sampler
+{
+public:
+	explicit stratified_sampler(int samples_per_pixel) : sampler(samples_per_pixel)
+	{
+		// near square grid covering spp
+		nx = std::max(static_cast<uint32_t>(std::sqrt(static_cast<double>(spp))), 1u);
+		ny = (spp + nx - 1) / nx;
+	}
+
+	real get_1d() override
+	{
+		uint32_t stratum = permute(index % spp, spp, seed(dimension++));
+		return std::min((stratum + g.uniform()) / spp, one_minus_epsilon());
+	}
+
+	sample2 get_2d() override
+	{
+		uint32_t stratum = permute(index % (nx * ny), nx * ny, seed(dimension));
+		dimension += 2;
+		real u = std::min((stratum % nx + g.uniform()) / nx, one_minus_epsilon());
+		real v = std::min((stratum / nx + g.uniform()) / ny, one_minus_epsilon());
+		return { u, v };
+	}
+
+private:
+	uint32_t nx, ny;
+};
+
+// radical inverse in the n-th prime for dimension n, digits Owen scrambled per pixel
+// unscrambled high bases are nearly linear in sample index at low counts and line up across dimensions
+// large bases correlate badly anyway and deep bounces matter little, dimensions past the table are independent
+// See pbrt 3rd edition, 7.4 The Halton Sampler
+class halton_sampler : public sampler
+{
+public:
+	explicit halton_sampler(int samples_per_pixel) : sampler(samples_per_pixel) {}
+
+	real get_1d() override
+	{
+		return sample(dimension++);
+	}
+
+	sample2 get_2d() override
+	{
+		real u = sample(dimension++);
+		return { u, sample(dimension++) };
+	}
+
+	// each digit permuted by a hash of the digits before it
+	// digits past what count samples need would all be scrambled zeros, a random tail is the same in distribution
+	static real scrambled_radical_inverse(uint32_t base, uint32_t i, uint32_t seed, uint32_t count)
+	{
+		double inv_base = 1.0 / base;
+		double weight = 1;
+		double result = 0;
+		uint64_t prefix = seed;
+		while (i > 0 || weight * count > 1)
+		{
+			uint32_t digit = i % base;
+			i /= base;
+			weight *= inv_base;
+			result += permute(digit, base, static_cast<uint32_t>(rng::mix(prefix))) * weight;
+			prefix = prefix * base + digit;
+		}
+		result += weight * to_unit(static_cast<uint32_t>(rng::mix(prefix ^ 0x5bd1e995u)));
+		return std::min(static_cast<real>(result), one_minus_epsilon());
+	}
+
+private:
+	real sample(uint32_t d)
+	{
+		static const uint32_t primes[] =
+		{
+			2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+			59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+		};
+
+		if (d >= sizeof(primes) / sizeof(primes[0]))
+			return g.uniform();
+
+		return scrambled_radical_inverse(primes[d], index, seed(d), spp);
+	}
+};
+
+// first two Sobol dimensions per pair of dimensions, each pair with its own Owen scrambling
+// and its own shuffle of sample index (padding), so pairs are decorrelated without a direction number table
+// best with power of two samples per pixel
+// See Burley, "Practical Hash-based Owen Scrambling", JCGT 2020
+class sobol_sampler : public sampler
+{
+public:
+	explicit sobol_sampler(int samples_per_pixel) : sampler(samples_per_pixel) {}
+
+	real get_1d() override
+	{
+		uint32_t s = seed(dimension++);
+		uint32_t i = nested_uniform_scramble(index, s);
+		return to_unit(nested_uniform_scramble(sobol(i, 0), hash(s, 0)));
+	}
+
+	sample2 get_2d() override
+	{
+		uint32_t s = seed(dimension);
+		dimension += 2;
+		uint32_t i = nested_uniform_scramble(index, s);
+		return { to_unit(nested_uniform_scramble(sobol(i, 0), hash(s, 0))), to_unit(nested_uniform_scramble(sobol(i, 1), hash(s, 1))) };
+	}
+
+	// dimension 0 is van der Corput, dimension 1 has direction numbers of x + 1 (Pascal matrix mod 2)
+	static uint32_t sobol(uint32_t i, int d)
+	{
+		if (d == 0)
+			return reverse_bits(i);
+
+		uint32_t result = 0;
+		uint32_t v = 1u << 31;
+		for (; i != 0; i >>= 1)
+		{
+			if (i & 1)
+				result ^= v;
+			v ^= v >> 1;
+		}
+		return result;
+	}
+
+	static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+	{
+		return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+	}
+
+private:
+	// Owen scrambling of bit reversed x, a higher bit only depends on lower ones
+	static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+	{
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+
+	static uint32_t reverse_bits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+		x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	static uint32_t hash(uint32_t seed, uint32_t i)
+	{
+		return static_cast<uint32_t>(rng::mix((static_cast<uint64_t>(seed) << 32) | i));
+	}
+};
+
+// pixels darker than this are judged on absolute error, otherwise a near black pixel never converges
+const real adaptive_black_level = 1e-3f;
+
+// running mean and variance of each channel of one pixel, adaptive sampling stops it on relative_error()
+// See Welford, "Note on a Method for Calculating Corrected Sums of Squares and Products", 1962
+struct pixel_estimate
+{
+	void add(const vec3& c)
+	{
+		sum += c;
+		count++;
+
+		vec3 delta = c - mean;
+		mean += delta / static_cast<real>(count);
+		m2 += delta * (c - mean);
+	}
+
+	// standard error of the mean over the mean, of the worst channel
+	// per channel as a tinted caustic or a rare refraction through colored glass barely moves luminance
+	real relative_error() const
+	{
+		if (count < 2)
+			return std::numeric_limits<real>::max();
+
+		real error = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			real variance = m2[i] / (count - 1);
+			error = std::max(error, sqrt(variance / count) / std::max(mean[i], adaptive_black_level));
+		}
+		return error;
+	}
+
+	vec3 sum = vec3(0, 0, 0);
+	int count = 0;
+	vec3 mean = vec3(0, 0, 0);
+	vec3 m2 = vec3(0, 0, 0);
+};
@@ -5,13 +5,15 @@
 
 struct movement_none
 {
-	vec3 center(const vec3& center0, double time) const
+	vec3 center(const vec3& center0, real time) const
 	{
 		return center0;
 	}
 
-	bool bounding_box(const vec3& center0, double radius, double t0, double t1, aabb& box) const
+	bool bounding_box(const vec3& center0, real radius, real t0, real t1, aabb& box) const
 	{
+		// radius can be negative for hollow glass sphere
+		radius = fabs(radius);
 		box = aabb(center0 - vec3(radius, radius, radius), center0 + vec3(radius, radius, radius));
 		return true;
 	}
@@ -19,22 +21,26 @@ struct movement_none
 
 struct movement_linear
 {
-	vec3 center(const vec3& center0, double time) const
+	vec3 center(const vec3& center0, real time) const
 	{
 		return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 	}
 
-	bool bounding_box(const vec3& center0, double radius, double t0, double t1, aabb& box) const
+	// over [t0, t1], box at one moment when t0 == t1
+	bool bounding_box(const vec3& center0, real radius, real t0, real t1, aabb& box) const
 	{
-		auto box0 = aabb(center0 - vec3(radius, radius, radius), center0 + vec3(radius, radius, radius));
-		auto box1 = aabb(center1 - vec3(radius, radius, radius), center1 + vec3(radius, radius, radius));
+		radius = fabs(radius);
+		vec3 c0 = center(center0, t0);
+		vec3 c1 = center(center0, t1);
+		auto box0 = aabb(c0 - vec3(radius, radius, radius), c0 + vec3(radius, radius, radius));
+		auto box1 = aabb(c1 - vec3(radius, radius, radius), c1 + vec3(radius, radius, radius));
 		box = aabb::surrounding(box0, box1);
 		return true;
 	}
 
 	vec3 center1;
-	double time0;
-	double time1;
+	real time0;
+	real time1;
 };
 
 template<typename movement_type>
@@ -42,26 +48,27 @@ class sphere_base : public hittable
 {
 public:
 	sphere_base() : center(0, 0, 0), radius(0), mat(nullptr) {}
-	sphere_base(vec3 cen, double r, std::shared_ptr<material> m) : center(cen), radius(r), mat(m) {}
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	sphere_base(vec3 cen, real r, std::shared_ptr<material> m) : center(cen), radius(r), mat(m) {}
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
 	{
 		vec3 currentCenter = movement.center(center, r.time());
 		vec3 oc = r.origin() - currentCenter;
-		double a = dot(r.direction(), r.direction());
-		double b = dot(oc, r.direction());
-		double c = dot(oc, oc) - radius * radius;
-		double discriminant = b * b - a * c;
+		real a = dot(r.direction(), r.direction());
+		real b = dot(oc, r.direction());
+
+		// b * b - a * c cancels badly in float for big or far spheres (ground of radius 1000)
+		// same value from the distance between center and ray instead
+		// See Haines et al., "Precision Improvements for Ray/Sphere Intersection", Ray Tracing Gems 2019
+		vec3 l = oc - (b / a) * r.direction();
+		real discriminant = a * (radius * radius - dot(l, l));
 		if (discriminant > 0)
 		{
-			double temp = (-b - sqrt(discriminant)) / a;
+			real temp = (-b - sqrt(discriminant)) / a;
 			if (temp < t_max && temp > t_min)
 			{
 				// hit on near point
 				rec.t = temp;
-				rec.p = r.point_at_parameter(rec.t);
-				rec.normal = (rec.p - currentCenter) / radius;
-				get_sphere_uv(rec.normal, rec.u, rec.v);
-				rec.mat_ptr = mat.get();
+				rec.object = this;
 				return true;
 			}
 			temp = (-b + sqrt(discriminant)) / a;
@@ -69,10 +76,7 @@ public:
 			{
 				// hit on far point
 				rec.t = temp;
-				rec.p = r.point_at_parameter(rec.t);
-				rec.normal = (rec.p - currentCenter) / radius;
-				get_sphere_uv(rec.normal, rec.u, rec.v);
-				rec.mat_ptr = mat.get();
+				rec.object = this;
 				return true;
 			}
 		}
@@ -80,49 +84,62 @@ public:
 		return false;
 	}
 
-	bool bounding_box(double t0, double t1, aabb& box) const override
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		rec.p = r.point_at_parameter(rec.t);
+		rec.normal = (rec.p - movement.center(center, r.time())) / radius;
+		rec.mat_ptr = mat.get();
+
+		// atan2 and asin only when a texture reads them
+		if (mat != nullptr && mat->uses_uv())
+			get_sphere_uv(rec.normal, rec.u, rec.v);
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
 	{
 		return movement.bounding_box(center, radius, t0, t1, box);
 	}
 
-	virtual double pdf_value(const vec3& o, const vec3& v) const override
+	virtual real pdf_value(const vec3& o, const vec3& v) const override
 	{
-		hit_record rec;
 		// ensure hit if direction is right by letting 0.001 < FLT_MAX < +inf
-		if (!this->hit(ray(o, v, FLT_MAX), 0.001, std::numeric_limits<double>::infinity(), rec))
+		if (!this->occluded(ray(o, v, FLT_MAX), 0.001, std::numeric_limits<real>::infinity()))
 			return 0.0;
 
-		double cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
-		double solid_angle = 2.0 * M_PI * (1.0 - cos_theta_max);
+		real cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
+		real solid_angle = 2.0 * M_PI * (1.0 - cos_theta_max);
 
 		return 1.0 / solid_angle;
 	}
 
-	virtual vec3 random(const vec3& o) const override
+	virtual vec3 random(const vec3& o, sampler& g) const override
 	{
 		vec3 direction = center - o;
-		double distance_squared = direction.length_squared();
+		real distance_squared = direction.length_squared();
 		onb uvw;
 		uvw.build_from_w(direction);
-		return uvw.local(random_to_sphere(radius, distance_squared));
+		return uvw.local(random_to_sphere(g, radius, distance_squared));
 	}
 	
+	real area() const override { return real(4 * M_PI) * radius * radius; }
+	const material* surface_material() const override { return mat.get(); }
+
 	void set_movement(const movement_type& m)
 	{
 		movement = m;
 	}
 
-	static void get_sphere_uv(const vec3& p, double& u, double& v)
+	static void get_sphere_uv(const vec3& p, real& u, real& v)
 	{
-		double phi = atan2(p.z, p.x);
-		double theta = asin(p.y);
+		real phi = atan2(p.z, p.x);
+		real theta = asin(p.y);
 
-		u = double(1 - (phi + M_PI) / (2 * M_PI));
-		v = double((theta + M_PI / 2) / M_PI);
+		u = real(1 - (phi + M_PI) / (2 * M_PI));
+		v = real((theta + M_PI / 2) / M_PI);
 	}
 	
 	vec3 center;
-	double radius;
+	real radius;
 	std::shared_ptr<material> mat;
 	movement_type movement;
 };
@@ -0,0 +1,122 @@
+#pragma once
+
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include "math.h"
+
+#include "vec3.h"
+#include "sampler.h"
+
+// Rectangle as seen from a point, sampled uniformly in the solid angle it subtends
+// Directions are then as dense near the rectangle as far from it, and do not bunch up
+// at grazing angles as points uniform by area do. pdf is 1 / solid angle, no ray to trace.
+// Tiny or nearly hemispherical solid angles lose too much in float, those fall back to area.
+// See Urena et al., "An Area-Preserving Parametrization for Spherical Rectangles", EGSR 2013
+// and pbrt-v4 6.5.4 for the thresholds
+class spherical_rectangle
+{
+public:
+	// rectangle is corner + s * ex + t * ey for s, t in [0, 1], ex and ey perpendicular
+	spherical_rectangle(const vec3& origin, const vec3& corner, const vec3& ex, const vec3& ey) :
+		o(origin), corner(corner), ex(ex), ey(ey)
+	{
+		real ex_length = ex.length();
+		real ey_length = ey.length();
+		area = ex_length * ey_length;
+
+		// local frame with the rectangle at z = z0 < 0
+		x = ex / ex_length;
+		y = ey / ey_length;
+		z = cross(x, y);
+		vec3 d = corner - origin;
+		x0 = dot(d, x);
+		y0 = dot(d, y);
+		z0 = dot(d, z);
+		if (z0 > 0)
+		{
+			z0 = -z0;
+			z = -z;
+		}
+		x1 = x0 + ex_length;
+		y1 = y0 + ey_length;
+
+		solid_angle = 0;
+		if (z0 == 0) // in the plane, edge on
+			return;
+
+		// normals of the planes through origin and each edge, then interior angles between them
+		vec3 n0 = normalize(vec3(0, z0, -y0));
+		vec3 n1 = normalize(vec3(-z0, 0, x1));
+		vec3 n2 = normalize(vec3(0, -z0, y1));
+		vec3 n3 = normalize(vec3(z0, 0, -x0));
+		real g0 = acos(clamp(-dot(n0, n1)));
+		real g1 = acos(clamp(-dot(n1, n2)));
+		real g2 = acos(clamp(-dot(n2, n3)));
+		real g3 = acos(clamp(-dot(n3, n0)));
+
+		b0 = n0.z;
+		b1 = n2.z;
+		k = real(2 * M_PI) - g2 - g3;
+		solid_angle = g0 + g1 - k;
+	}
+
+	// point on the rectangle
+	vec3 sample(const sample2& s) const
+	{
+		if (by_area())
+			return corner + s.u * ex + s.v * ey;
+
+		// x from the solid angle left of it, u of the total
+		real au = s.u * solid_angle + k;
+		real sin_au = sin(au);
+		real fu = sin_au != 0 ? (cos(au) * b0 - b1) / sin_au : real(0);
+		real cu = clamp((fu > 0 ? 1 : -1) / sqrt(fu * fu + b0 * b0));
+		real xu = std::min(std::max(-(cu * z0) / std::max(sqrt(1 - cu * cu), real(1e-7)), x0), x1);
+
+		// y uniform in the sine of elevation along that column
+		real d = sqrt(xu * xu + z0 * z0);
+		real h0 = y0 / sqrt(d * d + y0 * y0);
+		real h1 = y1 / sqrt(d * d + y1 * y1);
+		real hv = h0 + s.v * (h1 - h0);
+		real hv2 = hv * hv;
+		real yv = hv2 < 1 - 1e-6f ? hv * d / sqrt(1 - hv2) : y1;
+		yv = std::min(std::max(yv, y0), y1);
+
+		return o + xu * x + yv * y + z0 * z;
+	}
+
+	// solid angle density of direction v from origin, 0 if it misses the rectangle
+	real pdf(const vec3& v) const
+	{
+		real vz = dot(v, z);
+		if (vz >= 0 || z0 == 0)
+			return 0;
+
+		real t = z0 / vz;
+		real px = t * dot(v, x);
+		real py = t * dot(v, y);
+		if (px < x0 || px > x1 || py < y0 || py > y1)
+			return 0;
+
+		if (by_area())
+		{
+			real distance_squared = t * t * v.length_squared();
+			real cosine = -vz / v.length();
+			return distance_squared / (cosine * area);
+		}
+		return 1 / solid_angle;
+	}
+
+private:
+	bool by_area() const { return solid_angle < real(3e-4) || solid_angle > real(6.22); }
+
+	static real clamp(real c) { return std::min(std::max(c, real(-1)), real(1)); }
+
+	vec3 o, corner, ex, ey;
+	vec3 x, y, z;
+	real x0, x1, y0, y1, z0;
+	real b0, b1, k;
+	real solid_angle;
+	real area;
+};
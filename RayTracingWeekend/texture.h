@@ -10,7 +10,9 @@
 class texture
 {
 public:
-	virtual vec3 value(double u, double v, const vec3& p) const = 0;
+	virtual vec3 value(real u, real v, const vec3& p) const = 0;
+	// false if value() ignores u, v, so hits can skip computing them
+	virtual bool uses_uv() const { return false; }
 };
 
 class constant_texture : public texture
@@ -18,7 +20,7 @@ class constant_texture : public texture
 public:
 	constant_texture() {}
 	constant_texture(vec3 c) : color(c) {}
-	vec3 value(double u, double v, const vec3& p) const override
+	vec3 value(real u, real v, const vec3& p) const override
 	{
 		return color;
 	}
@@ -32,9 +34,9 @@ public:
 	checker_texture() {}
 	checker_texture(std::shared_ptr<texture>& t0, std::shared_ptr<texture>& t1) : odd(t1), even(t0) {}
 
-	vec3 value(double u, double v, const vec3& p) const override
+	vec3 value(real u, real v, const vec3& p) const override
 	{
-		double sines = std::sin(10.0 * p.x) * std::sin(10.0 * p.y) * std::sin(10.0 * p.z);
+		real sines = std::sin(10.0 * p.x) * std::sin(10.0 * p.y) * std::sin(10.0 * p.z);
 		if (sines < 0)
 		{
 			return odd->value(u, v, p);
@@ -45,6 +47,8 @@ public:
 		}
 	}
 
+	bool uses_uv() const override { return odd->uses_uv() || even->uses_uv(); }
+
 	std::shared_ptr<texture> odd;
 	std::shared_ptr<texture> even;
 };
@@ -53,8 +57,8 @@ class noise_texture : public texture
 {
 public:
 	noise_texture() : scale(5.f) {}
-	noise_texture(double sc) : scale(sc) {}
-	vec3 value(double u, double v, const vec3& p) const override
+	noise_texture(real sc) : scale(sc) {}
+	vec3 value(real u, real v, const vec3& p) const override
 	{
 		// static std::uniform_real<double> uniform;
 		// static std::minstd_rand engine;
@@ -67,7 +71,7 @@ public:
 		return vec3(1, 1, 1) * 0.5f * (1 + sin(scale * p.z + 10 * noise.turb(p)));
 	}
 	perlin noise;
-	double scale;
+	real scale;
 };
 
 class image_texture : public texture
@@ -78,7 +82,7 @@ public:
 
 	image_texture() {}
 	image_texture(std::shared_ptr<byte_array> pixels, int A, int B) : data(pixels), nx(A), ny(B) {}
-	vec3 value(double u, double v, const vec3& p) const override
+	vec3 value(real u, real v, const vec3& p) const override
 	{
 		int i = (int)(u * nx);
 		int j = (int)((1 - v) * ny - 0.001f); // ?
@@ -86,14 +90,37 @@ public:
 		i = clamp(i, 0, nx - 1);
 		j = clamp(j, 0, ny - 1);
 
-		double r = int((*data)[3 * i + 3 * nx * j]) / 255.0;
-		double g = int((*data)[3 * i + 3 * nx * j + 1]) / 255.0;
-		double b = int((*data)[3 * i + 3 * nx * j + 2]) / 255.0;
+		real r = int((*data)[3 * i + 3 * nx * j]) / 255.0;
+		real g = int((*data)[3 * i + 3 * nx * j + 1]) / 255.0;
+		real b = int((*data)[3 * i + 3 * nx * j + 2]) / 255.0;
 
 		return vec3(r, g, b);
 	}
 
+	bool uses_uv() const override { return true; }
+
 	std::shared_ptr<byte_array> data;
 	int nx;
 	int ny;
-};
\ No newline at end of file
+};
+
+// linear radiance per pixel, unbounded, as read from an HDR image
+// rows from the top as image_texture, nearest pixel so a piecewise constant pdf over pixels matches it exactly
+class hdr_texture : public texture
+{
+public:
+	hdr_texture() {}
+	hdr_texture(std::shared_ptr<std::vector<vec3>> pixels, int A, int B) : data(pixels), nx(A), ny(B) {}
+	vec3 value(real u, real v, const vec3& p) const override
+	{
+		int i = clamp(static_cast<int>(u * nx), 0, nx - 1);
+		int j = clamp(static_cast<int>((1 - v) * ny), 0, ny - 1);
+		return (*data)[i + nx * j];
+	}
+
+	bool uses_uv() const override { return true; }
+
+	std::shared_ptr<std::vector<vec3>> data;
+	int nx;
+	int ny;
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include <cmath>
+
+#include "vec3.h"
+#include "aabb.h"
+
+// affine transform, 3x4 row major with implicit last row (0, 0, 0, 1)
+// inverse is kept alongside so neither direction needs to solve anything at hit time
+class transform
+{
+public:
+	transform()
+	{
+		set_identity(m);
+		set_identity(m_inv);
+	}
+
+	// any invertible affine matrix, rotation about any axis, shear, mirror
+	// inverse of the linear part from its cofactors, translation then undone by it
+	explicit transform(const real matrix[3][4])
+	{
+		std::copy(&matrix[0][0], &matrix[0][0] + 12, &m[0][0]);
+
+		real inv_det = 1 / determinant();
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				// cofactor of m[j][i], indices cycled so no sign is needed
+				int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+				int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+				m_inv[i][j] = (m[j1][i1] * m[j2][i2] - m[j1][i2] * m[j2][i1]) * inv_det;
+			}
+		}
+		for (int i = 0; i < 3; i++)
+			m_inv[i][3] = -(m_inv[i][0] * m[0][3] + m_inv[i][1] * m[1][3] + m_inv[i][2] * m[2][3]);
+	}
+
+	static transform translation(const vec3& offset)
+	{
+		transform t;
+		for (int i = 0; i < 3; i++)
+		{
+			t.m[i][3] = offset[i];
+			t.m_inv[i][3] = -offset[i];
+		}
+		return t;
+	}
+
+	// angle in degree, same direction as rotate_y
+	static transform rotation_y(real angle)
+	{
+		real radians = ((real)M_PI / 180.0) * angle;
+		real sin_theta = sin(radians);
+		real cos_theta = cos(radians);
+
+		transform t;
+		t.m[0][0] = cos_theta;	t.m[0][2] = sin_theta;
+		t.m[2][0] = -sin_theta;	t.m[2][2] = cos_theta;
+
+		// rotation is orthogonal, inverse is transpose
+		t.m_inv[0][0] = cos_theta;	t.m_inv[0][2] = -sin_theta;
+		t.m_inv[2][0] = sin_theta;	t.m_inv[2][2] = cos_theta;
+		return t;
+	}
+
+	// angle in degree about a unit axis, rotation_y for axis y
+	// See Rodrigues' rotation formula
+	static transform rotation(const vec3& axis, real angle)
+	{
+		real radians = ((real)M_PI / 180.0) * angle;
+		real sin_theta = sin(radians);
+		real cos_theta = cos(radians);
+
+		transform t;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				// cos I + sin [axis]x + (1 - cos) axis axis^T
+				int k = 3 - i - j;
+				real cross_term = i == j ? real(0) : ((j - i + 3) % 3 == 1 ? -axis[k] : axis[k]);
+				t.m[i][j] = (i == j ? cos_theta : real(0)) + sin_theta * cross_term + (1 - cos_theta) * axis[i] * axis[j];
+				t.m_inv[j][i] = t.m[i][j];
+			}
+		}
+		return t;
+	}
+
+	static transform scaling(const vec3& scale)
+	{
+		transform t;
+		for (int i = 0; i < 3; i++)
+		{
+			t.m[i][i] = scale[i];
+			t.m_inv[i][i] = 1.0 / scale[i];
+		}
+		return t;
+	}
+
+	// apply rhs first, then this
+	transform operator*(const transform& rhs) const
+	{
+		transform t;
+		multiply(m, rhs.m, t.m);
+		multiply(rhs.m_inv, m_inv, t.m_inv);
+		return t;
+	}
+
+	transform inverse() const
+	{
+		transform t;
+		std::copy(&m_inv[0][0], &m_inv[0][0] + 12, &t.m[0][0]);
+		std::copy(&m[0][0], &m[0][0] + 12, &t.m_inv[0][0]);
+		return t;
+	}
+
+	vec3 point(const vec3& p) const
+	{
+		return vec3(
+			m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+			m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+			m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+			m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+			m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+
+	vec3 inverse_point(const vec3& p) const
+	{
+		return vec3(
+			m_inv[0][0] * p.x + m_inv[0][1] * p.y + m_inv[0][2] * p.z + m_inv[0][3],
+			m_inv[1][0] * p.x + m_inv[1][1] * p.y + m_inv[1][2] * p.z + m_inv[1][3],
+			m_inv[2][0] * p.x + m_inv[2][1] * p.y + m_inv[2][2] * p.z + m_inv[2][3]);
+	}
+
+	vec3 inverse_vector(const vec3& v) const
+	{
+		return vec3(
+			m_inv[0][0] * v.x + m_inv[0][1] * v.y + m_inv[0][2] * v.z,
+			m_inv[1][0] * v.x + m_inv[1][1] * v.y + m_inv[1][2] * v.z,
+			m_inv[2][0] * v.x + m_inv[2][1] * v.y + m_inv[2][2] * v.z);
+	}
+
+	// normal goes with inverse transpose, not normalized
+	vec3 normal(const vec3& n) const
+	{
+		return vec3(
+			m_inv[0][0] * n.x + m_inv[1][0] * n.y + m_inv[2][0] * n.z,
+			m_inv[0][1] * n.x + m_inv[1][1] * n.y + m_inv[2][1] * n.z,
+			m_inv[0][2] * n.x + m_inv[1][2] * n.y + m_inv[2][2] * n.z);
+	}
+
+	// of the linear part, volume scale
+	real determinant() const
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+	// rotation and uniform scale, perhaps a mirror, so angles are kept
+	bool is_similarity() const
+	{
+		vec3 x(m[0][0], m[1][0], m[2][0]);
+		vec3 y(m[0][1], m[1][1], m[2][1]);
+		vec3 z(m[0][2], m[1][2], m[2][2]);
+		real scale_squared = x.length_squared();
+		real tolerance = 1e-4f * scale_squared;
+		return fabs(y.length_squared() - scale_squared) <= tolerance && fabs(z.length_squared() - scale_squared) <= tolerance
+			&& fabs(dot(x, y)) <= tolerance && fabs(dot(y, z)) <= tolerance && fabs(dot(z, x)) <= tolerance;
+	}
+
+	// Arvo, "Transforming Axis-Aligned Bounding Boxes", Graphics Gems 1990
+	aabb box(const aabb& b) const
+	{
+		vec3 min, max;
+		for (int i = 0; i < 3; i++)
+		{
+			min[i] = max[i] = m[i][3];
+			for (int j = 0; j < 3; j++)
+			{
+				real a = m[i][j] * b.min()[j];
+				real c = m[i][j] * b.max()[j];
+				min[i] += std::min(a, c);
+				max[i] += std::max(a, c);
+			}
+		}
+		return aabb(min, max);
+	}
+
+	real m[3][4];
+	real m_inv[3][4];
+
+private:
+	static void set_identity(real out[3][4])
+	{
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 4; j++)
+				out[i][j] = i == j ? 1.0 : 0.0;
+	}
+
+	static void multiply(const real a[3][4], const real b[3][4], real out[3][4])
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+				if (j == 3)
+					out[i][j] += a[i][3];
+			}
+		}
+	}
+};
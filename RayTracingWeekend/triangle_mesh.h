@@ -0,0 +1,611 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hittable.h"
+#include "material.h"
+#include "bvh.h"
+
+// ray prepared for watertight triangle test
+// See Woop, Benthin, Wald, "Watertight Ray/Triangle Intersection", JCGT 2013
+//
+// Vertices are translated to ray origin and sheared so that ray goes along +z,
+// then edge functions are evaluated in 2D. Edges shared by two triangles give exactly
+// opposite values, so a ray never slips through the crack between them.
+struct watertight_ray
+{
+	watertight_ray(const ray& r)
+	{
+		origin = r.origin();
+		vec3 direction = r.direction();
+
+		// dominant axis as z, keep winding
+		kz = fabs(direction.x) > fabs(direction.y) ? (fabs(direction.x) > fabs(direction.z) ? 0 : 2) : (fabs(direction.y) > fabs(direction.z) ? 1 : 2);
+		kx = kz == 2 ? 0 : kz + 1;
+		ky = kx == 2 ? 0 : kx + 1;
+		if (direction[kz] < 0.0)
+			std::swap(kx, ky);
+
+		shear_x = direction[kx] / direction[kz];
+		shear_y = direction[ky] / direction[kz];
+		shear_z = 1.0 / direction[kz];
+	}
+
+	vec3 origin;
+	int kx, ky, kz;
+	real shear_x, shear_y, shear_z;
+};
+
+// indexed triangles in one hittable
+// Vertex attributes are stored per component (SoA), triangles only keep 3 indices,
+// so a mesh costs a few arrays and its own bvh instead of one hittable per triangle.
+class triangle_mesh : public hittable
+{
+public:
+	triangle_mesh() {}
+
+	// call build() after filling attributes and indices
+	triangle_mesh(std::shared_ptr<material> mat, int width = 2) : mp(mat), width(width) {}
+
+	size_t vertex_count() const { return position[0].size(); }
+	size_t triangle_count() const { return indices.size() / 3; }
+
+	void add_vertex(const vec3& p)
+	{
+		for (int axis = 0; axis < 3; axis++)
+			position[axis].push_back(static_cast<float>(p[axis]));
+	}
+
+	void add_triangle(uint32_t i0, uint32_t i1, uint32_t i2)
+	{
+		indices.push_back(i0);
+		indices.push_back(i1);
+		indices.push_back(i2);
+	}
+
+	vec3 vertex(uint32_t index) const { return vec3(position[0][index], position[1][index], position[2][index]); }
+	bool has_normal() const { return !normal[0].empty(); }
+	bool has_uv() const { return !uv[0].empty(); }
+
+	// build bvh over triangles, reorders indices to leaf order
+	void build()
+	{
+		std::vector<aabb> boxes(triangle_count());
+		concurrency::parallel_for(size_t(0), boxes.size(), [&](size_t i)
+		{
+			vec3 v0 = vertex(indices[3 * i + 0]);
+			vec3 v1 = vertex(indices[3 * i + 1]);
+			vec3 v2 = vertex(indices[3 * i + 2]);
+			boxes[i] = aabb(
+				vec3(std::min(std::min(v0.x, v1.x), v2.x), std::min(std::min(v0.y, v1.y), v2.y), std::min(std::min(v0.z, v1.z), v2.z)),
+				vec3(std::max(std::max(v0.x, v1.x), v2.x), std::max(std::max(v0.y, v1.y), v2.y), std::max(std::max(v0.z, v1.z), v2.z)));
+		});
+
+		std::vector<uint32_t> order = tree.build(boxes);
+
+		std::vector<uint32_t> sorted(indices.size());
+		concurrency::parallel_for(size_t(0), order.size(), [&](size_t i)
+		{
+			for (int k = 0; k < 3; k++)
+				sorted[3 * i + k] = indices[3 * order[i] + k];
+		});
+		indices.swap(sorted);
+
+		if (width == 4)
+			tree4.build(tree);
+		else if (width == 8)
+			tree8.build(tree);
+	}
+
+	// returns t in (t_min, t_max) and barycentrics of v1 and v2
+	bool intersect_triangle(const watertight_ray& r, uint32_t triangle, real t_min, real t_max, real& t, real& b1, real& b2) const
+	{
+		vec3 a = vertex(indices[3 * triangle + 0]) - r.origin;
+		vec3 b = vertex(indices[3 * triangle + 1]) - r.origin;
+		vec3 c = vertex(indices[3 * triangle + 2]) - r.origin;
+
+		real ax = a[r.kx] - r.shear_x * a[r.kz];
+		real ay = a[r.ky] - r.shear_y * a[r.kz];
+		real bx = b[r.kx] - r.shear_x * b[r.kz];
+		real by = b[r.ky] - r.shear_y * b[r.kz];
+		real cx = c[r.kx] - r.shear_x * c[r.kz];
+		real cy = c[r.ky] - r.shear_y * c[r.kz];
+
+		// scaled barycentrics
+		real u = cx * by - cy * bx;
+		real v = ax * cy - ay * cx;
+		real w = bx * ay - by * ax;
+
+		// on an edge in float, products may have rounded away the sign, decide again in double
+		if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0))
+		{
+			u = static_cast<real>((double)cx * by - (double)cy * bx);
+			v = static_cast<real>((double)ax * cy - (double)ay * cx);
+			w = static_cast<real>((double)bx * ay - (double)by * ax);
+		}
+
+		// both sides
+		if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+			return false;
+
+		real det = u + v + w;
+		if (det == 0.0)
+			return false;
+
+		real az = r.shear_z * a[r.kz];
+		real bz = r.shear_z * b[r.kz];
+		real cz = r.shear_z * c[r.kz];
+		real inv_det = 1.0 / det;
+		t = (u * az + v * bz + w * cz) * inv_det;
+		if (!(t > t_min && t < t_max))
+			return false;
+
+		b1 = v * inv_det;
+		b2 = w * inv_det;
+		return true;
+	}
+
+	// records triangle and barycentrics of the closest one
+	bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override
+	{
+		watertight_ray wr(r);
+
+		uint32_t closest = 0;
+		real closest_b1 = 0.0;
+		real closest_b2 = 0.0;
+		auto leaf = [&](uint32_t first, uint32_t count, real& closest_so_far)
+		{
+			bool hit_leaf = false;
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				real t, b1, b2;
+				if (intersect_triangle(wr, i, t_min, closest_so_far, t, b1, b2))
+				{
+					hit_leaf = true;
+					closest_so_far = t;
+					closest = i;
+					closest_b1 = b1;
+					closest_b2 = b2;
+				}
+			}
+			return hit_leaf;
+		};
+
+		bool hit_tree;
+		switch (width)
+		{
+		case 4:
+			hit_tree = tree4.traverse(r, t_min, t_max, leaf);
+			break;
+		case 8:
+			hit_tree = tree8.traverse(r, t_min, t_max, leaf);
+			break;
+		default:
+			hit_tree = tree.traverse(r, t_min, t_max, leaf);
+			break;
+		}
+		if (!hit_tree)
+			return false;
+
+		rec.t = t_max;
+		rec.object = this;
+		rec.primitive = closest;
+		rec.b1 = closest_b1;
+		rec.b2 = closest_b2;
+		return true;
+	}
+
+	void surface(const ray& r, hit_record& rec) const override
+	{
+		uint32_t i0 = indices[3 * rec.primitive + 0];
+		uint32_t i1 = indices[3 * rec.primitive + 1];
+		uint32_t i2 = indices[3 * rec.primitive + 2];
+		real b0 = 1.0 - rec.b1 - rec.b2;
+
+		rec.p = r.point_at_parameter(rec.t);
+		rec.mat_ptr = mp.get();
+
+		// counter-clockwise is front, interpolated normal if any
+		vec3 n(0.0);
+		if (has_normal())
+		{
+			vec3 n0(normal[0][i0], normal[1][i0], normal[2][i0]);
+			vec3 n1(normal[0][i1], normal[1][i1], normal[2][i1]);
+			vec3 n2(normal[0][i2], normal[1][i2], normal[2][i2]);
+			n = b0 * n0 + rec.b1 * n1 + rec.b2 * n2;
+		}
+		if (n.length_squared() == 0.0)
+		{
+			vec3 v0 = vertex(i0);
+			n = cross(vertex(i1) - v0, vertex(i2) - v0);
+		}
+		rec.normal = normalize(n);
+
+		// barycentrics as uv when mesh has none
+		if (has_uv() && (mp == nullptr || mp->uses_uv()))
+		{
+			rec.u = b0 * uv[0][i0] + rec.b1 * uv[0][i1] + rec.b2 * uv[0][i2];
+			rec.v = b0 * uv[1][i0] + rec.b1 * uv[1][i1] + rec.b2 * uv[1][i2];
+		}
+		else
+		{
+			rec.u = rec.b1;
+			rec.v = rec.b2;
+		}
+	}
+
+	bool occluded(const ray& r, real t_min, real t_max) const override
+	{
+		watertight_ray wr(r);
+		auto leaf = [&](uint32_t first, uint32_t count, real& leaf_t_max)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				real t, b1, b2;
+				if (intersect_triangle(wr, i, t_min, leaf_t_max, t, b1, b2))
+					return true;
+			}
+			return false;
+		};
+
+		switch (width)
+		{
+		case 4: return tree4.traverse<true>(r, t_min, t_max, leaf);
+		case 8: return tree8.traverse<true>(r, t_min, t_max, leaf);
+		default: return tree.traverse<true>(r, t_min, t_max, leaf);
+		}
+	}
+
+	bool bounding_box(real t0, real t1, aabb& box) const override
+	{
+		if (tree.nodes.empty())
+			return false;
+
+		box = tree.bounds();
+		return true;
+	}
+
+	// Wavefront OBJ, v/vt/vn and polygon faces, materials are ignored
+	// returns nullptr if file can not be read
+	static std::shared_ptr<triangle_mesh> load_obj(const std::string& path, std::shared_ptr<material> mat, int width = 2)
+	{
+		std::ifstream file(path);
+		if (!file)
+			return nullptr;
+
+		std::vector<float> file_position[3], file_normal[3], file_uv[2];
+		auto mesh = std::make_shared<triangle_mesh>(mat, width);
+
+		// OBJ indexes attributes separately, one mesh vertex per unique v/vt/vn
+		struct corner
+		{
+			uint32_t position, uv, normal;
+			bool operator==(const corner& other) const { return position == other.position && uv == other.uv && normal == other.normal; }
+		};
+		struct corner_hash
+		{
+			size_t operator()(const corner& c) const
+			{
+				// odd multiplier per step, then high bits folded down, as the map keeps low bits
+				uint64_t h = c.position;
+				h = h * 0x9e3779b97f4a7c15ull + c.uv;
+				h = h * 0x9e3779b97f4a7c15ull + c.normal;
+				h ^= h >> 32;
+				return static_cast<size_t>(h * 0xd6e8feb86659fd93ull >> 16);
+			}
+		};
+		std::unordered_map<corner, uint32_t, corner_hash> vertex_map;
+		std::vector<uint32_t> polygon;
+		bool with_uv = false, with_normal = false;
+
+		// 1-based, negative counts from end, 0 for missing
+		auto resolve = [](long index, size_t count) -> uint32_t
+		{
+			if (index > 0)
+				return static_cast<uint32_t>(index);
+			if (index < 0)
+				return static_cast<uint32_t>(static_cast<long>(count) + index + 1);
+			return 0;
+		};
+
+		std::string line;
+		while (std::getline(file, line))
+		{
+			const char* s = line.c_str();
+			while (*s == ' ' || *s == '\t')
+				s++;
+
+			if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+			{
+				char* end = const_cast<char*>(s + 2);
+				for (int axis = 0; axis < 3; axis++)
+					file_position[axis].push_back(std::strtof(end, &end));
+			}
+			else if (s[0] == 'v' && s[1] == 'n')
+			{
+				char* end = const_cast<char*>(s + 2);
+				for (int axis = 0; axis < 3; axis++)
+					file_normal[axis].push_back(std::strtof(end, &end));
+			}
+			else if (s[0] == 'v' && s[1] == 't')
+			{
+				char* end = const_cast<char*>(s + 2);
+				for (int axis = 0; axis < 2; axis++)
+					file_uv[axis].push_back(std::strtof(end, &end));
+			}
+			else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+			{
+				polygon.clear();
+				s++;
+				while (true)
+				{
+					char* end;
+					long v = std::strtol(s, &end, 10);
+					if (end == s)
+						break;
+					s = end;
+
+					long vt = 0, vn = 0;
+					if (*s == '/')
+					{
+						s++;
+						if (*s != '/')
+						{
+							vt = std::strtol(s, &end, 10);
+							s = end;
+						}
+						if (*s == '/')
+						{
+							vn = std::strtol(s + 1, &end, 10);
+							s = end;
+						}
+					}
+
+					uint32_t position_index = resolve(v, file_position[0].size());
+					uint32_t uv_index = resolve(vt, file_uv[0].size());
+					uint32_t normal_index = resolve(vn, file_normal[0].size());
+					if (position_index == 0 || position_index > file_position[0].size())
+						return nullptr;
+					with_uv |= uv_index != 0;
+					with_normal |= normal_index != 0;
+
+					corner key = { position_index, uv_index, normal_index };
+					auto found = vertex_map.find(key);
+					if (found != vertex_map.end())
+					{
+						polygon.push_back(found->second);
+						continue;
+					}
+
+					uint32_t index = static_cast<uint32_t>(mesh->vertex_count());
+					for (int axis = 0; axis < 3; axis++)
+						mesh->position[axis].push_back(file_position[axis][position_index - 1]);
+					for (int axis = 0; axis < 3; axis++)
+						mesh->normal[axis].push_back(normal_index != 0 && normal_index <= file_normal[0].size() ? file_normal[axis][normal_index - 1] : 0.0f);
+					for (int axis = 0; axis < 2; axis++)
+						mesh->uv[axis].push_back(uv_index != 0 && uv_index <= file_uv[0].size() ? file_uv[axis][uv_index - 1] : 0.0f);
+					vertex_map.emplace(key, index);
+					polygon.push_back(index);
+				}
+
+				// fan
+				for (size_t k = 2; k < polygon.size(); k++)
+					mesh->add_triangle(polygon[0], polygon[k - 1], polygon[k]);
+			}
+		}
+
+		if (!with_normal)
+			for (auto& component : mesh->normal)
+				component.clear();
+		if (!with_uv)
+			for (auto& component : mesh->uv)
+				component.clear();
+
+		mesh->build();
+		return mesh;
+	}
+
+	// binary PLY (either endian), vertex x/y/z, optional nx/ny/nz and u/v (or s/t), face as vertex index list
+	// returns nullptr if file can not be read or is ascii
+	static std::shared_ptr<triangle_mesh> load_ply(const std::string& path, std::shared_ptr<material> mat, int width = 2)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return nullptr;
+
+		struct property
+		{
+			std::string name;
+			int size = 0;			// scalar or list item
+			bool is_float = false;
+			bool is_signed = false;
+			int list_count_size = 0;	// list only
+		};
+		struct element
+		{
+			std::string name;
+			size_t count = 0;
+			std::vector<property> properties;
+		};
+
+		auto type_info = [](const std::string& type, property& p)
+		{
+			if (type == "char" || type == "int8") { p.size = 1; p.is_signed = true; }
+			else if (type == "uchar" || type == "uint8") { p.size = 1; }
+			else if (type == "short" || type == "int16") { p.size = 2; p.is_signed = true; }
+			else if (type == "ushort" || type == "uint16") { p.size = 2; }
+			else if (type == "int" || type == "int32") { p.size = 4; p.is_signed = true; }
+			else if (type == "uint" || type == "uint32") { p.size = 4; }
+			else if (type == "float" || type == "float32") { p.size = 4; p.is_float = true; }
+			else if (type == "double" || type == "float64") { p.size = 8; p.is_float = true; }
+			return p.size != 0;
+		};
+
+		std::vector<element> elements;
+		bool big_endian = false;
+		std::string line;
+		if (!std::getline(file, line) || line.compare(0, 3, "ply") != 0)
+			return nullptr;
+		while (std::getline(file, line))
+		{
+			std::istringstream words(line);
+			std::string keyword;
+			words >> keyword;
+			if (keyword == "format")
+			{
+				std::string format;
+				words >> format;
+				if (format == "binary_big_endian")
+					big_endian = true;
+				else if (format != "binary_little_endian")
+					return nullptr;
+			}
+			else if (keyword == "element")
+			{
+				element e;
+				words >> e.name >> e.count;
+				elements.push_back(e);
+			}
+			else if (keyword == "property" && !elements.empty())
+			{
+				property p;
+				std::string type;
+				words >> type;
+				if (type == "list")
+				{
+					std::string count_type, item_type;
+					words >> count_type >> item_type;
+					property count_property;
+					if (!type_info(count_type, count_property) || !type_info(item_type, p))
+						return nullptr;
+					p.list_count_size = count_property.size;
+				}
+				else if (!type_info(type, p))
+				{
+					return nullptr;
+				}
+				words >> p.name;
+				elements.back().properties.push_back(p);
+			}
+			else if (keyword == "end_header")
+			{
+				break;
+			}
+		}
+
+		auto read = [&](int size, bool is_float, bool is_signed) -> double
+		{
+			unsigned char bytes[8];
+			file.read(reinterpret_cast<char*>(bytes), size);
+			if (big_endian)
+				std::reverse(bytes, bytes + size);
+
+			if (is_float)
+			{
+				if (size == 4) { float f; std::memcpy(&f, bytes, 4); return f; }
+				double d; std::memcpy(&d, bytes, 8); return d;
+			}
+			uint64_t value = 0;
+			std::memcpy(&value, bytes, size);
+			if (is_signed && (bytes[size - 1] & 0x80) && size < 8)
+				return static_cast<double>(static_cast<int64_t>(value | (~uint64_t(0) << (8 * size))));
+			return static_cast<double>(value);
+		};
+
+		auto mesh = std::make_shared<triangle_mesh>(mat, width);
+		std::vector<uint32_t> polygon;
+		for (const element& e : elements)
+		{
+			bool is_vertex = e.name == "vertex";
+			bool is_face = e.name == "face";
+
+			// map property to attribute slot
+			std::vector<float*> slots(e.properties.size(), nullptr);
+			float values[8] = {};
+			bool with_normal = false, with_uv = false;
+			if (is_vertex)
+			{
+				for (size_t k = 0; k < e.properties.size(); k++)
+				{
+					const std::string& name = e.properties[k].name;
+					const char* names[8] = { "x", "y", "z", "nx", "ny", "nz", "u", "v" };
+					for (int slot = 0; slot < 8; slot++)
+					{
+						if (name == names[slot] || (slot == 6 && (name == "s" || name == "texture_u")) || (slot == 7 && (name == "t" || name == "texture_v")))
+						{
+							slots[k] = &values[slot];
+							with_normal |= slot >= 3 && slot < 6;
+							with_uv |= slot >= 6;
+						}
+					}
+				}
+			}
+
+			for (size_t item = 0; item < e.count; item++)
+			{
+				for (size_t k = 0; k < e.properties.size(); k++)
+				{
+					const property& p = e.properties[k];
+					if (p.list_count_size != 0)
+					{
+						size_t count = static_cast<size_t>(read(p.list_count_size, false, false));
+						polygon.clear();
+						for (size_t n = 0; n < count; n++)
+							polygon.push_back(static_cast<uint32_t>(read(p.size, p.is_float, p.is_signed)));
+
+						if (is_face && (p.name == "vertex_indices" || p.name == "vertex_index"))
+							for (size_t n = 2; n < polygon.size(); n++)
+								mesh->add_triangle(polygon[0], polygon[n - 1], polygon[n]);
+					}
+					else
+					{
+						double value = read(p.size, p.is_float, p.is_signed);
+						if (slots[k] != nullptr)
+							*slots[k] = static_cast<float>(value);
+					}
+				}
+
+				if (is_vertex)
+				{
+					for (int axis = 0; axis < 3; axis++)
+						mesh->position[axis].push_back(values[axis]);
+					if (with_normal)
+						for (int axis = 0; axis < 3; axis++)
+							mesh->normal[axis].push_back(values[3 + axis]);
+					if (with_uv)
+						for (int axis = 0; axis < 2; axis++)
+							mesh->uv[axis].push_back(values[6 + axis]);
+				}
+
+				if (!file)
+					return nullptr;
+			}
+		}
+
+		for (uint32_t index : mesh->indices)
+			if (index >= mesh->vertex_count())
+				return nullptr;
+
+		mesh->build();
+		return mesh;
+	}
+
+	std::vector<float> position[3];
+	std::vector<float> normal[3];	// empty if not provided
+	std::vector<float> uv[2];		// empty if not provided
+	std::vector<uint32_t> indices;	// 3 per triangle, in leaf order after build()
+	std::shared_ptr<material> mp;
+
+	int width = 2;
+	bvh_tree tree;
+	bvh_wide_tree<4> tree4;
+	bvh_wide_tree<8> tree8;
+};
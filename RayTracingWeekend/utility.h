@@ -2,81 +2,82 @@
 
 #include <random>
 #include "vec3.h"
+#include "sampler.h"
 
-void get_sphere_uv(const vec3& p, double& u, double& v)
+void get_sphere_uv(const vec3& p, real& u, real& v)
 {
-	double phi = atan2(p.z, p.x);
-	double theta = asin(p.y);
+	real phi = atan2(p.z, p.x);
+	real theta = asin(p.y);
 	u = 1 - (phi + M_PI) / (2.0 * M_PI);
 	v = (theta + M_PI / 2) / M_PI;
 }
 
-double random_double(double a = 0.0, double b = 1.0)
-{
-	static std::uniform_real_distribution<double> uniform;
-	static std::minstd_rand engine;
-
-	return a + (b - a) * uniform(engine);
-}
+// all draws come from the sampler of the path being traced, see sampler
+// fixed number of dimensions each, no rejection loop, so dimensions stay aligned between samples
 
-int random_int(int a, int b)
+inline real random_double(sampler& g, real a = 0.0, real b = 1.0)
 {
-	return a + std::min(b - a, (int)((b - a + 1) * random_double()));
+	return a + (b - a) * g.get_1d();
 }
 
-inline vec3 random_in_unit_sphere()
+inline int random_int(sampler& g, int a, int b)
 {
-	vec3 p = { 0, 0, 0 };
-	do {
-		vec3 random_vector(random_double(), random_double(), random_double());
-		p = 2.0 * random_vector - vec3(1, 1, 1); // -1 ~ 1 box
-	} while (dot(p, p) >= 1.0); // unit sphere
-	return p;
+	return std::min(a + static_cast<int>(g.get_1d() * (b - a + 1)), b);
 }
 
-inline vec3 random_unit_vector()
+inline vec3 random_unit_vector(sampler& g)
 {
-	auto a = random_double() * 2.0 * M_PI;
-	auto z = random_double() * 2.0 - 1.0;
+	sample2 s = g.get_2d();
+	auto a = s.u * 2.0 * M_PI;
+	auto z = s.v * 2.0 - 1.0;
 	auto r = sqrt(1 - z * z);
 	return vec3(r * cos(a), r * sin(a), z);
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal)
+inline vec3 random_in_unit_sphere(sampler& g)
+{
+	// uniform in volume, radius by inverse of r^3 cdf
+	vec3 direction = random_unit_vector(g);
+	return direction * std::cbrt(g.get_1d());
+}
+
+inline vec3 random_in_hemisphere(sampler& g, const vec3& normal)
 {
-	vec3 in_unit_sphere = random_in_unit_sphere();
+	vec3 in_unit_sphere = random_in_unit_sphere(g);
 	if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
 		return in_unit_sphere;
 	else
 		return -in_unit_sphere;
 }
 
-inline vec3 random_cosine_direction()
+inline vec3 random_cosine_direction(sampler& g)
 {
 	// see book3.chapter7.2
 
-	double r1 = random_double();
-	double r2 = random_double();
-	double z = sqrt(1 - r2);
+	sample2 s = g.get_2d();
+	real r1 = s.u;
+	real r2 = s.v;
+	real z = sqrt(1 - r2);
 
-	double phi = 2 * M_PI * r1;
-	double x = cos(phi) * sqrt(r2);
-	double y = sin(phi) * sqrt(r2);
+	real phi = 2 * M_PI * r1;
+	real x = cos(phi) * sqrt(r2);
+	real y = sin(phi) * sqrt(r2);
 	
 	return vec3(x, y, z);
 }
 
-inline vec3 random_to_sphere(double radius, double distance_squared) 
+inline vec3 random_to_sphere(sampler& g, real radius, real distance_squared) 
 {
 	// see book3.chapter12.3
 
-	double r1 = random_double();
-	double r2 = random_double();
-	double z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+	sample2 s = g.get_2d();
+	real r1 = s.u;
+	real r2 = s.v;
+	real z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
 
-	double phi = 2 * M_PI * r1;
-	double x = cos(phi) * sqrt(1 - z * z);
-	double y = sin(phi) * sqrt(1 - z * z);
+	real phi = 2 * M_PI * r1;
+	real x = cos(phi) * sqrt(1 - z * z);
+	real y = sin(phi) * sqrt(1 - z * z);
 
 	return vec3(x, y, z);
 }
\ No newline at end of file
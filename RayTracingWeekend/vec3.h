@@ -6,65 +6,155 @@
 #include <cstdlib>
 #include <algorithm>
 
-class vec3
+#if defined(__AVX__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#define VEC3_SIMD
+#endif
+
+// scalar of geometry and shading
+// float by default, define RTW_DOUBLE to render a double precision reference
+#ifdef RTW_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
+
+template <typename T>
+class vec3_t
 {
 public:
-	vec3() { x = 0; y = 0; z = 0; } // initialize it in case...
+	typedef T scalar;
+
+	vec3_t() { x = 0; y = 0; z = 0; } // initialize it in case...
+
+	// scalar -> vec3 convesion
+	vec3_t(T t) { x = t; y = t; z = t; }
+
+	vec3_t(T e0, T e1, T e2) { x = e0; y = e1; z = e2; }
 
-	// double -> vec3 convesion
-	vec3(double t) { x = t; y = t; z = t; }
+	// between precisions, explicit so that mixing them is never silent
+	template <typename U>
+	explicit vec3_t(const vec3_t<U>& v) { x = static_cast<T>(v.x); y = static_cast<T>(v.y); z = static_cast<T>(v.z); }
 
-	vec3(double e0, double e1, double e2) { x = e0; y = e1; z = e2; }
+	inline const vec3_t& operator+() const { return *this; }
+	inline vec3_t operator-() const { return vec3_t(-x, -y, -z); }
+	inline T operator[](int i) const { return e[i]; }
+	inline T& operator[](int i) { return e[i]; }
 
-	inline const vec3& operator+() const { return *this; }
-	inline vec3 operator-() const { return vec3(-x, -y, -z); }
-	inline double operator[](int i) const { return e[i]; }
-	inline double& operator[](int i) { return e[i]; }
+	inline vec3_t& operator+=(const vec3_t& v2) { x += v2.x; y += v2.y; z += v2.z; return *this; }
+	inline vec3_t& operator-=(const vec3_t& v2) { x -= v2.x; y -= v2.y; z -= v2.z; return *this; }
+	inline vec3_t& operator*=(const vec3_t& v2) { x *= v2.x; y *= v2.y; z *= v2.z; return *this; }
+	inline vec3_t& operator/=(const vec3_t& v2) { x /= v2.x; y /= v2.y; z /= v2.z; return *this; }
+	inline vec3_t& operator*=(const T t) { x *= t; y *= t; z *= t; return *this; }
+	inline vec3_t& operator/=(const T t) { x /= t; y /= t; z /= t; return *this; }
 
-	inline vec3& operator+=(const vec3& v2) { x += v2.x; y += v2.y; z += v2.z; return *this; }
-	inline vec3& operator-=(const vec3& v2) { x -= v2.x; y -= v2.y; z -= v2.z; return *this; }
-	inline vec3& operator*=(const vec3& v2) { x *= v2.x; y *= v2.y; z *= v2.z; return *this; }
-	inline vec3& operator/=(const vec3& v2) { x /= v2.x; y /= v2.y; z /= v2.z; return *this; }
-	inline vec3& operator*=(const double t) { x *= t; y *= t; z *= t; return *this; }
-	inline vec3& operator/=(const double t) { x /= t; y /= t; z /= t; return *this; }
+	inline T length_squared() const { return x * x + y * y + z * z; }
+	inline T length() const { return std::sqrt(length_squared()); }
+	inline void make_unit_vector() { *this /= length(); }
 
-	inline double length_squared() const { return x * x + y * y + z * z; }
-	inline double length() const { return std::sqrt(length_squared()); }
-	inline void make_unit_vector();
+	// friends are found through the vector operand, so scalar operands still convert as before
+	friend inline vec3_t operator+(const vec3_t& v1, const vec3_t& v2) { vec3_t copy = v1; copy += v2; return copy; }
+	friend inline vec3_t operator-(const vec3_t& v1, const vec3_t& v2) { vec3_t copy = v1; copy -= v2; return copy; }
+	friend inline vec3_t operator*(const vec3_t& v1, const vec3_t& v2) { vec3_t copy = v1; copy *= v2; return copy; }
+	friend inline vec3_t operator/(const vec3_t& v1, const vec3_t& v2) { vec3_t copy = v1; copy /= v2; return copy; }
+
+	friend inline bool operator==(const vec3_t& v1, const vec3_t& v2) { return v1.x == v2.x && v1.y == v2.y && v1.z == v2.z; }
+	friend inline bool operator!=(const vec3_t& v1, const vec3_t& v2) { return !(v1 == v2); }
+
+	friend inline T dot(const vec3_t& v1, const vec3_t& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z; }
+
+	friend inline vec3_t cross(const vec3_t& v1, const vec3_t& v2)
+	{
+		return vec3_t((v1.y * v2.z - v1.z * v2.y),
+					(-(v1.x * v2.z - v1.z * v2.x)),
+					(v1.x * v2.y - v1.y * v2.x));
+	}
+
+	friend inline vec3_t normalize(const vec3_t& v) { return v / v.length(); }
 
 	union
 	{
 		struct
 		{
-			union { double x; double r; };
-			union { double y; double g; };
-			union { double z; double b; };
+			union { T x; T r; };
+			union { T y; T g; };
+			union { T z; T b; };
 		};
-		double e[3];
+		T e[3];
 	};
 };
 
-inline vec3 operator+(const vec3& v1, const vec3& v2) { vec3 copy = v1; copy += v2; return copy; }
-inline vec3 operator-(const vec3& v1, const vec3& v2) { vec3 copy = v1; copy -= v2; return copy; }
-inline vec3 operator*(const vec3& v1, const vec3& v2) { vec3 copy = v1; copy *= v2; return copy; }
-inline vec3 operator/(const vec3& v1, const vec3& v2) { vec3 copy = v1; copy /= v2; return copy; }
+#ifdef VEC3_SIMD
+// float vec3 lives in one SSE register, the 4th lane is padding and kept at 0
+// one instruction per operator instead of three, dot product via dpps
+template <>
+class vec3_t<float>
+{
+public:
+	typedef float scalar;
 
-inline double dot(const vec3& v1, const vec3& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z; }
+	vec3_t() : m(_mm_setzero_ps()) {}
+	vec3_t(float t) : m(_mm_set_ps(0.0f, t, t, t)) {}
+	vec3_t(float e0, float e1, float e2) : m(_mm_set_ps(0.0f, e2, e1, e0)) {}
+	explicit vec3_t(__m128 v) : m(v) {}
 
-inline vec3 cross(const vec3& v1, const vec3& v2)
-{
-	return vec3((v1.y * v2.z - v1.z * v2.y),
-				(-(v1.x * v2.z - v1.z * v2.x)),
-				(v1.x * v2.y - v1.y * v2.x));
-}
+	template <typename U>
+	explicit vec3_t(const vec3_t<U>& v) : m(_mm_set_ps(0.0f, static_cast<float>(v.z), static_cast<float>(v.y), static_cast<float>(v.x))) {}
 
-inline vec3 normalize(const vec3& v)
-{
-	vec3 copy = v;
-	double length = copy.length();
-	copy /= length;
-	return copy;
-}
+	inline const vec3_t& operator+() const { return *this; }
+	inline vec3_t operator-() const { return vec3_t(_mm_sub_ps(_mm_setzero_ps(), m)); }
+	inline float operator[](int i) const { return e[i]; }
+	inline float& operator[](int i) { return e[i]; }
+
+	inline vec3_t& operator+=(const vec3_t& v2) { m = _mm_add_ps(m, v2.m); return *this; }
+	inline vec3_t& operator-=(const vec3_t& v2) { m = _mm_sub_ps(m, v2.m); return *this; }
+	inline vec3_t& operator*=(const vec3_t& v2) { m = _mm_mul_ps(m, v2.m); return *this; }
+	// 0 / 0 in the padding lane, blend it back to 0
+	inline vec3_t& operator/=(const vec3_t& v2) { m = _mm_blend_ps(_mm_div_ps(m, v2.m), _mm_setzero_ps(), 0x8); return *this; }
+	inline vec3_t& operator*=(const float t) { m = _mm_mul_ps(m, _mm_set1_ps(t)); return *this; }
+	inline vec3_t& operator/=(const float t) { m = _mm_div_ps(m, _mm_set1_ps(t)); return *this; }
+
+	inline float length_squared() const { return _mm_cvtss_f32(_mm_dp_ps(m, m, 0x71)); }
+	inline float length() const { return _mm_cvtss_f32(_mm_sqrt_ss(_mm_dp_ps(m, m, 0x71))); }
+	inline void make_unit_vector() { *this /= length(); }
+
+	friend inline vec3_t operator+(const vec3_t& v1, const vec3_t& v2) { return vec3_t(_mm_add_ps(v1.m, v2.m)); }
+	friend inline vec3_t operator-(const vec3_t& v1, const vec3_t& v2) { return vec3_t(_mm_sub_ps(v1.m, v2.m)); }
+	friend inline vec3_t operator*(const vec3_t& v1, const vec3_t& v2) { return vec3_t(_mm_mul_ps(v1.m, v2.m)); }
+	friend inline vec3_t operator/(const vec3_t& v1, const vec3_t& v2) { vec3_t copy = v1; copy /= v2; return copy; }
+
+	friend inline bool operator==(const vec3_t& v1, const vec3_t& v2) { return (_mm_movemask_ps(_mm_cmpeq_ps(v1.m, v2.m)) & 0x7) == 0x7; }
+	friend inline bool operator!=(const vec3_t& v1, const vec3_t& v2) { return !(v1 == v2); }
+
+	friend inline float dot(const vec3_t& v1, const vec3_t& v2) { return _mm_cvtss_f32(_mm_dp_ps(v1.m, v2.m, 0x71)); }
+
+	friend inline vec3_t cross(const vec3_t& v1, const vec3_t& v2)
+	{
+		// yzx * zxy - zxy * yzx, padding stays 0 * 0 - 0 * 0
+		__m128 a_yzx = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 b_yzx = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 c = _mm_sub_ps(_mm_mul_ps(v1.m, b_yzx), _mm_mul_ps(a_yzx, v2.m));
+		return vec3_t(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+	}
+
+	friend inline vec3_t normalize(const vec3_t& v) { return vec3_t(_mm_div_ps(v.m, _mm_sqrt_ps(_mm_dp_ps(v.m, v.m, 0x7F)))); }
+
+	union
+	{
+		__m128 m;
+		struct
+		{
+			union { float x; float r; };
+			union { float y; float g; };
+			union { float z; float b; };
+			float w;
+		};
+		float e[4];
+	};
+};
+#endif
+
+typedef vec3_t<real> vec3;
 
 template <typename T>
 inline T clamp(const T& x, const T& min, const T& max)
@@ -81,12 +171,13 @@ inline vec3 clamp(const vec3& v, const vec3& min, const vec3& max)
 	return r;
 }
 
-inline vec3 lerp(vec3 from, vec3 to, double t)
+inline vec3 lerp(vec3 from, vec3 to, real t)
 {
-	return (1.0 - t) * to + t * from;
+	return (1 - t) * to + t * from;
 }
 
-inline void vec3::make_unit_vector()
+// Rec. 709 weights
+inline real luminance(const vec3& c)
 {
-	*this = normalize(*this);
+	return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
 }
\ No newline at end of file